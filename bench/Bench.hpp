@@ -0,0 +1,191 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+/** \file Bench.hpp
+ * Harness dei benchmark
+ * Ogni benchmark è una funzione che, data la dimensione dell'input, prepara
+ * i dati e restituisce il corpo da misurare. Il corpo viene eseguito per
+ * ogni combinazione di dimensione e numero di thread: prima alcune
+ * esecuzioni di warmup, poi le ripetizioni misurate. Ogni numero di thread
+ * corrisponde ad un WorkStealingPool, installato con ExecutorScope.
+ * I risultati sono stampati in JSON o CSV.
+ *
+ * Opzioni da riga di comando:
+ *   --sizes=1000,100000   dimensioni dell'input
+ *   --threads=1,2,4       concorrenza dell'esecutore
+ *   --repeats=10          ripetizioni misurate
+ *   --warmup=2            esecuzioni non misurate
+ *   --format=json|csv     formato dell'output (default json)
+ *   --filter=insert       solo i benchmark il cui nome contiene la stringa
+ */
+
+#include "fpar.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fpar {
+namespace bench {
+
+  /*! \class Case
+   *  \brief Benchmark registrato: setup(n) prepara l'input di dimensione n e
+   *         restituisce il corpo da misurare
+   */
+  struct Case {
+    std::string name;
+    std::function<std::function<void()>(size_t)> setup;
+  };
+
+  inline std::vector<Case>& registry () {
+    static std::vector<Case> cases;
+    return cases;
+  }
+
+  /*! \brief Registra un benchmark */
+  inline void add (std::string name, std::function<std::function<void()>(size_t)> setup) {
+    registry().push_back({std::move(name), std::move(setup)});
+  }
+
+  // impedisce al compilatore di eliminare il calcolo di un risultato
+  template <typename T>
+  inline void keep (const T& x) {
+    asm volatile("" : : "g"(&x) : "memory");
+  }
+
+  struct Options {
+    std::vector<size_t> sizes{1000, 100000};
+    std::vector<size_t> threads;
+    size_t repeats = 10;
+    size_t warmup = 2;
+    std::string format = "json";
+    std::string filter;
+  };
+
+  struct Result {
+    std::string name;
+    size_t size;
+    size_t threads;
+    std::vector<double> ns; // tempo di ogni ripetizione
+  };
+
+  namespace detail {
+    inline std::vector<size_t> parse_list (const std::string& s) {
+      std::vector<size_t> res;
+      size_t pos = 0;
+      while (pos < s.size()) {
+        auto next = s.find(',', pos);
+        if (next == std::string::npos) next = s.size();
+        res.push_back(std::stoul(s.substr(pos, next - pos)));
+        pos = next + 1;
+      }
+      return res;
+    }
+
+    inline double percentile (std::vector<double> v, double p) {
+      std::sort(v.begin(), v.end());
+      return v[static_cast<size_t>(p * (v.size() - 1) + 0.5)];
+    }
+
+    inline double mean (const std::vector<double>& v) {
+      double s = 0;
+      for (auto x : v) s += x;
+      return s / v.size();
+    }
+
+    inline double stddev (const std::vector<double>& v) {
+      auto m = mean(v);
+      double s = 0;
+      for (auto x : v) s += (x - m) * (x - m);
+      return v.size() > 1 ? std::sqrt(s / (v.size() - 1)) : 0.0;
+    }
+  }
+
+  inline Options parse (int argc, char const *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      auto eq = arg.find('=');
+      auto key = arg.substr(0, eq);
+      auto val = (eq == std::string::npos) ? std::string() : arg.substr(eq + 1);
+      if (key == "--sizes") opt.sizes = detail::parse_list(val);
+      else if (key == "--threads") opt.threads = detail::parse_list(val);
+      else if (key == "--repeats") opt.repeats = std::stoul(val);
+      else if (key == "--warmup") opt.warmup = std::stoul(val);
+      else if (key == "--format") opt.format = val;
+      else if (key == "--filter") opt.filter = val;
+      else {
+        std::cerr << "unknown option " << arg << std::endl;
+        std::exit(1);
+      }
+    }
+    if (opt.threads.empty()) opt.threads = {1, std::max<size_t>(1, std::thread::hardware_concurrency())};
+    if (opt.repeats == 0) opt.repeats = 1;
+    return opt;
+  }
+
+  inline std::vector<Result> run (const Options& opt) {
+    using clock = std::chrono::steady_clock;
+    std::vector<Result> results;
+    for (auto t : opt.threads) {
+      WorkStealingPool pool(t);
+      ExecutorScope scope(pool);
+      for (const auto& c : registry()) {
+        if (c.name.find(opt.filter) == std::string::npos) continue;
+        for (auto n : opt.sizes) {
+          auto body = c.setup(n);
+          for (size_t i = 0; i < opt.warmup; i++) body();
+          Result r{c.name, n, t, {}};
+          for (size_t i = 0; i < opt.repeats; i++) {
+            auto start = clock::now();
+            body();
+            auto stop = clock::now();
+            r.ns.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+          }
+          results.push_back(std::move(r));
+        }
+      }
+    }
+    return results;
+  }
+
+  inline void print (const std::vector<Result>& results, const std::string& format, std::ostream& out) {
+    if (format == "csv") {
+      out << "name,size,threads,repeats,min_ns,median_ns,mean_ns,stddev_ns\n";
+      for (const auto& r : results) {
+        out << r.name << ',' << r.size << ',' << r.threads << ',' << r.ns.size() << ','
+            << detail::percentile(r.ns, 0) << ',' << detail::percentile(r.ns, 0.5) << ','
+            << detail::mean(r.ns) << ',' << detail::stddev(r.ns) << '\n';
+      }
+      return;
+    }
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      const auto& r = results[i];
+      out << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size
+          << ", \"threads\": " << r.threads << ", \"repeats\": " << r.ns.size()
+          << ", \"min_ns\": " << detail::percentile(r.ns, 0)
+          << ", \"median_ns\": " << detail::percentile(r.ns, 0.5)
+          << ", \"mean_ns\": " << detail::mean(r.ns)
+          << ", \"stddev_ns\": " << detail::stddev(r.ns) << "}"
+          << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+  }
+
+  /*! \brief Punto di ingresso di un programma di benchmark */
+  inline int main (int argc, char const *argv[]) {
+    auto opt = parse(argc, argv);
+    print(run(opt), opt.format, std::cout);
+    return 0;
+  }
+}
+}
+
+#endif
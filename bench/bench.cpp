@@ -0,0 +1,188 @@
+#include "Bench.hpp"
+#include "Serialize.hpp"
+
+#include <cmath>
+#include <string>
+
+using namespace fpar;
+
+using Number = Object<int, double>;
+
+namespace {
+
+  // <0, 1, ..., N-1> come sequenza di box
+  Number boxed (size_t n) {
+    auto v = Sequence<Number>().transient();
+    for (size_t i = 0; i < n; i++) v.push_back(Number((int)(i % 1000)));
+    return Number(std::move(v).persistent());
+  }
+
+  Number packed (size_t n) {
+    return dense<int>(boxed(n));
+  }
+
+  // matrice quadrata con circa N elementi
+  Number matrix (size_t n, bool is_dense) {
+    auto side = std::max<size_t>(1, (size_t)std::sqrt((double)n));
+    auto v = Sequence<Number>().transient();
+    for (size_t i = 0; i < side; i++) {
+      v.push_back(is_dense ? packed(side) : boxed(side));
+    }
+    return Number(std::move(v).persistent());
+  }
+
+  Number pair (const Number& a, const Number& b) {
+    return Number::pair(a, b);
+  }
+
+  inline Number inc (const Number& x) {
+    return (int)x + 1;
+  }
+
+  inline Number is_even (const Number& x) {
+    return (int)x % 2 == 0;
+  }
+
+  inline Number select1 (const Number& x) {
+    return select<Number>(1)(x);
+  }
+
+  template <bool par>
+  inline Number IP (const Number& x) {
+    return (insert<par>(add_op<int, Number>, Number(0), associative) *
+              (apply_to_all<par, Number>(mul_op<int, Number>) * trans<Number>))(x);
+  }
+
+  template <bool par>
+  inline Number select2AndTrans (const Number& x) {
+    return trans<par>(select<Number>(2)(x));
+  }
+
+  template <bool par>
+  inline Number MM (const Number& x) {
+    auto aIP = [](const Number& y) { return apply_to_all<par, Number>(IP<par>)(y); };
+    return (apply_to_all<par, Number>(aIP) *
+              (apply_to_all<par, Number>(distl<par, Number>) *
+                (distr<par, Number> *
+                  construct<par, Number>({select1, select2AndTrans<par>}))))(x);
+  }
+
+  // registra f, applicata all'input costruito da make, come benchmark "name"
+  template <typename M, typename F>
+  void unary (const std::string& name, M make, F f) {
+    bench::add(name, [=](size_t n) -> std::function<void()> {
+      auto in = make(n);
+      return [=]{ bench::keep(f(in)); };
+    });
+  }
+
+  // registra le versioni seq e par di un funzionale
+  template <typename M, typename F>
+  void both (const std::string& name, M make, F f) {
+    unary(name + "/seq", make, f(std::integral_constant<bool, seq_exec>()));
+    unary(name + "/par", make, f(std::integral_constant<bool, par_exec>()));
+  }
+
+  void functionals () {
+    auto vec = [](size_t n) { return boxed(n); };
+    auto dvec = [](size_t n) { return packed(n); };
+    auto vpair = [](size_t n) { return pair(boxed(n), boxed(n)); };
+    auto dpair = [](size_t n) { return pair(packed(n), packed(n)); };
+    auto lpair = [](size_t n) { return pair(Number(7), boxed(n)); };
+    auto rpair = [](size_t n) { return pair(boxed(n), Number(7)); };
+    auto mat = [](size_t n) { return matrix(n, false); };
+    auto dmat = [](size_t n) { return matrix(n, true); };
+    auto mats = [](size_t n) {
+      auto m = matrix(std::min<size_t>(n, 10000), false);
+      return pair(m, m);
+    };
+
+    both("apply_to_all", vec, [](auto p) { return apply_to_all<decltype(p)::value, Number>(inc); });
+    both("apply_to_all_dense", dvec, [](auto p) { return apply_to_all<decltype(p)::value, Number>(inc); });
+    both("insert", vec, [](auto p) { return insert<decltype(p)::value>(add_op<int, Number>, Number(0)); });
+    both("insert_assoc", vec, [](auto p) {
+      return insert<decltype(p)::value>(add_op<int, Number>, Number(0), associative);
+    });
+    both("insert_comm", vec, [](auto p) {
+      return insert<decltype(p)::value>(add_op<int, Number>, Number(0), commutative);
+    });
+    both("insert_dense", dvec, [](auto p) {
+      return insert<decltype(p)::value>(add_op<int, Number>, Number(0), associative);
+    });
+    both("zip", vpair, [](auto p) { return zip<decltype(p)::value, Number>(add_op<int, Number>); });
+    both("zip_dense", dpair, [](auto p) { return zip<decltype(p)::value, Number>(add_op<int, Number>); });
+    both("construct", vec, [](auto p) {
+      using fn = Number (*)(const Number&);
+      return construct<decltype(p)::value, Number, fn>({length<Number>, reverse<Number>,
+                                                         tail<Number>, rotl<Number>});
+    });
+    both("condition", vec, [](auto p) {
+      return condition<decltype(p)::value, Number>(null<Number>, reverse<Number>, tail<Number>);
+    });
+    both("distl", lpair, [](auto p) { return distl<decltype(p)::value, Number>; });
+    both("distr", rpair, [](auto p) { return distr<decltype(p)::value, Number>; });
+    both("trans", mat, [](auto p) { return trans<decltype(p)::value, Number>; });
+    both("trans_dense", dmat, [](auto p) { return trans<decltype(p)::value, Number>; });
+    both("inner_product", vpair, [](auto p) { return IP<decltype(p)::value>; });
+    both("inner_product_dense", dpair, [](auto p) { return IP<decltype(p)::value>; });
+    both("matrix_mul", mats, [](auto p) { return MM<decltype(p)::value>; });
+    both("memoize_hit", vec, [](auto p) {
+      return memoize<Number>(apply_to_all<decltype(p)::value, Number>(inc));
+    });
+    unary("while_form", [](size_t n) { return Number((int)n); },
+          while_form<Number>(is_even, [](const Number& x) -> Number { return (int)x / 2; }));
+  }
+
+  // caricamento di matrici da immagini binarie (vedi Serialize.hpp)
+  void serialization () {
+    auto image = [](bool is_dense) {
+      return [=](size_t n) { return serial::dump(matrix(n, is_dense)); };
+    };
+    auto parse = [](const std::string& bytes) { return serial::parse<Number>(bytes); };
+    unary("serial_parse", image(false), parse);
+    unary("serial_parse_dense", image(true), parse);
+    unary("serial_dump_dense", [](size_t n) { return matrix(n, true); },
+          [](const Number& x) { return serial::dump(x); });
+  }
+
+  void primitives () {
+    auto vec = [](size_t n) { return boxed(n); };
+    auto dvec = [](size_t n) { return packed(n); };
+    auto vpair = [](size_t n) { return pair(boxed(n), boxed(n)); };
+    auto atoms = [](size_t) { return pair(Number(3), Number(4)); };
+    auto bools = [](size_t) { return pair(Number(true), Number(false)); };
+    auto apl = [](size_t n) { return pair(Number(7), boxed(n)); };
+    auto apr = [](size_t n) { return pair(boxed(n), Number(7)); };
+
+    unary("select", vec, select<Number>(1));
+    unary("tail", vec, tail<Number>);
+    unary("tail_dense", dvec, tail<Number>);
+    unary("id", vec, id<Number>);
+    unary("null", vec, null<Number>);
+    unary("reverse", vec, reverse<Number>);
+    unary("reverse_dense", dvec, reverse<Number>);
+    unary("length", vec, length<Number>);
+    unary("atom", vec, atom<Number>);
+    unary("equals", vpair, equals<int, Number>);
+    unary("and", bools, and_op<Number>);
+    unary("or", bools, or_op<Number>);
+    unary("not", [](size_t) { return Number(true); }, not_op<Number>);
+    unary("add", atoms, add_op<int, Number>);
+    unary("sub", atoms, sub_op<int, Number>);
+    unary("mul", atoms, mul_op<int, Number>);
+    unary("div", atoms, div_op<int, Number>);
+    unary("apndl", apl, apndl<Number>);
+    unary("apndr", apr, apndr<Number>);
+    unary("rtail", vec, rtail<Number>);
+    unary("rotl", vec, rotl<Number>);
+    unary("rotr", vec, rotr<Number>);
+    unary("dense", vec, dense<int, Number>);
+  }
+}
+
+int main (int argc, char const *argv[]) {
+  functionals();
+  serialization();
+  primitives();
+  return bench::main(argc, argv);
+}
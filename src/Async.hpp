@@ -0,0 +1,216 @@
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+/** \file Async.hpp
+ * Valutazione asincrona
+ * async_eval(f, x) sottomette la valutazione di f(x) all'esecutore corrente
+ * e restituisce subito un Future: il chiamante (es. un thread che fa I/O)
+ * può sottomettere altre valutazioni e raccoglierne i risultati più tardi,
+ * concatenare continuazioni con then o, con le coroutine di C++20, usare
+ * co_await. I funzionali paralleli dentro f generano task dello stesso
+ * esecutore, quindi valutazioni indipendenti condividono i worker.
+ *
+ *   auto r1 = async_eval(MM<par_exec>, x);
+ *   auto r2 = async_eval(MM<par_exec>, y).then(length<Number>);
+ *   ... I/O ...
+ *   Number a = r1.get(), b = r2.get();
+ *
+ * Se l'esecutore non ha worker (concorrenza 1) le valutazioni vengono
+ * eseguite dal thread che attende, in get o wait.
+ */
+
+#include "Executor.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define FPAR_COROUTINES 1
+#endif
+
+namespace fpar {
+
+  template <typename R>
+  class Future;
+
+  namespace detail {
+    template <typename R>
+    struct FutureState {
+      std::mutex m;
+      std::condition_variable cv;
+      bool ready = false;
+      std::optional<R> value;
+      std::exception_ptr error;
+      std::vector<std::function<void()>> continuations;
+      StopSource stop;
+
+      // completa lo stato ed esegue le continuazioni registrate
+      void complete () {
+        auto conts = std::vector<std::function<void()>>();
+        {
+          std::lock_guard<std::mutex> lk(m);
+          ready = true;
+          conts.swap(continuations);
+        }
+        cv.notify_all();
+        for (auto& c : conts) c();
+      }
+
+      // k viene eseguita al completamento, o subito se già completato
+      void on_ready (std::function<void()> k) {
+        {
+          std::lock_guard<std::mutex> lk(m);
+          if (!ready) {
+            continuations.push_back(std::move(k));
+            return;
+          }
+        }
+        k();
+      }
+    };
+
+    template <typename R, typename F>
+    inline Future<R> launch (Executor& ex, F f);
+  }
+
+  /*! \class Future
+   *  \brief Risultato di una valutazione asincrona (vedi async_eval).
+   *         Copiabile: le copie condividono lo stesso risultato.
+   */
+  template <typename R>
+  class Future {
+  private:
+    Executor* _ex;
+    std::shared_ptr<detail::FutureState<R>> _state;
+
+    Future (Executor& ex, std::shared_ptr<detail::FutureState<R>> st)
+      : _ex(&ex), _state(std::move(st)) {}
+
+    template <typename U>
+    friend class Future;
+
+    template <typename U, typename F>
+    friend Future<U> detail::launch (Executor& ex, F f);
+
+  public:
+    /*! \brief true se il risultato (o l'eccezione) è disponibile */
+    bool ready () const {
+      std::lock_guard<std::mutex> lk(_state->m);
+      return _state->ready;
+    }
+
+    /*! \brief Attende il risultato. Nel frattempo il thread chiamante
+     *         esegue i task in coda dell'esecutore, quindi wait può essere
+     *         chiamata anche da un task senza rischio di deadlock.
+     */
+    void wait () const {
+      while (!ready()) {
+        if (_ex->run_pending()) continue;
+        std::unique_lock<std::mutex> lk(_state->m);
+        _state->cv.wait_for(lk, std::chrono::milliseconds(1), [&]{ return _state->ready; });
+      }
+    }
+
+    /*! \brief Risultato della valutazione
+     *  \return f(x); rilancia l'eccezione di f, o cancelled se la
+     *          valutazione è stata cancellata
+     */
+    R get () const {
+      wait();
+      if (_state->error) std::rethrow_exception(_state->error);
+      return *_state->value;
+    }
+
+    /*! \brief Richiede lo stop della valutazione: i funzionali paralleli
+     *         la abbandonano al successivo cancellation_point
+     */
+    void cancel () noexcept {
+      _state->stop.request_stop();
+    }
+
+    /*! \brief Continuazione
+     *  \param g Funzione applicata al risultato, come task dell'esecutore,
+     *         senza bloccare il chiamante
+     *  \return Future di g(get()); un'eccezione viene propagata senza
+     *          invocare g
+     */
+    template <typename G>
+    auto then (G g) const {
+      using U = std::decay_t<std::invoke_result_t<G&, const R&>>;
+      auto st = std::make_shared<detail::FutureState<U>>();
+      auto ex = _ex;
+      auto src = _state;
+      _state->on_ready([=]{
+        ex->submit([=]{
+          {
+            StopScope scope(st->stop.token());
+            try {
+              if (src->error) std::rethrow_exception(src->error);
+              cancellation_point();
+              st->value.emplace(g(*src->value));
+            } catch (...) {
+              st->error = std::current_exception();
+            }
+          }
+          st->complete();
+        });
+      });
+      return Future<U>(*ex, st);
+    }
+
+#ifdef FPAR_COROUTINES
+    // co_await future: la coroutine riprende in un task dell'esecutore
+    bool await_ready () const { return ready(); }
+
+    void await_suspend (std::coroutine_handle<> h) const {
+      auto ex = _ex;
+      _state->on_ready([ex, h]{ ex->submit([h]{ h.resume(); }); });
+    }
+
+    R await_resume () const { return get(); }
+#endif
+  };
+
+  namespace detail {
+    template <typename R, typename F>
+    inline Future<R> launch (Executor& ex, F f) {
+      auto st = std::make_shared<FutureState<R>>();
+      ex.submit([st, f]() mutable {
+        {
+          StopScope scope(st->stop.token());
+          try {
+            cancellation_point(); // non inizia una valutazione già cancellata
+            st->value.emplace(f());
+          } catch (...) {
+            st->error = std::current_exception();
+          }
+        }
+        st->complete();
+      });
+      return Future<R>(ex, st);
+    }
+  }
+
+  /*! \brief Valutazione asincrona di f(x)
+   *  \param f Funzione (es. un programma FP composto)
+   *  \param x Argomento, copiato
+   *  \param ex Esecutore della valutazione (default: l'esecutore corrente)
+   *  \return Future di f(x); il chiamante non viene bloccato
+   */
+  template <typename F, typename T>
+  inline auto async_eval (F f, const T& x, Executor& ex = current_executor()) {
+    using R = std::decay_t<std::invoke_result_t<F&, const T&>>;
+    return detail::launch<R>(ex, [f, x]() mutable { return f(x); });
+  }
+}
+
+#endif
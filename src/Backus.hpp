@@ -8,8 +8,18 @@
 #include "Object.hpp"
 #include "Functions.hpp"
 #include "Functionals.hpp"
+#include "Stream.hpp"
+#include "Sort.hpp"
+#include "Typed.hpp"
+#include "Async.hpp"
+#include "Graph.hpp"
 
 namespace fpar {
+  /*
+    Modalità di esecuzione dei funzionali. Con par_exec il lavoro viene
+    sottomesso all'esecutore corrente (vedi Executor.hpp), che può essere
+    cambiato a runtime con ExecutorScope o set_default_executor.
+  */
   constexpr bool par_exec = true;
   constexpr bool seq_exec = false;
 }
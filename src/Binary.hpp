@@ -0,0 +1,267 @@
+#ifndef BINARY_HPP
+#define BINARY_HPP
+
+/** \file Binary.hpp
+ * Forme binarie delle primitive
+ * Le primitive che prendono una coppia <y,z> (add_op, equals, and_op, ...)
+ * hanno una forma che riceve y e z separatamente. detail::Binary applica una
+ * funzione a due elementi usando, se esiste, la sua forma binaria: è il
+ * punto di incontro tra le riduzioni (Reduce.hpp), i funzionali e le
+ * primitive (Functions.hpp), che includono questo file.
+ */
+
+#include "Object.hpp"
+
+#include <type_traits>
+
+namespace fpar {
+
+  // primitive sulle coppie, definite in Functions.hpp: binary_form ne
+  // riconosce i puntatori
+  template <typename O, typename T>
+  inline T equals (const T& x);
+
+  template <typename O, typename T>
+  inline T less_op (const T& x);
+
+  template <typename T>
+  inline T and_op (const T& x);
+
+  template <typename T>
+  inline T or_op (const T& x);
+
+  template <typename O, typename T>
+  inline T add_op (const T& x);
+
+  template <typename O, typename T>
+  inline T sub_op (const T& x);
+
+  template <typename O, typename T>
+  inline T mul_op (const T& x);
+
+  template <typename O, typename T>
+  inline T div_op (const T& x);
+
+  /*
+    Forme binarie delle primitive: prendono i due elementi della coppia
+    direttamente, senza che il chiamante costruisca la sequenza <y,z>.
+    I funzionali che applicano f a coppie di elementi (insert, zip,
+    binary_to_unary) le usano al posto di add_op, equals, ... e dichiarano
+    lo stesso comportamento:
+      binary::add_op<int, Number>(y, z) == add_op<int, Number>(<y,z>)
+  */
+  namespace binary {
+
+    /*! \brief Controllo equivalenza tra oggetti
+     *  \return true se y e z sono uguali (vedi fpar::equals), false altrimenti
+     */
+    template <typename O, typename T>
+    inline T equals (const T& y, const T& z) {
+      if (y.template is<O>() and z.template is<O>()) {
+        O a = y;
+        O b = z;
+        return (a == b);
+      }
+      if (y.isSequence() and z.isSequence()) return (y == z);
+      return false;
+    }
+
+    /*! \brief Confronto tra atomi
+     *  \return true se y < z, bottom se y e z non sono atomi di tipo O
+     */
+    template <typename O, typename T>
+    inline T less_op (const T& y, const T& z) {
+      if (!y.template is<O>() or !z.template is<O>()) return Bottom;
+      return (y.template get<O>() < z.template get<O>());
+    }
+
+    /*! \brief Operazione logica AND
+     *  \return y AND z
+     */
+    template <typename T>
+    inline T and_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<bool>() or !z.template is<bool>()) return Bottom;
+      bool a = y;
+      bool b = z;
+      return (a and b);
+    }
+
+    /*! \brief Operazione logica OR
+     *  \return y OR z
+     */
+    template <typename T>
+    inline T or_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<bool>() or !z.template is<bool>()) return Bottom;
+      bool a = y;
+      bool b = z;
+      return (a or b);
+    }
+
+    /*! \brief Operazione di addizione generica
+     *  \return y+z
+     */
+    template <typename O, typename T>
+    inline T add_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<O>() or !z.template is<O>()) return Bottom;
+      O a = y;
+      O b = z;
+      return (a + b);
+    }
+
+    /*! \brief Operazione di sottrazione generica
+     *  \return y-z
+     */
+    template <typename O, typename T>
+    inline T sub_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<O>() or !z.template is<O>()) return Bottom;
+      O a = y;
+      O b = z;
+      return (a - b);
+    }
+
+    /*! \brief Operazione di moltiplicazione generica
+     *  \return y*z
+     */
+    template <typename O, typename T>
+    inline T mul_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<O>() or !z.template is<O>()) return Bottom;
+      O a = y;
+      O b = z;
+      return (a * b);
+    }
+
+    /*! \brief Operazione di divisione generica
+     *  \return y/z, bottom se z è 0
+     */
+    template <typename O, typename T>
+    inline T div_op (const T& y, const T& z) {
+      if (y.isBottom() or z.isBottom()) return Bottom;
+      if (!y.template is<O>() or !z.template is<O>()) return Bottom;
+      O b = z;
+      if (b == 0) return Bottom;
+      O a = y;
+      return (a / b);
+    }
+  }
+
+  namespace detail {
+    template <typename T>
+    using binary_fn = T (*)(const T&, const T&);
+
+    // O ha le operazioni aritmetiche delle primitive, chiuse in O
+    template <typename O, typename = void>
+    struct closed_arith : std::false_type {};
+
+    template <typename O>
+    struct closed_arith<O, std::void_t<decltype(std::declval<O>() + std::declval<O>()),
+                                       decltype(std::declval<O>() - std::declval<O>()),
+                                       decltype(std::declval<O>() * std::declval<O>()),
+                                       decltype(std::declval<O>() / std::declval<O>()),
+                                       decltype(std::declval<O>() == 0)>>
+      : std::bool_constant<std::is_same<decltype(std::declval<O>() + std::declval<O>()), O>::value and
+                           std::is_same<decltype(std::declval<O>() - std::declval<O>()), O>::value and
+                           std::is_same<decltype(std::declval<O>() * std::declval<O>()), O>::value and
+                           std::is_same<decltype(std::declval<O>() / std::declval<O>()), O>::value> {};
+
+    template <typename O, typename = void>
+    struct comparable : std::false_type {};
+
+    template <typename O>
+    struct comparable<O, std::void_t<decltype(std::declval<const O&>() == std::declval<const O&>())>>
+      : std::true_type {};
+
+    template <typename O, typename = void>
+    struct ordered : std::false_type {};
+
+    template <typename O>
+    struct ordered<O, std::void_t<decltype(std::declval<const O&>() < std::declval<const O&>())>>
+      : std::true_type {};
+
+    template <typename O, typename T>
+    inline binary_fn<T> binary_atom_form (T (*fp)(const T&)) noexcept {
+      if constexpr (closed_arith<O>::value) {
+        if (fp == &add_op<O, T>) return &binary::add_op<O, T>;
+        if (fp == &sub_op<O, T>) return &binary::sub_op<O, T>;
+        if (fp == &mul_op<O, T>) return &binary::mul_op<O, T>;
+        if (fp == &div_op<O, T>) return &binary::div_op<O, T>;
+      }
+      if constexpr (comparable<O>::value) {
+        if (fp == &equals<O, T>) return &binary::equals<O, T>;
+      }
+      if constexpr (ordered<O>::value) {
+        if (fp == &less_op<O, T>) return &binary::less_op<O, T>;
+      }
+      return nullptr;
+    }
+
+    template <typename T>
+    struct binary_forms;
+
+    template <typename MP, typename... Ts>
+    struct binary_forms<BasicObject<MP, Ts...>> {
+      using T = BasicObject<MP, Ts...>;
+
+      static binary_fn<T> find (T (*fp)(const T&)) noexcept {
+        if (fp == &and_op<T>) return &binary::and_op<T>;
+        if (fp == &or_op<T>) return &binary::or_op<T>;
+        binary_fn<T> res = nullptr;
+        ((res = res ? res : binary_atom_form<Ts, T>(fp)), ...);
+        return res;
+      }
+    };
+
+    /*! \brief Forma binaria di una primitiva
+     *  \param f Funzione passata al funzionale
+     *  \return la primitiva di fpar::binary che calcola f(<y,z>) dati y e z,
+     *          nullptr se f non è una delle primitive binarie (es. una lambda)
+     */
+    template <typename T, typename F>
+    inline binary_fn<T> binary_form (const F& f) noexcept {
+      if constexpr (std::is_convertible<F, T(*)(const T&)>::value and
+                    std::is_pointer<F>::value) {
+        return binary_forms<T>::find(f);
+      }
+      return nullptr;
+    }
+
+    // valore di un elemento restituito da un accessore
+    template <typename T>
+    inline const T& value (const Box<T>& b) { return b.get(); }
+
+    template <typename T>
+    inline const T& value (const T& v) { return v; }
+
+    /*! \class Binary
+     *  \brief Applicazione di f ad una coppia di elementi (box o oggetti).
+     *         Se f accetta (const T&, const T&), o è una primitiva con una
+     *         forma binaria (vedi fpar::binary), la coppia non viene
+     *         costruita; altrimenti f riceve Object::pair(a, b).
+     */
+    template <typename T, typename F>
+    struct Binary {
+      F f;
+      binary_fn<T> fp;
+
+      static constexpr bool direct = std::is_invocable_r<T, const F&, const T&, const T&>::value;
+
+      explicit Binary (const F& f) : f(f), fp(direct ? nullptr : binary_form<T>(f)) {}
+
+      template <typename A, typename B>
+      T operator() (const A& a, const B& b) const {
+        if constexpr (direct) {
+          return f(value<T>(a), value<T>(b));
+        } else {
+          if (fp) return fp(value<T>(a), value<T>(b));
+          return f(T::pair(a, b));
+        }
+      }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef BUILDER_HPP
+#define BUILDER_HPP
+
+/** \file Builder.hpp
+ * Costruzione di sequenze
+ * Costruzione (anche parallela) delle sequenze risultato dei funzionali e
+ * delle funzioni primitive. Le sequenze immer non possono essere modificate
+ * in modo concorrente: ogni task dell'esecutore corrente costruisce quindi un
+ * proprio blocco contiguo in un transient privato e i blocchi vengono
+ * concatenati alla fine. Sotto la soglia di cutoff (vedi Grain.hpp) la
+ * sequenza viene costruita sequenzialmente.
+ */
+
+#include "Object.hpp"
+#include "Executor.hpp"
+#include "Grain.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+namespace fpar {
+
+  namespace detail {
+    // concatena i blocchi; la concatenazione di flex_vector costa O(log N)
+    template <typename T>
+    inline Sequence<T> concat (std::vector<Sequence<T>>& chunks) {
+      auto res = std::move(chunks[0]);
+      for (size_t c = 1; c < chunks.size(); c++) {
+        res = std::move(res) + chunks[c];
+      }
+      return res;
+    }
+  }
+
+  /*! \brief Costruisce una sequenza a partire da un generatore
+   *  \param n Numero di elementi della sequenza
+   *  \param g Generatore, invocato con l'indice (tra 0 e N-1) dell'elemento
+   *  \param par se true i blocchi della sequenza sono costruiti in parallelo,
+   *         se il lavoro stimato supera la soglia di cutoff
+   *  \return <g(0), g(1), ..., g(N-1)>
+   */
+  template <bool par, typename T, typename G>
+  inline Sequence<T> build_sequence (size_t n, G&& g, const Cutoff& cutoff = Cutoff()) {
+    auto res = Sequence<T>().transient();
+    size_t done = 0;
+    if constexpr (par) {
+      auto& ex = current_executor();
+      auto probe = [&]{ res.push_back(g(0)); return size_t(1); };
+      if (detail::worth_parallel(cutoff, ex, n, probe, done)) {
+        // più blocchi che thread, per bilanciare il carico con il work stealing
+        auto rest = n - done;
+        auto n_chunks = std::min(4 * ex.concurrency(), rest);
+        auto chunks = std::vector<Sequence<T>>(n_chunks + 1);
+        chunks[0] = std::move(res).persistent();
+        parallel_for(ex, n_chunks, [&](size_t c) {
+          auto chunk = Sequence<T>().transient();
+          auto lo = done + rest*c/n_chunks, hi = done + rest*(c+1)/n_chunks;
+          for (size_t i = lo; i < hi; i++) {
+            if ((i - lo) % detail::cancel_stride == 0) cancellation_point();
+            chunk.push_back(g(i));
+          }
+          chunks[c+1] = std::move(chunk).persistent();
+        });
+        return detail::concat(chunks);
+      }
+    }
+    for (size_t i = done; i < n; i++) {
+      if ((i - done) % detail::cancel_stride == 0) cancellation_point();
+      res.push_back(g(i));
+    }
+    return std::move(res).persistent();
+  }
+
+  /*! \brief Costruisce una sequenza a blocchi contigui
+   *  \param n Numero di elementi della sequenza
+   *  \param grain Dimensione minima di un blocco
+   *  \param block Invocato con gli estremi [lo, hi) di ogni blocco,
+   *         restituisce la Sequence<T> dei suoi elementi
+   *  \param par se true i blocchi sono costruiti in parallelo, se il lavoro
+   *         stimato supera la soglia di cutoff
+   *  \return concatenazione dei blocchi
+   */
+  template <bool par, typename T, typename B>
+  inline Sequence<T> build_blocks (size_t n, size_t grain, B&& block,
+                                   const Cutoff& cutoff = Cutoff()) {
+    if (n == 0) return Sequence<T>();
+    if (grain == 0) grain = 1;
+    if constexpr (par) {
+      auto& ex = current_executor();
+      auto first = Sequence<T>();
+      size_t done = 0;
+      auto probe = [&]{
+        auto k = std::min(grain, n);
+        first = block(size_t(0), k);
+        return k;
+      };
+      if (detail::worth_parallel(cutoff, ex, n, probe, done)) {
+        auto rest = n - done;
+        auto n_chunks = std::min((rest + grain - 1) / grain, 4 * ex.concurrency());
+        auto chunks = std::vector<Sequence<T>>(n_chunks + 1);
+        chunks[0] = std::move(first);
+        parallel_for(ex, n_chunks, [&](size_t c) {
+          chunks[c+1] = block(done + rest*c/n_chunks, done + rest*(c+1)/n_chunks);
+        });
+        return detail::concat(chunks);
+      }
+      if (done > 0) return done < n ? std::move(first) + block(done, n) : first;
+    }
+    return block(size_t(0), n);
+  }
+
+  namespace detail {
+    // concatenazione di blocchi impaccati (vedi Object::pack), se tutti i
+    // blocchi non vuoti sono densi dello stesso tipo
+    template <typename T>
+    inline std::optional<T> concat_dense (const std::vector<T>& parts) {
+      const T* first = nullptr;
+      for (const auto& p : parts) {
+        if (p.identity().size == 0) continue;
+        if (!p.isDense()) return std::nullopt;
+        if (!first) first = &p;
+      }
+      if (!first) return std::nullopt;
+      return first->visit_dense([&](const auto& d) -> std::optional<T> {
+        using dense_t = std::decay_t<decltype(d)>;
+        size_t total = 0;
+        for (const auto& p : parts) {
+          if (p.identity().size == 0) continue;
+          if (!p.template is<dense_t>()) return std::nullopt;
+          total += p.identity().size;
+        }
+        auto res = dense_t(total).transient();
+        auto out = res.data_mut();
+        for (const auto& p : parts) {
+          if (p.identity().size == 0) continue;
+          const auto& a = p.template get<dense_t>();
+          out = std::copy(a.begin(), a.end(), out);
+        }
+        return T(std::move(res).persistent());
+      });
+    }
+  }
+
+  /*! \brief Costruisce una sequenza, densa se possibile, da un generatore
+   *  \param n Numero di elementi della sequenza
+   *  \param g Generatore, invocato con l'indice (tra 0 e N-1) dell'elemento
+   *  \param par se true gli elementi sono calcolati in parallelo, se il
+   *         lavoro stimato supera la soglia di cutoff
+   *  \return <g(0), g(1), ..., g(N-1)>, densa se gli elementi sono atomi
+   *          dello stesso tipo (vedi Object::pack)
+   */
+  template <bool par, typename T, typename G>
+  inline T build_packed (size_t n, G&& g, const Cutoff& cutoff = Cutoff()) {
+    auto els = std::vector<T>();
+    size_t done = 0;
+    if constexpr (par) {
+      auto& ex = current_executor();
+      auto probe = [&]{ els.push_back(g(0)); return size_t(1); };
+      if (detail::worth_parallel(cutoff, ex, n, probe, done)) {
+        // ogni task impacca il proprio blocco: denso, o una sequenza di box
+        auto rest = n - done;
+        auto n_chunks = std::min(4 * ex.concurrency(), rest);
+        auto parts = std::vector<T>(n_chunks + 1);
+        parts[0] = T::pack(els);
+        els = std::vector<T>();
+        parallel_for(ex, n_chunks, [&](size_t c) {
+          auto lo = done + rest*c/n_chunks, hi = done + rest*(c+1)/n_chunks;
+          auto chunk = std::vector<T>();
+          chunk.reserve(hi - lo);
+          for (size_t i = lo; i < hi; i++) {
+            if ((i - lo) % detail::cancel_stride == 0) cancellation_point();
+            chunk.push_back(g(i));
+          }
+          parts[c+1] = T::pack(chunk);
+        });
+        if (auto res = detail::concat_dense(parts)) return *res;
+        // risultato di box: i blocchi densi vengono convertiti in parallelo
+        auto seqs = std::vector<Sequence<T>>(n_chunks + 1);
+        parallel_for(ex, n_chunks + 1, [&](size_t c) {
+          seqs[c] = Sequence<T>(std::move(parts[c]));
+        });
+        return T(detail::concat(seqs));
+      }
+    }
+    els.reserve(n);
+    for (size_t i = done; i < n; i++) {
+      if ((i - done) % detail::cancel_stride == 0) cancellation_point();
+      els.push_back(g(i));
+    }
+    return T::pack(els);
+  }
+}
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+/** \file Distributed.hpp
+ * Esecuzione distribuita con MPI
+ * I funzionali di dist:: hanno la stessa interfaccia di quelli di
+ * Functionals.hpp e si compongono allo stesso modo, ma distribuiscono il
+ * lavoro sulla sequenza di livello più alto tra i processi MPI di un
+ * comunicatore. Il modello è SPMD: tutti i processi eseguono lo stesso
+ * programma sullo stesso input (eventualmente replicato con
+ * dist::broadcast) e ottengono lo stesso risultato.
+ *  - apply_to_all e zip: ogni processo calcola un blocco contiguo di
+ *    elementi con il funzionale locale (parallelo sul pool se par = true),
+ *    poi i blocchi, serializzati con Serialize.hpp, vengono scambiati tra
+ *    tutti i processi (allgather)
+ *  - insert con associative o commutative: ogni processo riduce il proprio
+ *    blocco a partire dal suo primo elemento, i risultati parziali vengono
+ *    combinati con una riduzione ad albero che rispetta l'ordine dei
+ *    blocchi e trasmessi a tutti (allreduce); n viene combinato una sola
+ *    volta, come in fpar::insert. Senza proprietà la riduzione è
+ *    sequenziale e viene eseguita da ogni processo senza comunicazione
+ *  - insert * apply_to_all viene fuso: ogni processo applica f e riduce il
+ *    proprio blocco, senza scambiare la sequenza intermedia
+ *  - distl e distr non comunicano: costano quanto la copia dei box
+ *
+ *   dist::Environment env(argc, argv);
+ *   auto f = dist::insert<par_exec>(add_op<int, Number>, Number(0), associative) *
+ *            dist::apply_to_all<par_exec, Number>(g);
+ *   f(dist::broadcast(x));
+ *
+ * Le chiamate MPI vengono fatte solo dal thread che invoca il funzionale,
+ * quindi basta MPI_THREAD_FUNNELED. Richiede MPI (es. mpicxx) e non è
+ * incluso da fpar.hpp.
+ */
+
+#include "Object.hpp"
+#include "Functions.hpp"
+#include "Functionals.hpp"
+#include "Stream.hpp"
+#include "Serialize.hpp"
+#include "Trace.hpp"
+
+#include <climits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+namespace fpar {
+namespace dist {
+
+  /*! \class error
+   *  \brief Errore di una chiamata MPI o messaggio troppo grande
+   */
+  struct error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  namespace detail {
+    inline void check (int rc, const char* what) {
+      if (rc != MPI_SUCCESS) throw error(std::string("dist: ") + what + " failed");
+    }
+
+    inline int count (size_t n) {
+      if (n > size_t(INT_MAX)) throw error("dist: message larger than INT_MAX bytes");
+      return static_cast<int>(n);
+    }
+  }
+
+  /*! \class Environment
+   *  \brief Inizializza MPI (MPI_THREAD_FUNNELED) e lo termina alla
+   *         distruzione, se non era già inizializzato
+   */
+  class Environment {
+  private:
+    bool _owner = false;
+
+  public:
+    Environment (int& argc, char**& argv) {
+      int done = 0;
+      detail::check(MPI_Initialized(&done), "MPI_Initialized");
+      if (done) return;
+      int provided = 0;
+      detail::check(MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided), "MPI_Init_thread");
+      _owner = true;
+      if (provided < MPI_THREAD_FUNNELED) {
+        MPI_Finalize();
+        throw error("dist: MPI_THREAD_FUNNELED not supported");
+      }
+    }
+
+    Environment (const Environment&) = delete;
+    Environment& operator= (const Environment&) = delete;
+
+    ~Environment () {
+      if (_owner) MPI_Finalize();
+    }
+  };
+
+  /*! \class Communicator
+   *  \brief Insieme dei processi su cui viene distribuito il lavoro;
+   *         di default MPI_COMM_WORLD. Non possiede il comunicatore.
+   */
+  class Communicator {
+  private:
+    MPI_Comm _comm;
+
+  public:
+    Communicator (MPI_Comm comm = MPI_COMM_WORLD) : _comm(comm) {}
+
+    MPI_Comm comm () const noexcept { return _comm; }
+
+    int rank () const {
+      int r = 0;
+      detail::check(MPI_Comm_rank(_comm, &r), "MPI_Comm_rank");
+      return r;
+    }
+
+    int size () const {
+      int s = 1;
+      detail::check(MPI_Comm_size(_comm, &s), "MPI_Comm_size");
+      return s;
+    }
+
+    /*! \brief Blocco [lo, hi) di n elementi assegnato al processo r */
+    static std::pair<size_t, size_t> block (size_t n, int r, int size) noexcept {
+      return {n * r / size, n * (r + 1) / size};
+    }
+  };
+
+  namespace detail {
+    inline std::string broadcast_bytes (std::string bytes, int root, const Communicator& c) {
+      uint64_t n = bytes.size();
+      check(MPI_Bcast(&n, 1, MPI_UINT64_T, root, c.comm()), "MPI_Bcast");
+      bytes.resize(n);
+      check(MPI_Bcast(&bytes[0], count(n), MPI_BYTE, root, c.comm()), "MPI_Bcast");
+      return bytes;
+    }
+
+    // i blocchi di tutti i processi, in ordine di rank
+    inline std::vector<std::string> allgather_bytes (const std::string& mine, const Communicator& c) {
+      int p = c.size();
+      int n = count(mine.size());
+      auto sizes = std::vector<int>(p);
+      check(MPI_Allgather(&n, 1, MPI_INT, sizes.data(), 1, MPI_INT, c.comm()), "MPI_Allgather");
+      auto displs = std::vector<int>(p);
+      size_t total = 0;
+      for (int r = 0; r < p; r++) {
+        displs[r] = count(total);
+        total += sizes[r];
+      }
+      auto all = std::string(total, '\0');
+      check(MPI_Allgatherv(mine.data(), n, MPI_BYTE, &all[0], sizes.data(), displs.data(),
+                           MPI_BYTE, c.comm()), "MPI_Allgatherv");
+      auto res = std::vector<std::string>(p);
+      for (int r = 0; r < p; r++) res[r] = all.substr(displs[r], sizes[r]);
+      return res;
+    }
+
+    inline void send_bytes (const std::string& bytes, int dest, const Communicator& c) {
+      check(MPI_Send(bytes.data(), count(bytes.size()), MPI_BYTE, dest, 0, c.comm()), "MPI_Send");
+    }
+
+    inline std::string recv_bytes (int source, const Communicator& c) {
+      MPI_Status st;
+      check(MPI_Probe(source, 0, c.comm(), &st), "MPI_Probe");
+      int n = 0;
+      check(MPI_Get_count(&st, MPI_BYTE, &n), "MPI_Get_count");
+      auto bytes = std::string(n, '\0');
+      check(MPI_Recv(&bytes[0], n, MPI_BYTE, source, 0, c.comm(), MPI_STATUS_IGNORE), "MPI_Recv");
+      return bytes;
+    }
+
+    // risultato parziale: vuoto se il blocco del processo è vuoto
+    template <typename T>
+    inline std::string dump_partial (const std::optional<T>& x) {
+      return x ? '\1' + serial::dump(*x) : std::string(1, '\0');
+    }
+
+    template <typename T>
+    inline std::optional<T> parse_partial (const std::string& bytes) {
+      if (bytes.empty() or bytes[0] == '\0') return std::nullopt;
+      return serial::parse<T>(bytes.data() + 1, bytes.size() - 1);
+    }
+
+    /*! \brief Concatenazione dei blocchi di tutti i processi
+     *  \param local Blocco del processo corrente
+     */
+    template <typename T>
+    inline T allgather_sequence (const T& local, const Communicator& c) {
+      auto chunks = std::vector<T>();
+      for (const auto& bytes : allgather_bytes(serial::dump(local), c)) {
+        T chunk = serial::parse<T>(bytes);
+        if (fpar::detail::seq_size(chunk) > 0) chunks.push_back(std::move(chunk));
+      }
+      return fpar::detail::concat_chunks(chunks);
+    }
+
+    /*! \brief Riduzione ad albero dei risultati parziali, nell'ordine dei
+     *         processi: a distanza d il processo r + d invia a r, che
+     *         calcola op(parziale di r, parziale di r + d)
+     *  \return il risultato, su tutti i processi; bottom se tutti i
+     *          parziali sono vuoti
+     */
+    template <typename T, typename Op>
+    inline T allreduce (std::optional<T> acc, const Op& op, const Communicator& c) {
+      int p = c.size(), r = c.rank();
+      for (int d = 1; d < p; d *= 2) {
+        if (r % (2 * d) == d) {
+          send_bytes(dump_partial(acc), r - d, c);
+          break;
+        }
+        if (r % (2 * d) == 0 and r + d < p) {
+          auto other = parse_partial<T>(recv_bytes(r + d, c));
+          if (!acc) acc = std::move(other);
+          else if (other) acc = op(*acc, *other);
+        }
+      }
+      auto res = parse_partial<T>(broadcast_bytes(r == 0 ? dump_partial(acc) : std::string(), 0, c));
+      return res ? *res : T(Bottom);
+    }
+  }
+
+  /*! \brief Replica un oggetto su tutti i processi
+   *  \param x Oggetto, significativo solo sul processo root
+   *  \return x del processo root
+   */
+  template <typename T>
+  inline T broadcast (const T& x, int root = 0, const Communicator& c = Communicator()) {
+    bool is_root = c.rank() == root;
+    return serial::parse<T>(detail::broadcast_bytes(is_root ? serial::dump(x) : std::string(), root, c));
+  }
+
+  /*! \class Map
+   *  \brief Funzione restituita da dist::apply_to_all
+   */
+  template <bool par, typename T, typename F>
+  struct Map {
+    F f;
+    Cutoff cutoff;
+    Communicator comm;
+
+    T operator() (const T& x) const {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      auto n = fpar::detail::seq_size(x);
+      FPAR_TRACE_SPAN("dist_apply_to_all", n);
+      auto local = fpar::apply_to_all<par, T>(f, cutoff);
+      int p = comm.size();
+      if (p == 1) return local(x);
+      auto [lo, hi] = Communicator::block(n, comm.rank(), p);
+      return detail::allgather_sequence(local(fpar::detail::slice(x, lo, hi)), comm);
+    }
+  };
+
+  /*! \brief Operazione di "map" distribuita
+   *  \param f Funzione da applicare agli elementi di una sequenza
+   *  \param par se true ogni processo calcola il suo blocco su più thread
+   *  \return <x1, x2, .., xN> -> <f(x1), f(x2), ..., f(xN)>, su tutti i processi
+   */
+  template <bool par, typename T, typename F>
+  inline auto apply_to_all (F f, Cutoff cutoff = Cutoff(), Communicator comm = Communicator()) {
+    return Map<par, T, F>{f, cutoff, comm};
+  }
+
+  /*! \class Insert
+   *  \brief Funzione restituita da dist::insert
+   *  \param L Insert locale di Functionals.hpp (eventualmente fuso con
+   *         apply_to_all), applicato al blocco di ogni processo
+   */
+  template <typename T, typename F, typename Tag, typename L>
+  struct Insert {
+    F f;
+    L local;
+    Communicator comm;
+
+    T operator() (const T& x) const {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      auto n = fpar::detail::seq_size(x);
+      FPAR_TRACE_SPAN("dist_insert", n);
+      int p = comm.size();
+      // senza associatività l'ordine della riduzione è quello sequenziale
+      if (std::is_same<Tag, void>::value or p == 1) return local(x);
+      if (n == 0) return Bottom;
+      auto [lo, hi] = Communicator::block(n, comm.rank(), p);
+      std::optional<T> partial;
+      if (hi > lo) { // il blocco si riduce dal suo primo elemento, senza n
+        T head = fpar::select<T>(1)(fpar::detail::slice(x, lo, lo + 1));
+        if constexpr (!std::is_same<decltype(L::g), fpar::detail::no_map>::value) head = T(local.g(head));
+        if (hi > lo + 1) {
+          auto rest = local;
+          rest.n = std::move(head);
+          partial = rest(fpar::detail::slice(x, lo + 1, hi));
+        } else {
+          partial = std::move(head);
+        }
+      }
+      const fpar::detail::Binary<T, F> op(f);
+      // l'elemento neutro viene combinato una sola volta, come in fpar::insert
+      return op(local.n, detail::allreduce(std::move(partial), op, comm));
+    }
+  };
+
+  template <typename T, typename F, typename Tag, bool par, typename G>
+  inline auto make_insert (fpar::Insert<par, T, F, Tag, G> local, Communicator comm) {
+    return Insert<T, F, Tag, fpar::Insert<par, T, F, Tag, G>>{local.f, local, comm};
+  }
+
+  /*! \brief Operazione di "fold" distribuita (vedi fpar::insert)
+   *  \return <x1, x2, .., xN> -> f(uf, f(x1, f(x2, ...f(xN-1, xN)))),
+   *          calcolata da ogni processo
+   */
+  template <bool par, typename T, typename F>
+  inline auto insert (F f, const T& n, Cutoff cutoff = Cutoff(), Communicator comm = Communicator()) {
+    return make_insert(fpar::insert<par>(f, n, cutoff), comm);
+  }
+
+  /*! \brief Operazione di "fold" distribuita con operazione associativa
+   *  \return <x1, x2, .., xN> -> f(n, f(x1, f(x2, ...f(xN-1, xN)))), su
+   *          tutti i processi
+   */
+  template <bool par, typename T, typename F>
+  inline auto insert (F f, const T& n, associative_t, Cutoff cutoff = Cutoff(),
+                      Communicator comm = Communicator()) {
+    return make_insert(fpar::insert<par>(f, n, associative, cutoff), comm);
+  }
+
+  /*! \brief Operazione di "fold" distribuita con operazione associativa e
+   *         commutativa; i blocchi vengono comunque combinati in ordine
+   */
+  template <bool par, typename T, typename F>
+  inline auto insert (F f, const T& n, commutative_t, Cutoff cutoff = Cutoff(),
+                      Communicator comm = Communicator()) {
+    return make_insert(fpar::insert<par>(f, n, commutative, cutoff), comm);
+  }
+
+  /*
+    insert(f) * apply_to_all(g): ogni processo riduce g(xi) sul suo blocco
+    con la fusione di Functionals.hpp, senza scambiare g(x1), ..., g(xN)
+  */
+  template <bool p, typename T, typename F, typename Tag, typename L, typename G>
+  inline auto operator*(Insert<T, F, Tag, L> f, Map<p, T, G> g) {
+    return make_insert(f.local * fpar::apply_to_all<p, T>(g.f, g.cutoff), f.comm);
+  }
+
+  /*! \brief Operazione di "zip" distribuita
+   *  \return <<x1, ..., xN>, <y1, ..., yN>> -> <f(x1, y1), ..., f(xN, yN)>,
+   *          su tutti i processi
+   */
+  template <bool par, typename T, typename F>
+  inline auto zip (F f, Cutoff cutoff = Cutoff(), Communicator comm = Communicator()) {
+    auto local = fpar::zip<par, T>(f, cutoff);
+    return [=](const T& x) -> T {
+      if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+      const auto& s = x.as_sequence();
+      if (s.size() != 2) return Bottom;
+      const T& y = *s.front();
+      const T& z = *s.back();
+      if (!y.isSequence() or !z.isSequence()) return Bottom;
+      auto n = fpar::detail::seq_size(y);
+      if (n != fpar::detail::seq_size(z)) return Bottom;
+      FPAR_TRACE_SPAN("dist_zip", n);
+      int p = comm.size();
+      if (p == 1) return local(x);
+      auto [lo, hi] = Communicator::block(n, comm.rank(), p);
+      auto block = T::pair(fpar::detail::slice(y, lo, hi), fpar::detail::slice(z, lo, hi));
+      return detail::allgather_sequence(local(block), comm);
+    };
+  }
+
+  /*! \brief distl, eseguita da ogni processo senza comunicazione */
+  template <bool par, typename T>
+  inline T distl (const T& x) {
+    return fpar::distl<par, T>(x);
+  }
+
+  /*! \brief distr, eseguita da ogni processo senza comunicazione */
+  template <bool par, typename T>
+  inline T distr (const T& x) {
+    return fpar::distr<par, T>(x);
+  }
+}
+}
+
+#endif
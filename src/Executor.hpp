@@ -0,0 +1,592 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+/** \file Executor.hpp
+ * Esecutori dei funzionali paralleli
+ * Definizione degli esecutori a cui i funzionali (e le primitive) con
+ * par = true sottomettono il proprio lavoro. L'esecutore di default è un
+ * pool di thread con work stealing, condiviso da tutte le chiamate: il
+ * parallelismo annidato (es. apply_to_all dentro apply_to_all) genera task
+ * e non nuovi team di thread. Un thread che attende il completamento dei
+ * propri task esegue nel frattempo i task in coda, quindi l'attesa annidata
+ * non può andare in deadlock.
+ */
+
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <omp.h>
+
+namespace fpar {
+
+  /*! \class Executor
+   *  \brief Interfaccia di un esecutore di task.
+   *         Un esecutore accoda task e permette al thread chiamante di
+   *         eseguire i task in attesa mentre aspetta un risultato.
+   */
+  class Executor {
+  public:
+    virtual ~Executor() {}
+
+    /*! \brief Numero di thread che eseguono task (compreso il chiamante) */
+    virtual size_t concurrency () const noexcept = 0;
+
+    /*! \brief Accoda un task. Il task non deve lanciare eccezioni */
+    virtual void submit (std::function<void()> task) = 0;
+
+    /*! \brief Accoda il task i di n task che lavorano su parti contigue
+     *         degli stessi dati (es. i blocchi di parallel_for). Un esecutore
+     *         può assegnare la stessa parte sempre allo stesso thread.
+     */
+    virtual void submit_part (std::function<void()> task, size_t i, size_t n) {
+      (void)i; (void)n;
+      submit(std::move(task));
+    }
+
+    /*! \brief true se submit_part, chiamata dal thread corrente, assegna
+     *         ogni parte ad un thread fisso: anche la parte 0 va sottomessa,
+     *         invece di essere eseguita dal chiamante
+     */
+    virtual bool assigns_parts () const noexcept { return false; }
+
+    /*! \brief Esegue nel thread chiamante uno dei task in coda
+     *  \return true se è stato eseguito un task, false se la coda è vuota
+     */
+    virtual bool run_pending () = 0;
+  };
+
+  /*! \class InlineExecutor
+   *  \brief Esegue ogni task nel thread che lo sottomette.
+   *         Rende sequenziale, a runtime, un programma scritto con par_exec.
+   */
+  class InlineExecutor : public Executor {
+  public:
+    size_t concurrency () const noexcept override { return 1; }
+
+    void submit (std::function<void()> task) override { task(); }
+
+    bool run_pending () override { return false; }
+  };
+
+  /*! \class WorkStealingPool
+   *  \brief Pool di thread con una coda per worker.
+   *         Ogni worker estrae i task dalla coda della propria deque (LIFO)
+   *         e, se questa è vuota, li ruba dalla testa delle altre (FIFO).
+   *         Il thread che sottomette i task partecipa all'esecuzione, quindi
+   *         un pool di concorrenza N ha N-1 worker.
+   *         Con affinità la parte i di n (vedi submit_part) sottomessa da
+   *         fuori dal pool va nella coda del worker i*(N-1)/n: le stesse
+   *         porzioni dei dati vengono elaborate dagli stessi worker, finché
+   *         il carico non ne richiede il furto; il thread esterno, mentre
+   *         attende, non esegue task.
+   */
+  class WorkStealingPool : public Executor {
+  private:
+    struct Queue {
+      std::mutex m;
+      std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _workers;
+    std::atomic<size_t> _queued{0};
+    std::atomic<size_t> _next{0};
+    std::mutex _sleep_m;
+    std::condition_variable _sleep_cv;
+    bool _stop = false;
+    bool _affine = false;
+
+    // indice del worker del thread corrente (se appartiene a questo pool)
+    static std::pair<const WorkStealingPool*, size_t>& self () noexcept {
+      static thread_local std::pair<const WorkStealingPool*, size_t> id{nullptr, 0};
+      return id;
+    }
+
+    bool pop (std::function<void()>& task) {
+      auto n = _queues.size();
+      auto first = _next++ % n;
+      if (self().first == this) { // prima la propria coda, dal fondo
+        first = self().second;
+        auto& q = *_queues[first];
+        std::lock_guard<std::mutex> lk(q.m);
+        if (!q.tasks.empty()) {
+          task = std::move(q.tasks.back());
+          q.tasks.pop_back();
+          _queued--;
+          return true;
+        }
+      }
+      for (size_t k = 0; k < n; k++) { // furto dalla testa delle altre code
+        auto& q = *_queues[(first + k) % n];
+        std::lock_guard<std::mutex> lk(q.m);
+        if (!q.tasks.empty()) {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+          _queued--;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void work (size_t id);
+
+    void push (size_t i, std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lk(_queues[i]->m);
+        _queues[i]->tasks.push_back(std::move(task));
+        _queued++;
+      }
+      // il lock evita che un worker si addormenti senza vedere il task
+      { std::lock_guard<std::mutex> lk(_sleep_m); }
+      _sleep_cv.notify_one();
+    }
+
+  public:
+    /*! \param n_threads Concorrenza del pool (worker più il chiamante)
+     *  \param init Eseguita da ogni worker, con il suo indice, prima dei
+     *         task (es. per fissarne la cpu)
+     *  \param affine Se true le parti dei dati sono assegnate ai worker
+     */
+    explicit WorkStealingPool (size_t n_threads, std::function<void(size_t)> init = nullptr,
+                               bool affine = false) : _affine(affine) {
+      if (n_threads == 0) n_threads = 1;
+      auto n_queues = (n_threads > 1) ? n_threads - 1 : 1;
+      for (size_t i = 0; i < n_queues; i++) {
+        _queues.push_back(std::make_unique<Queue>());
+      }
+      for (size_t i = 0; i + 1 < n_threads; i++) {
+        _workers.emplace_back([this, i, init]{
+          if (init) init(i);
+          work(i);
+        });
+      }
+    }
+
+    WorkStealingPool (const WorkStealingPool&) = delete;
+    WorkStealingPool& operator= (const WorkStealingPool&) = delete;
+
+    // i task ancora in coda alla distruzione vengono scartati
+    ~WorkStealingPool () override {
+      {
+        std::lock_guard<std::mutex> lk(_sleep_m);
+        _stop = true;
+      }
+      _sleep_cv.notify_all();
+      for (auto& w : _workers) w.join();
+    }
+
+    size_t concurrency () const noexcept override {
+      return _workers.size() + 1;
+    }
+
+    void submit (std::function<void()> task) override {
+      auto i = (self().first == this) ? self().second
+                                      : _next++ % _queues.size();
+      push(i, std::move(task));
+    }
+
+    // dentro il pool i task restano nella coda del worker che li genera
+    void submit_part (std::function<void()> task, size_t i, size_t n) override {
+      if (!_affine or self().first == this or n == 0) return submit(std::move(task));
+      push(owner(i, n), std::move(task));
+    }
+
+    bool assigns_parts () const noexcept override {
+      return _affine and self().first != this and !_workers.empty();
+    }
+
+    /*! \brief Worker a cui è assegnata la parte i di n */
+    size_t owner (size_t i, size_t n) const noexcept {
+      return std::min(i * _queues.size() / n, _queues.size() - 1);
+    }
+
+    // con affinità il thread esterno attende senza prendere le parti dei worker
+    bool run_pending () override {
+      std::function<void()> task;
+      if (assigns_parts() or !pop(task)) return false;
+      FPAR_TRACE_SPAN("task", 0);
+      task();
+      return true;
+    }
+  };
+
+  namespace detail {
+    // esecutore scelto esplicitamente per il thread corrente
+    inline Executor*& current_executor_ptr () noexcept {
+      static thread_local Executor* ex = nullptr;
+      return ex;
+    }
+
+    inline std::mutex& default_executor_mutex () noexcept {
+      static std::mutex m;
+      return m;
+    }
+
+    inline std::shared_ptr<Executor>& default_executor_ref () noexcept {
+      static std::shared_ptr<Executor> ex;
+      return ex;
+    }
+
+    // copia di default_executor_ref().get(), letta da current_executor senza
+    // il mutex; viene aggiornata (sotto il mutex) insieme al shared_ptr
+    inline std::atomic<Executor*>& default_executor_raw () noexcept {
+      static std::atomic<Executor*> ex{nullptr};
+      return ex;
+    }
+  }
+
+  inline void WorkStealingPool::work (size_t id) {
+    self() = {this, id};
+    detail::current_executor_ptr() = this;
+    while (true) {
+      if (run_pending()) continue;
+      std::unique_lock<std::mutex> lk(_sleep_m);
+      _sleep_cv.wait(lk, [this]{ return _stop or _queued > 0; });
+      if (_stop) return;
+    }
+  }
+
+  /*! \brief Esecutore di default, condiviso da tutte le chiamate.
+   *         Alla prima chiamata viene creato un WorkStealingPool con
+   *         omp_get_max_threads() thread.
+   */
+  inline std::shared_ptr<Executor> default_executor () {
+    std::lock_guard<std::mutex> lk(detail::default_executor_mutex());
+    auto& ex = detail::default_executor_ref();
+    if (!ex) {
+      ex = std::make_shared<WorkStealingPool>(omp_get_max_threads());
+      detail::default_executor_raw().store(ex.get(), std::memory_order_release);
+    }
+    return ex;
+  }
+
+  /*! \brief Sostituisce l'esecutore di default.
+   *         Va chiamata quando non ci sono computazioni parallele in corso.
+   *  \param ex Nuovo esecutore (nullptr ripristina il pool di default)
+   */
+  inline void set_default_executor (std::shared_ptr<Executor> ex) {
+    std::lock_guard<std::mutex> lk(detail::default_executor_mutex());
+    detail::default_executor_raw().store(ex.get(), std::memory_order_release);
+    detail::default_executor_ref() = std::move(ex);
+  }
+
+  /*! \brief Esecutore usato dal thread corrente.
+   *         Nei worker di un pool è il pool stesso, altrimenti è quello
+   *         impostato con ExecutorScope o, in mancanza, quello di default
+   *         (letto senza lock, una volta creato)
+   */
+  inline Executor& current_executor () {
+    auto ex = detail::current_executor_ptr();
+    if (ex) return *ex;
+    if (auto def = detail::default_executor_raw().load(std::memory_order_acquire)) return *def;
+    return *default_executor();
+  }
+
+  /*! \class ExecutorScope
+   *  \brief Imposta l'esecutore del thread corrente per la durata dello scope.
+   *         E' l'handle di runtime con cui si sceglie dove (e se) eseguire
+   *         in parallelo i funzionali istanziati con par_exec.
+   */
+  class ExecutorScope {
+  private:
+    Executor* _prev;
+
+  public:
+    explicit ExecutorScope (Executor& ex) : _prev(detail::current_executor_ptr()) {
+      detail::current_executor_ptr() = &ex;
+    }
+
+    ExecutorScope (const ExecutorScope&) = delete;
+    ExecutorScope& operator= (const ExecutorScope&) = delete;
+
+    ~ExecutorScope () {
+      detail::current_executor_ptr() = _prev;
+    }
+  };
+
+  /*
+    Cancellazione cooperativa. Un task sottomesso con TaskGroup o spawn
+    eredita lo StopToken del thread che lo sottomette; i funzionali paralleli
+    controllano il token tra un blocco e l'altro (cancellation_point) e, se è
+    stato richiesto lo stop, abbandonano il lavoro lanciando cancelled.
+    Lo stop di un token si propaga ai token figli.
+  */
+
+  /*! \class cancelled
+   *  \brief Eccezione lanciata da cancellation_point se è stato richiesto lo stop
+   */
+  struct cancelled : std::exception {
+    const char* what () const noexcept override { return "fpar: computation cancelled"; }
+  };
+
+  namespace detail {
+    struct StopState {
+      std::atomic<bool> stop{false};
+      std::shared_ptr<const StopState> parent;
+
+      bool requested () const noexcept {
+        for (auto s = this; s; s = s->parent.get()) {
+          if (s->stop.load(std::memory_order_relaxed)) return true;
+        }
+        return false;
+      }
+    };
+
+    // token del thread corrente
+    inline std::shared_ptr<const StopState>& current_stop_ptr () noexcept {
+      static thread_local std::shared_ptr<const StopState> st;
+      return st;
+    }
+  }
+
+  /*! \class StopToken
+   *  \brief Permette di controllare se è stato richiesto lo stop
+   */
+  class StopToken {
+  private:
+    std::shared_ptr<const detail::StopState> _state;
+    friend class StopSource;
+    friend class StopScope;
+
+  public:
+    StopToken () {}
+    explicit StopToken (std::shared_ptr<const detail::StopState> st) : _state(std::move(st)) {}
+
+    bool stop_requested () const noexcept {
+      return _state and _state->requested();
+    }
+  };
+
+  /*! \class StopSource
+   *  \brief Richiede lo stop dei task che usano il suo token.
+   *         E' figlia del token del thread che la crea: lo stop di questo
+   *         viene visto anche dai suoi task.
+   */
+  class StopSource {
+  private:
+    std::shared_ptr<detail::StopState> _state;
+
+  public:
+    StopSource () : _state(std::make_shared<detail::StopState>()) {
+      _state->parent = detail::current_stop_ptr();
+    }
+
+    StopToken token () const { return StopToken(_state); }
+
+    void request_stop () noexcept { _state->stop = true; }
+  };
+
+  /*! \class StopScope
+   *  \brief Imposta il token del thread corrente per la durata dello scope
+   */
+  class StopScope {
+  private:
+    std::shared_ptr<const detail::StopState> _prev;
+
+  public:
+    explicit StopScope (const StopToken& tk) : _prev(std::move(detail::current_stop_ptr())) {
+      detail::current_stop_ptr() = tk._state;
+    }
+
+    StopScope (const StopScope&) = delete;
+    StopScope& operator= (const StopScope&) = delete;
+
+    ~StopScope () {
+      detail::current_stop_ptr() = std::move(_prev);
+    }
+  };
+
+  /*! \brief Token del thread corrente (vuoto se non è mai richiesto lo stop) */
+  inline StopToken current_stop_token () {
+    return StopToken(detail::current_stop_ptr());
+  }
+
+  /*! \brief Lancia cancelled se è stato richiesto lo stop del token corrente.
+   *         Può essere chiamata anche dalle funzioni dell'utente.
+   */
+  inline void cancellation_point () {
+    auto& st = detail::current_stop_ptr();
+    if (st and st->requested()) throw cancelled();
+  }
+
+  namespace detail {
+    // elementi tra due cancellation_point nei cicli sugli elementi dei
+    // funzionali: il controllo (un accesso TLS) si fa una volta per blocco
+    constexpr size_t cancel_stride = 1024;
+  }
+
+  /*! \class TaskGroup
+   *  \brief Gruppo di task di cui si attende il completamento.
+   *         Durante l'attesa il thread chiamante esegue i task in coda.
+   *         La prima eccezione lanciata da un task viene rilanciata da wait().
+   */
+  class TaskGroup {
+  private:
+    struct State {
+      std::atomic<size_t> pending{0};
+      std::mutex m;
+      std::exception_ptr error;
+    };
+
+    Executor& _ex;
+    std::shared_ptr<State> _state;
+
+  public:
+    explicit TaskGroup (Executor& ex) : _ex(ex), _state(std::make_shared<State>()) {}
+
+    TaskGroup (const TaskGroup&) = delete;
+    TaskGroup& operator= (const TaskGroup&) = delete;
+
+    ~TaskGroup () {
+      try { wait(); } catch (...) {}
+    }
+
+    template <typename F>
+    void run (F&& f) {
+      _state->pending++;
+      _ex.submit(wrap(std::forward<F>(f)));
+    }
+
+    /*! \brief Come run, per la parte i di n dei dati (vedi Executor::submit_part) */
+    template <typename F>
+    void run_part (F&& f, size_t i, size_t n) {
+      _state->pending++;
+      _ex.submit_part(wrap(std::forward<F>(f)), i, n);
+    }
+
+    void wait () {
+      while (_state->pending > 0) {
+        if (!_ex.run_pending()) std::this_thread::yield();
+      }
+      if (_state->error) {
+        auto error = _state->error;
+        _state->error = nullptr;
+        std::rethrow_exception(error);
+      }
+    }
+
+  private:
+    template <typename F>
+    std::function<void()> wrap (F&& f) {
+      return [state = _state, tk = current_stop_token(), f = std::forward<F>(f)]() mutable {
+        try {
+          StopScope scope(tk);
+          cancellation_point(); // non inizia un task già cancellato
+          f();
+        } catch (...) {
+          std::lock_guard<std::mutex> lk(state->m);
+          if (!state->error) state->error = std::current_exception();
+        }
+        state->pending--;
+      };
+    }
+  };
+
+  /*! \class Task
+   *  \brief Risultato di un task sottomesso con spawn.
+   *         get() esegue i task in coda finché il risultato non è pronto.
+   */
+  template <typename R>
+  class Task {
+  private:
+    struct State {
+      std::atomic<bool> ready{false};
+      std::optional<R> value;
+      std::exception_ptr error;
+    };
+
+    Executor* _ex;
+    std::shared_ptr<State> _state;
+
+  public:
+    template <typename F>
+    Task (Executor& ex, F&& f) : _ex(&ex), _state(std::make_shared<State>()) {
+      _ex->submit([state = _state, tk = current_stop_token(), f = std::forward<F>(f)]() mutable {
+        try {
+          StopScope scope(tk);
+          cancellation_point();
+          state->value.emplace(f());
+        } catch (...) {
+          state->error = std::current_exception();
+        }
+        state->ready = true;
+      });
+    }
+
+    bool ready () const noexcept { return _state->ready; }
+
+    R get () {
+      while (!_state->ready) {
+        if (!_ex->run_pending()) std::this_thread::yield();
+      }
+      if (_state->error) std::rethrow_exception(_state->error);
+      return *_state->value;
+    }
+  };
+
+  /*! \brief Sottomette un task all'esecutore
+   *  \param f Funzione senza argomenti da eseguire
+   *  \return Task il cui get() restituisce f()
+   */
+  template <typename F>
+  inline auto spawn (Executor& ex, F&& f) {
+    return Task<std::decay_t<std::invoke_result_t<F&>>>(ex, std::forward<F>(f));
+  }
+
+  /*! \brief Esegue body(0), ..., body(N-1) come task dell'esecutore.
+   *         Le iterazioni non ancora iniziate vengono saltate se è richiesto
+   *         lo stop del token corrente. L'iterazione i è la parte i di N
+   *         (vedi Executor::submit_part); la prima è eseguita dal thread
+   *         chiamante, se l'esecutore non assegna le parti ai suoi thread.
+   *  \param n Numero di iterazioni (ognuna è un task)
+   *  \param body Corpo del ciclo, invocato con l'indice dell'iterazione
+   */
+  template <typename F>
+  inline void parallel_for (Executor& ex, size_t n, F&& body) {
+    if (n == 0) return;
+    TaskGroup group(ex);
+    bool assigned = ex.assigns_parts();
+    for (size_t i = assigned ? 0 : 1; i < n; i++) {
+      group.run_part([&body, i]{ body(i); }, i, n);
+    }
+    if (!assigned) {
+      cancellation_point();
+      FPAR_TRACE_SPAN("task", 0);
+      body(0); // la prima iterazione nel thread chiamante
+    }
+    group.wait();
+  }
+
+  /*! \brief Esegue body(lo, hi) su blocchi contigui di [0, N)
+   *  \param n Numero di elementi
+   *  \param grain Dimensione minima di un blocco
+   *  \param body Corpo, invocato con gli estremi [lo, hi) di ogni blocco
+   */
+  template <typename F>
+  inline void parallel_for_chunks (Executor& ex, size_t n, size_t grain, F&& body) {
+    if (grain == 0) grain = 1;
+    auto n_chunks = (n + grain - 1) / grain;
+    if (n_chunks > 4 * ex.concurrency()) n_chunks = 4 * ex.concurrency();
+    if (n_chunks < 2) {
+      if (n > 0) body(size_t(0), n);
+      return;
+    }
+    parallel_for(ex, n_chunks, [&](size_t c) {
+      body(n*c/n_chunks, n*(c+1)/n_chunks);
+    });
+  }
+}
+
+#endif
@@ -9,23 +9,52 @@
  */
 
 #include "Object.hpp"
+#include "Builder.hpp"
+#include "Executor.hpp"
+#include "Reduce.hpp"
+#include "Kernels.hpp"
+#include "Memo.hpp"
+#include "Trace.hpp"
 
 #include <initializer_list>
+#include <memory>
 #include <vector>
 #include <functional>
-#include <numeric>
-#include <future>
-#include <thread>
-#include <omp.h>
 #include <algorithm>
+#include <optional>
+#include <type_traits>
 
 namespace fpar {
 
   /*
    I funzionali (o functional forms) restituiscono funzioni.
    Nello specifico, in questa implementazione, restituiscono lambda expressions
+   oppure, per i funzionali che possono essere fusi tra loro (apply_to_all e
+   insert), oggetti funzione di cui la composizione conosce il tipo.
   */
 
+  /*! \class Composed
+   *  \brief Funzione composta f(g(x))
+   */
+  template <typename F, typename G>
+  struct Composed {
+    F f;
+    G g;
+
+    template <typename X>
+    auto operator() (const X& x) const {
+      return f(g(x));
+    }
+  };
+
+  namespace detail {
+    template <typename F>
+    struct is_composed : std::false_type {};
+
+    template <typename F, typename G>
+    struct is_composed<Composed<F, G>> : std::true_type {};
+  }
+
   /*! \brief Composizione di funzioni (operatore)
    *  \param f Funzione più esterna
    *  \param g Funzione più interna
@@ -33,9 +62,7 @@ namespace fpar {
    */
   template <typename F, typename G>
   auto operator*(F f, G g) {
-    return [=](const auto& x) {
-      return f(g(x));
-    };
+    return Composed<F, G>{f, g};
   }
 
   /*! \brief Composizione di funzioni (funzione)
@@ -45,73 +72,111 @@ namespace fpar {
    */
   template <typename F, typename G>
   inline auto compose (F f, G g) {
-    return [=](const auto& x) {
-      return f(g(x));
-    };
+    return f * g;
   }
 
   /*! \brief Costruisce sequenze a partire da funzioni
    *  \param fs Insieme di funzioni da applicare per costruire la sequenza
    *  \param par se true eseguito su più thread
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
    *  \return x -> <f1(x), f2(x), ..., fN(x)>
    */
   template <bool par, typename T, typename F>
-  inline auto construct (std::initializer_list<F> fs) {
+  inline auto construct (std::initializer_list<F> fs, Cutoff cutoff = Cutoff()) {
+    // l'initializer_list non sopravvive alla chiamata: si copiano le funzioni
+    auto fs_list = std::vector<F>(fs);
     return [=](const T& x) -> T {
-      auto fs_list = fs.begin();
-      auto res = Sequence<T>(fs.size());
-      if constexpr (par) {
-        #pragma omp parallel for
-        for (size_t i = 0; i < fs.size(); i++) {
-          std::move(res).set(i, (fs_list[i])(x));
-        }
-      } else {
-        for(size_t i = 0; i < fs.size(); i++) {
-          std::move(res).set(i, (fs_list[i])(x));
-        }
-      }
-      return res;
+      FPAR_TRACE_SPAN("construct", fs_list.size());
+      return build_sequence<par, T>(fs_list.size(), [&](size_t i) {
+        return fs_list[i](x);
+      }, cutoff);
     };
   }
 
+  /*
+    Indicazioni sul costo di condition<par_exec>, date dal chiamante:
+      condition<par_exec, Number>(p, f, g, lazy)
+    speculative: f e g sono calcolate mentre si calcola p, conviene se p costa
+                 quanto f e g; il ramo scartato viene cancellato
+    lazy: si calcola p e poi solo il ramo scelto, conviene se p costa poco
+  */
+  struct speculative_t {};
+  struct lazy_t {};
+  constexpr speculative_t speculative{};
+  constexpr lazy_t lazy{};
+
   /*! \brief Costrutto "if-then-else"
    *  \param p Funzione di "guardia"
    *  \param f Applicazione ramo then
    *  \param g Applicazione ramo else
-   *  \param par se true eseguito su più thread
+   *  \param par se true f e g vengono calcolati in modo speculativo, come task
+   *         dell'esecutore corrente, mentre il thread chiamante calcola p;
+   *         il ramo scartato riceve la richiesta di stop e abbandona il lavoro
+   *         al successivo cancellation_point. Se l'esecutore ha un solo
+   *         thread (es. InlineExecutor) dopo p viene calcolato solo il ramo
+   *         scelto, come con lazy
    *  \return x -> (p(x) ? f(x) : g(x))
    */
   template <bool par, typename T, typename P, typename F, typename G>
-  inline auto condition (P p, F f, G g) {
+  inline auto condition (P p, F f, G g, speculative_t = speculative) {
     return [=](const T& x) -> T {
+      FPAR_TRACE_SPAN("condition", 0);
       T _px;
-      if constexpr (par) { // calcolo in parallelo
-        // utile solo se p(x) "costa" quanto f(x) e g(x)
-        // sorta di valutazione eager ma in parallelo
-        auto fpx = std::async(std::launch::async, [=](){return p(x);});
-        auto ffx = std::async(std::launch::async, [=](){return f(x);});
-        auto fgx = std::async(std::launch::async, [=](){return g(x);});
-        _px = fpx.get(); // si attende il valore di p(x)
-        if (_px.isBottom() or !_px.template is<bool>()) return Bottom;
-        bool px = _px;
-        if (px) {
-          return ffx.get();
-        } else {
-          return fgx.get();
-        }
-      } else { // calcolo sequenziale
-        _px = p(x);
-        if (_px.isBottom() or !_px.template is<bool>()) return Bottom;
-        bool px = _px;
-        if (px) {
-          return f(x);
-        } else {
-          return g(x);
+      if constexpr (par) {
+        auto& ex = current_executor();
+        // con un solo thread spawn calcolerebbe f e g prima di p, anche il
+        // ramo che p esclude (es. il caso ricorsivo sotto la guardia)
+        if (ex.concurrency() >= 2) { // calcolo speculativo in parallelo
+          StopSource fstop, gstop;
+          auto ffx = spawn(ex, [=, tk = fstop.token()](){ StopScope s(tk); return f(x); });
+          auto fgx = spawn(ex, [=, tk = gstop.token()](){ StopScope s(tk); return g(x); });
+          try {
+            _px = p(x);
+          } catch (...) {
+            fstop.request_stop();
+            gstop.request_stop();
+            throw;
+          }
+          if (_px.isBottom() or !_px.template is<bool>()) {
+            fstop.request_stop();
+            gstop.request_stop();
+            return Bottom;
+          }
+          bool px = _px;
+          if (px) {
+            gstop.request_stop();
+            return ffx.get();
+          } else {
+            fstop.request_stop();
+            return fgx.get();
+          }
         }
       }
+      // calcolo sequenziale
+      _px = p(x);
+      if (_px.isBottom() or !_px.template is<bool>()) return Bottom;
+      bool px = _px;
+      if (px) {
+        return f(x);
+      } else {
+        return g(x);
+      }
     };
   }
 
+  /*! \brief Costrutto "if-then-else" senza speculazione
+   *  \param p Funzione di "guardia"
+   *  \param f Applicazione ramo then
+   *  \param g Applicazione ramo else
+   *  \param par ignorato: dopo p viene calcolato solo il ramo scelto (che può
+   *         a sua volta essere parallelo)
+   *  \return x -> (p(x) ? f(x) : g(x))
+   */
+  template <bool par, typename T, typename P, typename F, typename G>
+  inline auto condition (P p, F f, G g, lazy_t) {
+    return condition<false, T>(p, f, g);
+  }
+
   /*! \brief Funzione costante
    *  \param c Valore da incapsulare in un atomo costante
    *  \return x -> c
@@ -124,142 +189,521 @@ namespace fpar {
     };
   }
 
+  /*! \brief Funzione con memoria dei risultati
+   *  \param f Funzione (pura) da memoizzare
+   *  \param capacity Numero massimo di risultati memorizzati
+   *  \return x -> f(x); se f è già stata applicata ad un oggetto uguale a x
+   *          il risultato viene preso dalla cache, condivisa dalle copie
+   *          della funzione restituita e tra i thread
+   */
+  template <typename T, typename F>
+  inline auto memoize (F f, size_t capacity = 1024) {
+    auto cache = std::make_shared<detail::MemoCache<T>>(capacity);
+    return [=](const T& x) -> T {
+      FPAR_TRACE_SPAN("memoize", 0);
+      size_t hash = 0;
+      if (auto res = cache->find(x, hash)) return *res;
+      T res = f(x);
+      cache->put(x, hash, res);
+      return res;
+    };
+  }
+
+  namespace detail {
+    // nessuna funzione da applicare agli elementi prima della riduzione
+    struct no_map {};
+
+    // composizione g * h, dove g può essere no_map
+    template <typename G, typename H>
+    inline auto then (const G& g, const H& h) {
+      if constexpr (std::is_same<G, no_map>::value) {
+        return h;
+      } else {
+        return Composed<G, H>{g, h};
+      }
+    }
+  }
+
+  /*! \class Insert
+   *  \brief Funzione restituita da insert.
+   *         Se composta con apply_to_all(g) diventa una sola passata che
+   *         riduce g(x1), ..., g(xN) senza costruire la sequenza intermedia.
+   *  \param Tag proprietà di f: void, associative_t o commutative_t
+   *  \param G funzione applicata agli elementi prima della riduzione
+   */
+  template <bool par, typename T, typename F, typename Tag = void, typename G = detail::no_map>
+  struct Insert {
+    F f;
+    T n;
+    G g;
+    Cutoff cutoff;
+
+    T operator() (const T& x) const {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("insert", detail::seq_size(x));
+      // in backus fp le operazioni binarie sono operazioni unarie
+      // che prendono coppie in input: detail::reduce costruisce le coppie
+      constexpr bool reassoc = !std::is_same<Tag, void>::value;
+      if (x.isDense()) { // riduzione direttamente sull'array
+        return x.visit_dense([&](const auto& d) -> T {
+          if constexpr (std::is_same<G, detail::no_map>::value) {
+            if (auto r = detail::sum_kernel<par, T>(f, n, d, reassoc)) return *r;
+            return detail::reduce<par, Tag>(f, n, d.begin(), d.end(), detail::deref<T>(), cutoff);
+          } else {
+            return detail::reduce<par, Tag>(f, n, d.begin(), d.end(),
+                                            [&](const auto& it) { return T(g(T(*it))); }, cutoff);
+          }
+        });
+      }
+      const auto& s = x.as_sequence();
+      if constexpr (std::is_same<G, detail::no_map>::value) {
+        return detail::reduce<par, Tag>(f, n, s.begin(), s.end(), detail::deref<T>(), cutoff);
+      } else {
+        return detail::reduce<par, Tag>(f, n, s.begin(), s.end(),
+                                        [&](const auto& it) { return T(g(it->get())); }, cutoff);
+      }
+    }
+
+    /*! \brief Riduzione di trans(x), senza costruire la trasposta
+     *  \param x Sequenze <<x1,...,xN>,<y1,...,yN>,...,<z1,...,zN>>
+     *  \return (*this)(trans(x)); le colonne sono costruite una alla volta
+     */
+    T transposed (const T& x) const {
+      // le righe di una sequenza densa sono atomi
+      if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+      FPAR_TRACE_SPAN("insert_trans", detail::seq_size(x));
+      const auto& s = x.as_sequence();
+      if (s.size() == 0) return Bottom;
+      if (s[0]->isDense()) { // righe dense dello stesso tipo
+        auto res = s[0]->visit_dense([&](const auto& first) -> std::optional<T> {
+          using dense_t = std::decay_t<decltype(first)>;
+          auto rows = std::vector<dense_t>();
+          size_t els = first.size();
+          for (const auto& row : s) {
+            if (!row->template is<dense_t>()) return std::nullopt;
+            rows.push_back(*row);
+            if (rows.back().size() < els) els = rows.back().size();
+          }
+          if (els == 0) return T(Bottom);
+          if constexpr (!std::is_same<G, detail::no_map>::value) {
+            if (rows.size() == 2) {
+              auto r = detail::dot_kernel<par, T>(f, g, n, rows[0], rows[1], els, reassoc);
+              if (r) return r;
+            }
+          }
+          auto column = [&](size_t i) {
+            auto col = DenseSequence<typename dense_t::value_type>().transient();
+            for (const auto& row : rows) col.push_back(row[i]);
+            return T(std::move(col).persistent());
+          };
+          return columns(els, column);
+        });
+        if (res) return *res;
+      }
+      auto rows = std::vector<Sequence<T>>();
+      size_t els = detail::npos;
+      for (const auto& row : s) {
+        if (row->isBottom() or !row->isSequence()) return Bottom;
+        rows.push_back(*row);
+        if (rows.back().size() < els) els = rows.back().size();
+      }
+      if (els == 0) return Bottom;
+      return columns(els, [&](size_t i) {
+        auto col = Sequence<T>().transient();
+        for (const auto& row : rows) col.push_back(row[i]);
+        return T(std::move(col).persistent());
+      });
+    }
+
+  private:
+    static constexpr bool reassoc = !std::is_same<Tag, void>::value;
+
+    template <typename C>
+    T columns (size_t els, const C& column) const {
+      if constexpr (std::is_same<G, detail::no_map>::value) {
+        return detail::reduce<par, Tag>(f, n, size_t(0), els, column, cutoff);
+      } else {
+        return detail::reduce<par, Tag>(f, n, size_t(0), els,
+                                        [&](size_t i) { return T(g(column(i))); }, cutoff);
+      }
+    }
+  };
+
   /*! \brief Operazione di "fold"
    *  \param f Funzione di riduzione
    *  \param par se true eseguito su più thread
    *  \param uf Valore di accumulazione di default
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
    *  \return <x1, x2, .., xN> -> f(uf, f(x1, f(x2, ...f(xN-1, xN))))
    */
   template <bool par, typename T, typename F>
-  inline auto insert (F f, const T& n) {
-    return [=](const T& x) -> T {
+  inline auto insert (F f, const T& n, Cutoff cutoff = Cutoff()) {
+    return Insert<par, T, F>{f, n, {}, cutoff};
+  }
+
+  /*! \brief Operazione di "fold" con operazione associativa
+   *  \param f Funzione di riduzione, associativa
+   *  \param n Elemento neutro per f
+   *  \param par se true riduzione ad albero: foglie di dimensione adattiva,
+   *         sotto-alberi eseguiti come task dell'esecutore corrente
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
+   *  \return <x1, x2, .., xN> -> f(n, f(x1, f(x2, ...f(xN-1, xN))))
+   */
+  template <bool par, typename T, typename F>
+  inline auto insert (F f, const T& n, associative_t, Cutoff cutoff = Cutoff()) {
+    return Insert<par, T, F, associative_t>{f, n, {}, cutoff};
+  }
+
+  /*! \brief Operazione di "fold" con operazione associativa e commutativa
+   *  \param f Funzione di riduzione, associativa e commutativa
+   *  \param n Elemento neutro per f
+   *  \param par se true i blocchi vengono ridotti in parallelo e combinati
+   *         nell'ordine in cui terminano
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
+   *  \return <x1, x2, .., xN> -> f(n, f(x1, f(x2, ...f(xN-1, xN))))
+   */
+  template <bool par, typename T, typename F>
+  inline auto insert (F f, const T& n, commutative_t, Cutoff cutoff = Cutoff()) {
+    return Insert<par, T, F, commutative_t>{f, n, {}, cutoff};
+  }
+
+  /*! \class Scan
+   *  \brief Somme prefisse di una sequenza (vedi scan)
+   */
+  template <bool par, typename T, typename F, typename Tag = void>
+  struct Scan {
+    F f;
+    T n;
+    Cutoff cutoff;
+
+    T operator() (const T& x) const {
       if (x.isBottom() or !x.isSequence()) return Bottom;
-      Sequence<T> s = x;
-      if (s.size() == 0) return Bottom;
-      // std::accumulate si aspetta un operatore binario,
-      // tuttavia in backus fp le operazioni binarie
-      // sono operazioni unarie che prendono coppie in input
-      using operand_t = immer::box<T>;
-      auto combinator =
-        [&](operand_t a, operand_t b) {
-          return f(Sequence<T>({a, b}));
-        };
-      if constexpr (par) {
-        auto els = s.size();
-        auto n_threads = omp_get_max_threads();
-        auto locals = std::vector<decltype(f(x))>(n_threads);
-        auto local_acc = [&](auto first, auto last){
-          return std::accumulate(first, last, operand_t(n), combinator);
-        };
-        auto firstel = s.begin();
-
-        #pragma omp parallel for num_threads(n_threads)
-        for (auto i = 0; i < n_threads; i++) {
-          locals[i] = local_acc(firstel + els*i/n_threads, firstel + els*(i+1)/n_threads);
-        }
-        return std::accumulate(locals.begin(), locals.end(), operand_t(n), combinator);
-      } else {
-        // il primo elemento della sequenza è l'elemento neutro per l'operazione
-        return std::accumulate(s.begin(),
-                               s.end(),
-                               operand_t(n),
-                               combinator);
+      FPAR_TRACE_SPAN("scan", detail::seq_size(x));
+      if (x.isDense()) {
+        return x.visit_dense([&](const auto& d) -> T {
+          return T::pack(detail::scan<par, Tag>(f, n, d.begin(), d.end(), detail::deref<T>(), cutoff));
+        });
       }
-    };
+      const auto& s = x.as_sequence();
+      return T::pack(detail::scan<par, Tag>(f, n, s.begin(), s.end(), detail::deref<T>(), cutoff));
+    }
+  };
+
+  /*! \brief Somme prefisse da sinistra
+   *  \param f Funzione binaria
+   *  \param n Valore iniziale
+   *  \param par ignorato: senza proprietà di f la scan è sequenziale
+   *  \return <x1, .., xN> -> <f(n, x1), f(f(n, x1), x2), .., insert(f, n)(x)>;
+   *          la sequenza vuota resta vuota
+   */
+  template <bool par, typename T, typename F>
+  inline auto scan (F f, const T& n, Cutoff cutoff = Cutoff()) {
+    return Scan<par, T, F>{f, n, cutoff};
+  }
+
+  /*! \brief Somme prefisse da sinistra con operazione associativa
+   *  \param f Funzione binaria, associativa
+   *  \param n Valore iniziale
+   *  \param par se true scan in due passate sui blocchi di insert: riduzione
+   *         dei blocchi e somme prefisse di ogni blocco dal suo accumulo
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
+   *  \return <x1, .., xN> -> <f(n, x1), f(f(n, x1), x2), .., insert(f, n)(x)>
+   */
+  template <bool par, typename T, typename F>
+  inline auto scan (F f, const T& n, associative_t, Cutoff cutoff = Cutoff()) {
+    return Scan<par, T, F, associative_t>{f, n, cutoff};
+  }
+
+  /*! \brief Somme prefisse con operazione associativa e commutativa:
+   *         la commutatività non cambia l'ordine dei risultati, come scan
+   *         associativa
+   */
+  template <bool par, typename T, typename F>
+  inline auto scan (F f, const T& n, commutative_t, Cutoff cutoff = Cutoff()) {
+    return Scan<par, T, F, commutative_t>{f, n, cutoff};
   }
 
+  /*! \class Map
+   *  \brief Funzione restituita da apply_to_all
+   */
+  template <bool par, typename T, typename F>
+  struct Map {
+    F f;
+    Cutoff cutoff;
+
+    T operator() (const T& x) const {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("apply_to_all", detail::seq_size(x));
+      if (x.isDense()) {
+        return x.visit_dense([&](const auto& d) {
+          return build_packed<par, T>(d.size(), [&](size_t i) {
+            return f(T(d[i]));
+          }, cutoff);
+        });
+      }
+      const auto& s = x.as_sequence();
+      if (auto res = detail::map_pairs_kernel<par, T>(f, s)) return *res;
+      return build_packed<par, T>(s.size(), [&](size_t i) {
+        return f(s[i]);
+      }, cutoff);
+    }
+  };
+
   /*! \brief Operazione di "map"
    *  \param f Funzione da applicare agli elementi di una sequenza
    *  \param par se true eseguito su più thread
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
    *  \return <x1, x2, .., xN> -> <f(x1), f(x2), ..., f(xN)>
    */
   template <bool par, typename T, typename F>
-  inline auto apply_to_all (F f) {
-    return [=](const T& x) -> T {
-      if (x.isBottom() or !x.isSequence()) return Bottom;
-      Sequence<T> s = x;
-      auto res = Sequence<T>(s.size());
-      if constexpr (par) {
-        #pragma omp parallel for
-        for (size_t i = 0; i < s.size(); i++) {
-          std::move(res).set(i, f(s[i]));
-        }
-      } else {
-        for(size_t i = 0; i < s.size(); i++) {
-          std::move(res).set(i, f(s[i]));
+  inline auto apply_to_all (F f, Cutoff cutoff = Cutoff()) {
+    return Map<par, T, F>{f, cutoff};
+  }
+
+  /*
+    Fusione dei funzionali composti. Le composizioni riconosciute a tempo di
+    compilazione vengono riscritte in una sola passata sulla sequenza:
+      apply_to_all(f) * apply_to_all(g)  ->  apply_to_all(f * g)
+      insert(f) * apply_to_all(g)        ->  riduzione di g(x1), ..., g(xN)
+      insert(f) * trans                  ->  riduzione delle colonne, senza
+                                             costruire la trasposta
+    Le composizioni con associatività diversa, es. insert(f) * (apply_to_all(g)
+    * trans), vengono prima riassociate. Il risultato è parallelo solo se lo
+    sono tutti i funzionali fusi (una funzione passata ad un funzionale
+    seq_exec può non essere thread-safe) e usa la cutoff del funzionale
+    esterno.
+  */
+
+  template <bool p1, bool p2, typename T, typename F, typename G>
+  inline auto operator*(Map<p1, T, F> f, Map<p2, T, G> g) {
+    return Map<p1 and p2, T, Composed<F, G>>{{f.f, g.f}, f.cutoff};
+  }
+
+  template <bool p1, bool p2, typename T, typename F, typename Tag, typename G, typename H>
+  inline auto operator*(Insert<p1, T, F, Tag, G> f, Map<p2, T, H> g) {
+    auto gh = detail::then(f.g, g.f);
+    return Insert<p1 and p2, T, F, Tag, decltype(gh)>{f.f, f.n, gh, f.cutoff};
+  }
+
+  template <bool p1, bool p2, typename T, typename F, typename G, typename H>
+  inline auto operator*(Map<p1, T, F> f, Composed<Map<p2, T, G>, H> g) {
+    auto fg = f * g.f;
+    return Composed<decltype(fg), H>{fg, g.g};
+  }
+
+  template <bool p1, bool p2, typename T, typename F, typename Tag, typename G, typename H, typename K>
+  inline auto operator*(Insert<p1, T, F, Tag, G> f, Composed<Map<p2, T, H>, K> g) {
+    auto fh = f * g.f;
+    return Composed<decltype(fh), K>{fh, g.g};
+  }
+
+  /*! \class Composed
+   *  \brief insert (eventualmente fuso con apply_to_all) composto con g.
+   *         Se g è trans (sequenziale o parallela) la riduzione avviene
+   *         sulle colonne di x.
+   */
+  template <bool par, typename T, typename F, typename Tag, typename G, typename H>
+  struct Composed<Insert<par, T, F, Tag, G>, H> {
+    Insert<par, T, F, Tag, G> f;
+    H g;
+
+    T operator() (const T& x) const {
+      if constexpr (std::is_same<H, T(*)(const T&)>::value) {
+        if (g == &trans<T> or g == &trans<true, T>) return f.transposed(x);
+      }
+      return f(g(x));
+    }
+  };
+
+  /*! \class Composed
+   *  \brief apply_to_all(f) composto con g. Se g è distl o distr
+   *         (eventualmente composta con h) la distribuzione non viene
+   *         costruita: f viene applicata alle coppie <y, zi> (o <yi, z>)
+   *         indicizzando y e zs, e se f ha una forma binaria (vedi
+   *         detail::Binary) anche le coppie non vengono costruite.
+   */
+  template <bool par, typename T, typename F, typename H>
+  struct Composed<Map<par, T, F>, H> {
+    Map<par, T, F> f;
+    H g;
+
+    T operator() (const T& x) const {
+      using fn = T(*)(const T&);
+      if constexpr (std::is_same<H, fn>::value) {
+        if (auto d = distribution(g)) return distributed(*d, x);
+      } else if constexpr (detail::is_composed<H>::value) {
+        if constexpr (std::is_same<decltype(g.f), fn>::value) {
+          if (auto d = distribution(g.f)) return distributed(*d, g.g(x));
         }
       }
-      return res;
-    };
-  }
+      return f(g(x));
+    }
+
+  private:
+    // true per distl, false per distr
+    static std::optional<bool> distribution (T (*g)(const T&)) noexcept {
+      if (g == &distl<false, T> or g == &distl<true, T>) return true;
+      if (g == &distr<false, T> or g == &distr<true, T>) return false;
+      return std::nullopt;
+    }
+
+    T distributed (bool left, const T& x) const {
+      // gli elementi di una sequenza densa sono atomi
+      if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+      const auto& s = x.as_sequence();
+      if (s.size() != 2) return Bottom;
+      const auto& y = left ? s.front() : s.back();
+      const T& _zs = left ? *s.back() : *s.front();
+      if (_zs.isBottom() or !_zs.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN(left ? "apply_to_all_distl" : "apply_to_all_distr", detail::seq_size(_zs));
+      const detail::Binary<T, F> op(f.f);
+      if (_zs.isDense()) {
+        const T& yv = *y;
+        return _zs.visit_dense([&](const auto& d) {
+          return build_packed<par, T>(d.size(), [&](size_t i) {
+            return left ? op(yv, T(d[i])) : op(T(d[i]), yv);
+          }, f.cutoff);
+        });
+      }
+      const auto& zs = _zs.as_sequence();
+      return build_packed<par, T>(zs.size(), [&](size_t i) {
+        return left ? op(y, zs[i]) : op(zs[i], y);
+      }, f.cutoff);
+    }
+  };
 
   /*! \brief Rende f una funzione unaria (simile al currying)
-   *  \param f Funzione da rendere unaria
+   *  \param f Funzione da rendere unaria; se ha una forma binaria (vedi
+   *         detail::Binary) la coppia <x,y> non viene costruita
    *  \param x Primo parametro da passare a f
    *  \return y -> f(<x,y>)
    */
   template <typename T, typename F>
   inline auto binary_to_unary (F f, const T& x) {
+    const detail::Binary<T, F> op(f);
     return [=](const T& y) -> T {
-      using box_t = immer::box<T>;
-      return f(Sequence<T>({box_t(x), box_t(y)}));
+      return op(x, y);
     };
   }
 
   /*! \brief Costrutto di iterazione
    *  \param p Funzione di "guardia"
-   *  \param f "Corpo" del while
+   *  \param f "Corpo" del while. Lo stato del ciclo appartiene solo al ciclo
+   *         e viene passato a f come temporaneo: se f accetta un T&& può
+   *         spostarne le sequenze (Sequence<T>(std::move(x)))
+   *         e aggiornarle con le operazioni rvalue di immer, che dopo la
+   *         prima iterazione modificano i nodi in place invece di copiarne
+   *         i cammini
    *  \return x -> {while(p(x)) {x = f(x)}; return x;}
    */
   template <typename T, typename P, typename F>
   inline auto while_form (P p, F f) {
     return [=](const T& x) -> T {
-      T px;
-      auto _x(x);
+      FPAR_TRACE_SPAN("while_form", 0);
       // Backus la definisce ricorsivamente
       // Per semplificare si sfrutta il costrutto while del C++
-      do {
+      T _x(x);
+      while (true) {
+        cancellation_point();
         if (_x.isBottom()) return Bottom;
-        px = p(_x);
-        if (px.isBottom()) return Bottom;
-        _x = f(_x);
-        if (!px.template is<bool>()) return Bottom;
-      } while ((bool)px);
-      return _x;
+        T px = p(_x);
+        if (px.isBottom() or !px.template is<bool>()) return Bottom;
+        if (!(bool)px) return _x;
+        _x = f(std::move(_x));
+      }
     };
   }
 
+  /*! \brief Costrutto di iterazione con passo speculativo
+   *  \param p Funzione di "guardia"
+   *  \param f "Corpo" del while, indipendente da p
+   *  \param par se true ad ogni iterazione f(x) viene calcolata come task
+   *         dell'esecutore corrente mentre il thread chiamante calcola p(x);
+   *         al più un passo è in volo e, se p(x) è falso, riceve la richiesta
+   *         di stop. Lo stato è condiviso con il task, quindi f non lo
+   *         aggiorna in place: conviene se p costa quanto f
+   *  \return x -> {while(p(x)) {x = f(x)}; return x;}
+   */
+  template <bool par, typename T, typename P, typename F>
+  inline auto while_form (P p, F f, speculative_t) {
+    if constexpr (!par) {
+      return while_form<T>(p, f);
+    } else {
+      return [=](const T& x) -> T {
+        FPAR_TRACE_SPAN("while_form", 0);
+        auto& ex = current_executor();
+        T _x(x);
+        while (true) {
+          cancellation_point();
+          if (_x.isBottom()) return Bottom;
+          StopSource fstop;
+          auto fx = spawn(ex, [=, tk = fstop.token()](){ StopScope s(tk); return f(T(_x)); });
+          T px;
+          try {
+            px = p(_x);
+          } catch (...) {
+            fstop.request_stop();
+            throw;
+          }
+          if (px.isBottom() or !px.template is<bool>()) {
+            fstop.request_stop();
+            return Bottom;
+          }
+          if (!(bool)px) {
+            fstop.request_stop();
+            return _x;
+          }
+          _x = fx.get();
+        }
+      };
+    }
+  }
+
+  /*! \brief Costrutto di iterazione senza speculazione (vedi while_form) */
+  template <bool par, typename T, typename P, typename F>
+  inline auto while_form (P p, F f, lazy_t) {
+    return while_form<T>(p, f);
+  }
+
   /*! \brief Operazione di "zip"
    *  \param f  Funzione da applicare agli elementi che occorono
-                nella stessa posizione
+                nella stessa posizione; se ha una forma binaria (vedi
+                detail::Binary) le coppie non vengono costruite
    *  \param par se true eseguito su più thread
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
    *  \return <<x1, ..., xN>, <y1, ..., yN>>
                 -> <f(x1, y1), ..., f(xN, yN)>
    */
   template <bool par, typename T, typename F>
-  inline auto zip (F f) {
+  inline auto zip (F f, Cutoff cutoff = Cutoff()) {
+    const detail::Binary<T, F> op(f);
     return [=](const T& x) -> T {
-      if (x.isBottom() or !x.isSequence()) return Bottom;
-      Sequence<T> s = x;
+      // gli elementi di una sequenza densa sono atomi
+      if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+      const auto& s = x.as_sequence();
       if (s.size() != 2) return Bottom;
-      auto _y = *s.front();
-      auto _z = *s.back();
+      const T& _y = *s.front();
+      const T& _z = *s.back();
       if (!_y.isSequence() or !_z.isSequence()) return Bottom;
-      Sequence<T> y = _y;
-      Sequence<T> z = _z;
-      if (y.size() != z.size()) return Bottom;
-      auto res = Sequence<T>(y.size());
-      if constexpr (par) {
-        #pragma omp parallel for
-        for (size_t i = 0; i < y.size(); i++) {
-          std::move(res).set(i, f(Sequence<T>({y[i], z[i]})));
-        }
-      } else {
-        for (size_t i = 0; i < y.size(); i++) {
-          std::move(res).set(i, f(Sequence<T>({y[i], z[i]})));
-        }
+      FPAR_TRACE_SPAN("zip", detail::seq_size(_y));
+      if (_y.isDense() and _z.isDense()) { // coppie dense se possibile
+        auto res = _y.visit_dense([&](const auto& y) -> std::optional<T> {
+          using dense_t = std::decay_t<decltype(y)>;
+          if (!_z.template is<dense_t>()) return std::nullopt;
+          const auto& z = _z.template get<dense_t>();
+          if (y.size() != z.size()) return T(Bottom);
+          if (auto res = detail::zip_kernel<par, T>(f, y, z)) return res;
+          return build_packed<par, T>(y.size(), [&](size_t i) {
+            return op(T(y[i]), T(z[i]));
+          }, cutoff);
+        });
+        if (res) return *res;
       }
-      return res;
+      const detail::boxed_ref<T> y(_y), z(_z);
+      if (y->size() != z->size()) return Bottom;
+      return build_packed<par, T>(y->size(), [&](size_t i) {
+        return op((*y)[i], (*z)[i]);
+      }, cutoff);
     };
   }
 }
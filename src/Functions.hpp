@@ -9,11 +9,54 @@
  */
 
 #include "Object.hpp"
+#include "Builder.hpp"
+#include "Binary.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <omp.h>
 
 namespace fpar {
 
+  namespace detail {
+    // numero di elementi di una sequenza, densa o meno
+    template <typename T>
+    inline size_t seq_size (const T& x) {
+      if (x.isDense()) {
+        return x.visit_dense([](const auto& d) -> size_t { return d.size(); });
+      }
+      return x.as_sequence().size();
+    }
+
+    /*! \class boxed_ref
+     *  \brief Sequenza di box di una sequenza x: un riferimento se x è già
+     *         una sequenza di box, altrimenti la conversione di x (densa)
+     */
+    template <typename T>
+    class boxed_ref {
+    private:
+      Sequence<T> _owned;
+      const Sequence<T>* _seq;
+
+    public:
+      explicit boxed_ref (const T& x) : _seq(x.template get_if<Sequence<T>>()) {
+        if (!_seq) {
+          _owned = x;
+          _seq = &_owned;
+        }
+      }
+
+      boxed_ref (const boxed_ref&) = delete;
+      boxed_ref& operator= (const boxed_ref&) = delete;
+
+      const Sequence<T>& operator* () const noexcept { return *_seq; }
+      const Sequence<T>* operator-> () const noexcept { return _seq; }
+    };
+  }
+
   /*! \brief Operazione di accesso ad elementi di una sequenza
    *  \param i Indice (compreso tra 1 ed N) dell'elemento da accedere
    *  \return i -> x_i
@@ -22,7 +65,13 @@ namespace fpar {
   inline auto select (unsigned int i) {
     return [=](const T& x) -> T {
       if (x.isBottom() or !x.isSequence()) return Bottom;
-      Sequence<T> s = x;
+      if (x.isDense()) {
+        return x.visit_dense([&](const auto& d) -> T {
+          if (i == 0 or d.size() < i) return Bottom;
+          return d[i-1];
+        });
+      }
+      const auto& s = x.as_sequence();
       if (i == 0 or s.size() < i) return Bottom;
       return *(s[i-1]);
     };
@@ -35,7 +84,14 @@ namespace fpar {
   template <typename T>
   inline T tail (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isDense()) {
+      return x.visit_dense([](const auto& d) -> T {
+        using dense_t = std::decay_t<decltype(d)>;
+        if (d.size() == 0) return Bottom;
+        return dense_t(d.begin() + 1, d.end());
+      });
+    }
+    const auto& s = x.as_sequence();
     if (s.size() == 0) return Bottom;
     return s.drop(1);
   }
@@ -56,8 +112,7 @@ namespace fpar {
   template <typename T>
   inline T null (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
-    return (s.size() == 0);
+    return (detail::seq_size(x) == 0);
   }
 
   /*! \brief Restituisce una sequenza al contrario
@@ -67,7 +122,14 @@ namespace fpar {
   template <typename T>
   inline T reverse (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isDense()) {
+      return x.visit_dense([](const auto& d) -> T {
+        using dense_t = std::decay_t<decltype(d)>;
+        return dense_t(std::make_reverse_iterator(d.end()),
+                       std::make_reverse_iterator(d.begin()));
+      });
+    }
+    const auto& s = x.as_sequence();
     return Sequence<T>(s.rbegin(), s.rend());
   }
 
@@ -77,26 +139,20 @@ namespace fpar {
    */
   template <bool par, typename T>
   inline T distl (const T& x) {
-    if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    // gli elementi di una sequenza densa sono atomi
+    if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom; // controllo che in input ci sia una coppia
-    auto y = *s.front();
-    auto _zs = *s.back();
+    const auto& y = s.front();
+    const T& _zs = *s.back();
     // controllo che il secondo elemento sia una sequenza
     if (_zs.isBottom() or !_zs.isSequence()) return Bottom;
-    Sequence<T> zs = _zs; // cast a sequenza
-    auto res = Sequence<T>(zs.size());
-    if constexpr (par) {
-      #pragma omp parallel for
-      for (size_t i = 0; i < zs.size(); i++) {
-        std::move(res).set(i, Sequence<T>({y, zs[i]}));
-      }
-    } else {
-      for (size_t i = 0; i < zs.size(); i++) {
-        std::move(res).set(i, Sequence<T>({y, zs[i]}));
-      }
-    }
-    return res;
+    const detail::boxed_ref<T> ref(_zs);
+    const auto& zs = *ref;
+    FPAR_TRACE_SPAN("distl", zs.size());
+    return build_sequence<par, T>(zs.size(), [&](size_t i) {
+      return Sequence<T>({y, zs[i]});
+    });
   }
 
   /*! \brief Distribuzione di un oggetto in una sequenza
@@ -105,26 +161,20 @@ namespace fpar {
    */
   template <bool par, typename T>
   inline T distr (const T& x) {
-    if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    // gli elementi di una sequenza densa sono atomi
+    if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom; // controllo che in input ci sia una coppia
-    auto _ys = *s.front();
-    auto z = *s.back();
+    const T& _ys = *s.front();
+    const auto& z = s.back();
     // controllo che il secondo elemento sia una sequenza
     if (_ys.isBottom() or !_ys.isSequence()) return Bottom;
-    Sequence<T> ys = _ys; // cast a sequenza
-    auto res = Sequence<T>(ys.size());
-    if constexpr (par) {
-      #pragma omp parallel for
-      for (size_t i = 0; i < ys.size(); i++) {
-        std::move(res).set(i, Sequence<T>({ys[i], z}));
-      }
-    } else {
-      for (size_t i = 0; i < ys.size(); i++) {
-        std::move(res).set(i, Sequence<T>({ys[i], z}));
-      }
-    }
-    return res;
+    const detail::boxed_ref<T> ref(_ys);
+    const auto& ys = *ref;
+    FPAR_TRACE_SPAN("distr", ys.size());
+    return build_sequence<par, T>(ys.size(), [&](size_t i) {
+      return Sequence<T>({ys[i], z});
+    });
   }
 
   /*! \brief Restituisce il numero di elementi di una sequenza
@@ -134,8 +184,7 @@ namespace fpar {
   template <typename T>
   inline T length (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
-    return s.size();
+    return detail::seq_size(x);
   }
 
   /*! \brief Check tipo atomo
@@ -146,8 +195,7 @@ namespace fpar {
   inline T atom (const T& x) {
     if (x.isBottom()) return Bottom;
     if (x.isSequence()) {
-      Sequence<T> s = x;
-      if (s.size() == 0) return true;
+      if (detail::seq_size(x) == 0) return true;
       return false;
     }
     return true;
@@ -155,64 +203,142 @@ namespace fpar {
 
   /*! \brief Controllo equivalenza tra oggetti
    *  \param x Coppia <x1,x2>
-   *  \return true se x1 è x2 sono uguali, false altrimenti
+   *  \return true se x1 è x2 sono uguali, false altrimenti.
+   *          Gli atomi di x sono confrontati se di tipo O; le sequenze sono
+   *          confrontate strutturalmente (vedi Object::operator==): due
+   *          sequenze con la stessa rappresentazione immer, o che condividono
+   *          dei box, non vengono visitate nelle parti comuni
    */
   template <typename O, typename T>
   inline T equals (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2) return Bottom;
+      return (d[0] == d[1]);
+    }
+    // atomi di un altro tipo: mai uguali
+    if (x.isDense()) return (detail::seq_size(x) == 2) ? T(false) : T(Bottom);
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.template is<O>() and _z.template is<O>()) {
-      O y = _y;
-      O z = _z;
-      return (y == z);
-    } else if (_y.isSequence() and _z.isSequence()) {
-      Sequence<T> y = _y;
-      Sequence<T> z = _z;
-      if (y.size() != z.size()) return false;
-      auto yit = y.begin();
-      auto zit = z.begin();
-      for (; yit != y.end(); yit++) {
-        auto _eq = equals<O>((T)Sequence<T>({*yit, *zit}));
-        if (_eq.isBottom()) return Bottom;
-        bool eq = _eq;
-        if (!eq) return false;
-        zit++;
-      }
-      return true;
+    return binary::equals<O, T>(*s.front(), *s.back());
+  }
+
+  /*! \brief Confronto tra atomi
+   *  \param x Coppia <x1,x2> di atomi di tipo O
+   *  \return true se x1 < x2, false altrimenti; bottom se x non è una coppia
+   *          di atomi di tipo O
+   */
+  template <typename O, typename T>
+  inline T less_op (const T& x) {
+    if (x.isBottom() or !x.isSequence()) return Bottom;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2) return Bottom;
+      return (d[0] < d[1]);
     }
-    return false;
+    if (x.isDense()) return Bottom; // atomi di un altro tipo
+    const auto& s = x.as_sequence();
+    if (s.size() != 2) return Bottom;
+    return binary::less_op<O, T>(*s.front(), *s.back());
+  }
+
+  namespace detail {
+    // lato dei blocchi della trasposizione: un blocco di righe e colonne
+    // resta in cache mentre viene letto per righe e scritto per colonne
+    constexpr size_t trans_tile = 64;
   }
 
   /*! \brief Trasposizione di sequenze
    *  \param x Sequenze <<x1,...,xN>,<y1,...,yN>,...,<z1,...,zN>>
-   *  \return <<x1,y1,...,z1>,<x2,y2,...,z2>,...,<xN,yN,...,zN>>
+   *  \param par se true le righe del risultato sono costruite in parallelo
+   *  \return <<x1,y1,...,z1>,<x2,y2,...,z2>,...,<xN,yN,...,zN>>; se le righe
+   *          hanno lunghezze diverse N è la lunghezza minima
    */
-  template <typename T>
+  template <bool par, typename T>
   inline T trans (const T& x) {
+    using detail::trans_tile;
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    using seq_t = Sequence<T>;
-    seq_t s = x;
-    size_t els = 0;
-    for (auto _row : s) {
-      if (_row->isBottom() or !_row->isSequence()) return Bottom;
-      seq_t row = *_row;
-      if (els == 0 or row.size() < els) els = row.size();
+    if (x.isDense()) return detail::seq_size(x) == 0 ? T(Sequence<T>()) : T(Bottom); // righe atomiche
+    const auto& s = x.as_sequence();
+    FPAR_TRACE_SPAN("trans", s.size());
+    // fast path: righe dense dello stesso tipo, trasposte su array
+    if (s.size() > 0 and s[0]->isDense()) {
+      auto res = s[0]->visit_dense([&](const auto& first) -> std::optional<T> {
+        using dense_t = std::decay_t<decltype(first)>;
+        using atom_t = typename dense_t::value_type;
+        auto rows = std::vector<dense_t>();
+        rows.reserve(s.size());
+        size_t els = first.size();
+        for (const auto& row : s) {
+          if (!row->template is<dense_t>()) return std::nullopt;
+          rows.push_back(*row);
+          if (rows.back().size() < els) els = rows.back().size();
+        }
+        auto k = rows.size();
+        return T(build_blocks<par, T>(els, trans_tile, [&](size_t lo, size_t hi) {
+          auto transd = Sequence<T>().transient();
+          auto cols = std::vector<typename dense_t::transient_type>();
+          auto out = std::vector<atom_t*>();
+          cols.reserve(trans_tile);
+          for (size_t i0 = lo; i0 < hi; i0 += trans_tile) {
+            auto i1 = std::min(i0 + trans_tile, hi);
+            cols.clear();
+            out.clear();
+            for (size_t i = i0; i < i1; i++) {
+              cols.push_back(dense_t(k).transient());
+              out.push_back(cols.back().data_mut());
+            }
+            for (size_t j0 = 0; j0 < k; j0 += trans_tile) {
+              auto j1 = std::min(j0 + trans_tile, k);
+              for (size_t j = j0; j < j1; j++) {
+                const atom_t* row = rows[j].data();
+                for (size_t i = i0; i < i1; i++) out[i-i0][j] = row[i];
+              }
+            }
+            for (auto& col : cols) transd.push_back(T(std::move(col).persistent()));
+          }
+          return std::move(transd).persistent();
+        }));
+      });
+      if (res) return *res;
     }
-
-    seq_t transd;
-    for (size_t i = 0; i < els; i++) {
-      seq_t transd_row;
-      for (size_t j = 0; j < s.size(); j++) {
-        seq_t jth_head = *(s[j]);
-        std::move(transd_row).push_back(jth_head[i]);
-      }
-      std::move(transd).push_back(transd_row);
+    // le righe vengono estratte una sola volta
+    auto rows = std::vector<Sequence<T>>();
+    rows.reserve(s.size());
+    size_t els = detail::npos;
+    for (const auto& row : s) {
+      if (row->isBottom() or !row->isSequence()) return Bottom;
+      rows.push_back(*row);
+      if (rows.back().size() < els) els = rows.back().size();
     }
+    if (rows.empty()) return Sequence<T>();
+    return build_blocks<par, T>(els, trans_tile, [&](size_t lo, size_t hi) {
+      auto transd = Sequence<T>().transient();
+      auto cols = std::vector<typename Sequence<T>::transient_type>();
+      for (size_t i0 = lo; i0 < hi; i0 += trans_tile) {
+        auto i1 = std::min(i0 + trans_tile, hi);
+        cols.clear();
+        for (size_t i = i0; i < i1; i++) cols.push_back(Sequence<T>().transient());
+        // ogni riga è letta in sequenza con un iteratore, senza ricerche
+        // nell'albero per ogni elemento
+        for (const auto& row : rows) {
+          auto it = row.begin() + i0;
+          for (size_t i = i0; i < i1; i++, ++it) cols[i-i0].push_back(*it);
+        }
+        for (auto& col : cols) transd.push_back(T(std::move(col).persistent()));
+      }
+      return std::move(transd).persistent();
+    });
+  }
 
-    return transd;
+  /*! \brief Trasposizione di sequenze (sequenziale)
+   *  \param x Sequenze <<x1,...,xN>,<y1,...,yN>,...,<z1,...,zN>>
+   *  \return <<x1,y1,...,z1>,<x2,y2,...,z2>,...,<xN,yN,...,zN>>
+   */
+  template <typename T>
+  inline T trans (const T& x) {
+    return trans<false, T>(x);
   }
 
   /*! \brief Operazione logica AND
@@ -222,16 +348,17 @@ namespace fpar {
   template <typename T>
   inline T and_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if constexpr (T::template holds<DenseSequence<bool>>) {
+      if (x.template is<DenseSequence<bool>>()) { // coppia densa di atomi
+        DenseSequence<bool> d = x;
+        if (d.size() != 2) return Bottom;
+        return (d[0] and d[1]);
+      }
+    }
+    if (x.isDense()) return Bottom; // atomi non booleani
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<bool>() and _z.template is<bool>()) {
-      bool y = _y;
-      bool z = _z;
-      return (y and z);
-    } else return Bottom;
+    return binary::and_op<T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione logica OR
@@ -241,16 +368,17 @@ namespace fpar {
   template <typename T>
   inline T or_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if constexpr (T::template holds<DenseSequence<bool>>) {
+      if (x.template is<DenseSequence<bool>>()) { // coppia densa di atomi
+        DenseSequence<bool> d = x;
+        if (d.size() != 2) return Bottom;
+        return (d[0] or d[1]);
+      }
+    }
+    if (x.isDense()) return Bottom; // atomi non booleani
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<bool>() and _z.template is<bool>()) {
-      bool y = _y;
-      bool z = _z;
-      return (y or z);
-    } else return Bottom;
+    return binary::or_op<T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione logica NOT
@@ -271,16 +399,15 @@ namespace fpar {
   template <typename O, typename T>
   inline T add_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2) return Bottom;
+      return (d[0] + d[1]);
+    }
+    if (x.isDense()) return Bottom; // atomi di un altro tipo
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<O>() and _z.template is<O>()) {
-      O y = _y;
-      O z = _z;
-      return (y + z);
-    } else return Bottom;
+    return binary::add_op<O, T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione di sottrazione generica
@@ -290,16 +417,15 @@ namespace fpar {
   template <typename O, typename T>
   inline T sub_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2) return Bottom;
+      return (d[0] - d[1]);
+    }
+    if (x.isDense()) return Bottom; // atomi di un altro tipo
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<O>() and _z.template is<O>()) {
-      O y = _y;
-      O z = _z;
-      return (y - z);
-    } else return Bottom;
+    return binary::sub_op<O, T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione di moltiplicazione generica
@@ -309,16 +435,15 @@ namespace fpar {
   template <typename O, typename T>
   inline T mul_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2) return Bottom;
+      return (d[0] * d[1]);
+    }
+    if (x.isDense()) return Bottom; // atomi di un altro tipo
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<O>() and _z.template is<O>()) {
-      O y = _y;
-      O z = _z;
-      return (y * z);
-    } else return Bottom;
+    return binary::mul_op<O, T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione di divisione generica
@@ -328,17 +453,15 @@ namespace fpar {
   template <typename O, typename T>
   inline T div_op (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.template is<DenseSequence<O>>()) { // coppia densa di atomi
+      const auto& d = x.template get<DenseSequence<O>>();
+      if (d.size() != 2 or d[1] == 0) return Bottom;
+      return (d[0] / d[1]);
+    }
+    if (x.isDense()) return Bottom; // atomi di un altro tipo
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom;
-    auto _y = *s.front();
-    auto _z = *s.back();
-    if (_y.isBottom() or _z.isBottom()) return Bottom;
-    if (_y.template is<O>() and _z.template is<O>()) {
-      O z = _z;
-      if (z == 0) return Bottom;
-      bool y = _y;
-      return (y / z);
-    } else return Bottom;
+    return binary::div_op<O, T>(*s.front(), *s.back());
   }
 
   /*! \brief Operazione di append in testa ad una sequenza
@@ -347,15 +470,14 @@ namespace fpar {
    */
   template <typename T>
   inline T apndl (const T& x) {
-    if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom; // controllo che in input ci sia una coppia
-    auto y = s.front();
-    auto _zs = *s.back();
+    const auto& y = s.front();
+    const T& _zs = *s.back();
     // controllo che il secondo elemento sia una sequenza
     if (_zs.isBottom() or !_zs.isSequence()) return Bottom;
-    Sequence<T> zs = _zs;
-    return zs.push_front(y);
+    return detail::boxed_ref<T>(_zs)->push_front(y);
   }
 
   /*! \brief Operazione di append in coda ad una sequenza
@@ -364,22 +486,27 @@ namespace fpar {
    */
   template <typename T>
   inline T apndr (const T& x) {
-    if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+    const auto& s = x.as_sequence();
     if (s.size() != 2) return Bottom; // controllo che in input ci sia una coppia
-    auto _ys = *s.front();
-    auto z = s.back();
+    const T& _ys = *s.front();
+    const auto& z = s.back();
     // controllo che il primo elemento sia una sequenza
     if (_ys.isBottom() or !_ys.isSequence()) return Bottom;
-    Sequence<T> ys = _ys;
-    return ys.push_back(z);
+    return detail::boxed_ref<T>(_ys)->push_back(z);
   }
 
   // rselect: come select ma da destra
   template <typename T>
   inline T rselect (unsigned int i, const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isDense()) {
+      return x.visit_dense([&](const auto& d) -> T {
+        if (i == 0 or d.size() < i) return Bottom;
+        return d[d.size()-i];
+      });
+    }
+    const auto& s = x.as_sequence();
     auto len = s.size();
     if (i == 0 or len < i) return Bottom;
     return *(s[len-i]);
@@ -389,7 +516,13 @@ namespace fpar {
   template <typename T>
   inline T rtail (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
+    if (x.isDense()) {
+      return x.visit_dense([](const auto& d) -> T {
+        if (d.size() == 0) return Bottom;
+        return d.take(d.size()-1);
+      });
+    }
+    const auto& s = x.as_sequence();
     auto len = s.size();
     if (len == 0) return Bottom;
     return s.take(len-1);
@@ -402,9 +535,9 @@ namespace fpar {
   template <typename T>
   inline T rotl (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
-    if (s.size() < 2) return x;
-    return s.drop(1).push_back(s.front());
+    const detail::boxed_ref<T> s(x);
+    if (s->size() < 2) return x;
+    return s->drop(1).push_back(s->front());
   }
 
   /*! \brief Shift ciclico di una sequenza verso dx
@@ -414,10 +547,30 @@ namespace fpar {
   template <typename T>
   inline T rotr (const T& x) {
     if (x.isBottom() or !x.isSequence()) return Bottom;
-    Sequence<T> s = x;
-    auto len = s.size();
+    const detail::boxed_ref<T> s(x);
+    auto len = s->size();
     if (len < 2) return x;
-    return s.take(len-1).push_front(s.back());
+    return s->take(len-1).push_front(s->back());
+  }
+
+  /*! \brief Conversione in sequenza densa
+   *  \param x Sequenza <x1,x2,...,xN> di atomi di tipo O
+   *  \return la stessa sequenza memorizzata come DenseSequence<O>,
+   *          bottom se qualche elemento non è un atomo di tipo O
+   */
+  template <typename O, typename T>
+  inline T dense (const T& x) {
+    if (x.isBottom() or !x.isSequence()) return Bottom;
+    if (x.template is<DenseSequence<O>>()) return x;
+    // atomi di un altro tipo
+    if (x.isDense()) return (detail::seq_size(x) == 0) ? T(DenseSequence<O>()) : T(Bottom);
+    const auto& s = x.as_sequence();
+    auto res = DenseSequence<O>().transient();
+    for (const auto& el : s) {
+      if (!el->template is<O>()) return Bottom;
+      res.push_back(*el);
+    }
+    return std::move(res).persistent();
   }
 
 }
@@ -0,0 +1,89 @@
+#ifndef GRAIN_HPP
+#define GRAIN_HPP
+
+/** \file Grain.hpp
+ * Soglia sequenziale dei funzionali paralleli
+ * Sotto una certa quantità di lavoro l'esecuzione parallela costa più di
+ * quella sequenziale (creazione dei task, concatenazione dei blocchi). Ogni
+ * funzionale con par = true accetta una Cutoff: il lavoro viene stimato
+ * calcolando il primo elemento nel thread chiamante e moltiplicando il suo
+ * costo per il numero di elementi rimasti. Se la stima è sotto la soglia
+ * il resto viene calcolato sequenzialmente. In questo modo le chiamate
+ * annidate su sequenze piccole non generano task, mentre un apply_to_all su
+ * pochi elementi molto costosi (es. le righe di MM) resta parallelo.
+ */
+
+#include "Executor.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+// soglia di default sul lavoro stimato, in ns: 0 esegue sempre in parallelo
+#ifndef FPAR_DEFAULT_CUTOFF_NS
+#define FPAR_DEFAULT_CUTOFF_NS 20000
+#endif
+
+namespace fpar {
+
+  /*! \class Cutoff
+   *  \brief Politica di scelta tra esecuzione parallela e sequenziale.
+   *         Si esegue in parallelo se ci sono almeno min_elements elementi e
+   *         il lavoro stimato è di almeno min_ns nanosecondi.
+   *           Cutoff()               stima del costo, soglia di default
+   *           Cutoff::elements(1000) soglia statica sul numero di elementi
+   *           Cutoff::cost(100000)   soglia sul lavoro stimato
+   *           Cutoff::always()       sempre in parallelo
+   *           Cutoff::never()        sempre sequenziale
+   */
+  struct Cutoff {
+    size_t min_elements = 2;
+    uint64_t min_ns = FPAR_DEFAULT_CUTOFF_NS;
+
+    static constexpr Cutoff always () noexcept { return {0, 0}; }
+    static constexpr Cutoff never () noexcept { return {std::numeric_limits<size_t>::max(), 0}; }
+    static constexpr Cutoff elements (size_t n) noexcept { return {n, 0}; }
+    static constexpr Cutoff cost (uint64_t ns) noexcept { return {2, ns}; }
+  };
+
+  namespace detail {
+    inline uint64_t elapsed_ns (std::chrono::steady_clock::time_point since) {
+      auto d = std::chrono::steady_clock::now() - since;
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    }
+
+    /*! \brief Decide se calcolare in parallelo N elementi
+     *  \param probe Calcola i primi k elementi nel thread chiamante e
+     *         restituisce k; viene invocata solo se serve stimare il costo
+     *  \param done Numero di elementi già calcolati da probe
+     *  \return true se gli elementi da done a N-1 vanno calcolati in parallelo
+     */
+    template <typename P>
+    inline bool worth_parallel (const Cutoff& c, const Executor& ex, size_t n,
+                                P&& probe, size_t& done) {
+      done = 0;
+      if (ex.concurrency() < 2 or n < 2 or n < c.min_elements) return false;
+      if (c.min_ns == 0) return true;
+      auto start = std::chrono::steady_clock::now();
+      {
+        FPAR_TRACE_SPAN("task", 0);
+        done = probe();
+      }
+      if (done >= n) return false;
+      auto per_element = elapsed_ns(start) / double(done);
+      return per_element * (n - done) >= c.min_ns;
+    }
+
+    /*! \brief Numero di elementi di un blocco sequenziale
+     *  \param per_element_ns Costo stimato di un elemento
+     *  \return elementi necessari per circa min_ns di lavoro, almeno 1
+     */
+    inline size_t cost_grain (const Cutoff& c, double per_element_ns) noexcept {
+      if (per_element_ns <= 0 or c.min_ns == 0) return 1;
+      auto g = c.min_ns / per_element_ns;
+      return g < 1 ? 1 : static_cast<size_t>(g);
+    }
+  }
+}
+
+#endif
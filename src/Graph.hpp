@@ -0,0 +1,724 @@
+#ifndef GRAPH_HPP
+#define GRAPH_HPP
+
+/** \file Graph.hpp
+ * Programmi FP come grafi
+ * I funzionali di Functionals.hpp sono lambda opache: la scelta tra par_exec
+ * e seq_exec è fatta a mano ad ogni chiamata e le sole ottimizzazioni sono
+ * le fusioni riconosciute dai tipi. Un graph::Expr descrive invece il
+ * programma come un DAG di nodi (composizione, construct, apply_to_all,
+ * insert, select, costanti e primitive), che graph::compile ottimizza:
+ *  - le composizioni vengono riassociate e fuse (apply_to_all * apply_to_all,
+ *    insert * apply_to_all, insert * trans senza costruire la trasposta);
+ *  - i sotto-termini uguali diventano lo stesso nodo e, se usati più volte,
+ *    vengono calcolati una volta per argomento;
+ *  - dentro apply_to_all il primo stadio applicato ad una select viene
+ *    ricordato per identità dell'argomento: un termine invariante come
+ *    trans * select(2), applicato ad ogni coppia prodotta da distl, viene
+ *    calcolato una sola volta;
+ *  - ogni nodo sceglie a runtime se essere parallelo: il parallelismo
+ *    dell'esecutore viene diviso tra gli elementi di apply_to_all e insert
+ *    e tra i rami di construct, che sono calcolati come task concorrenti.
+ *
+ *   auto ip = graph::insert<Number>(add_op<int, Number>, Number(0), associative) *
+ *             graph::apply_to_all(graph::prim<Number>(mul_op<int, Number>)) *
+ *             graph::trans<Number>();
+ *   auto mm = graph::apply_to_all(graph::apply_to_all(ip) * graph::distl<Number>()) *
+ *             graph::distr<Number>() *
+ *             graph::construct<Number>({graph::select<Number>(1),
+ *                                       graph::trans<Number>() * graph::select<Number>(2)});
+ *   auto program = graph::compile(mm);
+ *   Number r = program(x);
+ *
+ * batch_eval applica un programma ad un lotto di input indipendenti, ad
+ * esempio migliaia di coppie di vettori piccoli per ip, valutando un nodo
+ * alla volta su tutto il lotto. I risultati intermedi di uno stadio sono una
+ * colonna, densa se omogenea: la scelta del nodo e del parallelismo avviene
+ * una volta per stadio invece che una volta per input; le primitive
+ * aritmetiche elaborano la colonna con un solo ciclo vettoriale; i corpi di
+ * apply_to_all vengono applicati una volta sola alla concatenazione degli
+ * elementi di tutti gli input.
+ *
+ *   Number rs = graph::batch_eval(program, xs); // <program(x1), ..., program(xN)>
+ */
+
+#include "Object.hpp"
+#include "Functions.hpp"
+#include "Functionals.hpp"
+#include "Executor.hpp"
+#include "Grain.hpp"
+#include "Kernels.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace fpar {
+namespace graph {
+
+  enum class Kind { id, prim, select, constant, compose, construct, map, insert };
+
+  /*! \class Node
+   *  \brief Nodo di un programma. I nodi sono immutabili e condivisi.
+   */
+  template <typename T>
+  struct Node {
+    using fn_t = T (*)(const T&);
+
+    Kind kind;
+    std::string name;                // prim: nome (le primitive con lo stesso nome sono uguali)
+    std::function<T(const T&)> fn;   // prim: funzione; insert: funzione di riduzione
+    fn_t fn_par = nullptr;           // prim: versione parallela, se esiste
+    unsigned index = 0;              // select
+    T value;                         // constant: valore; insert: elemento neutro
+    int tag = 0;                     // insert: 0 nessuna proprietà, 1 associativa, 2 commutativa
+    std::vector<std::shared_ptr<const Node>> kids; // compose: {f, g}; construct: fs; map, insert: {g}
+
+    // puntatore a funzione contenuto in fn, se fn ne contiene uno
+    fn_t pointer () const {
+      auto p = fn.template target<fn_t>();
+      return p ? *p : nullptr;
+    }
+  };
+
+  /*! \class Expr
+   *  \brief Programma (o sotto-programma) non ancora compilato
+   */
+  template <typename T>
+  class Expr {
+  private:
+    std::shared_ptr<const Node<T>> _node;
+
+  public:
+    Expr (std::shared_ptr<const Node<T>> n) : _node(std::move(n)) {}
+
+    const Node<T>& node () const noexcept { return *_node; }
+    const std::shared_ptr<const Node<T>>& ptr () const noexcept { return _node; }
+  };
+
+  namespace detail {
+    template <typename T>
+    inline Expr<T> make (Node<T> n) {
+      return Expr<T>(std::make_shared<const Node<T>>(std::move(n)));
+    }
+  }
+
+  /*! \brief Identità: x -> x */
+  template <typename T>
+  inline Expr<T> id () {
+    return detail::make<T>({Kind::id, "id"});
+  }
+
+  /*! \brief Primitiva da puntatore a funzione. trans, distl e distr
+   *         vengono riconosciute ed eseguite in parallelo quando conviene.
+   */
+  template <typename T>
+  inline Expr<T> prim (T (*f)(const T&)) {
+    Node<T> n{Kind::prim, "prim", f};
+    if (f == &fpar::trans<T> or f == &fpar::trans<false, T> or f == &fpar::trans<true, T>) {
+      n.name = "trans";
+      n.fn = &fpar::trans<false, T>;
+      n.fn_par = &fpar::trans<true, T>;
+    } else if (f == &fpar::distl<false, T> or f == &fpar::distl<true, T>) {
+      n.name = "distl";
+      n.fn = &fpar::distl<false, T>;
+      n.fn_par = &fpar::distl<true, T>;
+    } else if (f == &fpar::distr<false, T> or f == &fpar::distr<true, T>) {
+      n.name = "distr";
+      n.fn = &fpar::distr<false, T>;
+      n.fn_par = &fpar::distr<true, T>;
+    }
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Primitiva da una funzione qualsiasi
+   *  \param name Nome della funzione: due primitive con lo stesso nome sono
+   *         considerate la stessa funzione (vuoto: sempre distinta)
+   */
+  template <typename T>
+  inline Expr<T> prim (std::function<T(const T&)> f, std::string name = "") {
+    return detail::make<T>({Kind::prim, std::move(name), std::move(f)});
+  }
+
+  template <typename T>
+  inline Expr<T> trans () { return prim<T>(&fpar::trans<false, T>); }
+
+  template <typename T>
+  inline Expr<T> distl () { return prim<T>(&fpar::distl<false, T>); }
+
+  template <typename T>
+  inline Expr<T> distr () { return prim<T>(&fpar::distr<false, T>); }
+
+  /*! \brief Selettore: <x1, ..., xN> -> xi */
+  template <typename T>
+  inline Expr<T> select (unsigned i) {
+    Node<T> n{Kind::select, "select"};
+    n.index = i;
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Funzione costante: x -> c (bottom se x è bottom) */
+  template <typename T>
+  inline Expr<T> constant (const T& c) {
+    Node<T> n{Kind::constant, "constant"};
+    n.value = c;
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Composizione: x -> f(g(x)) */
+  template <typename T>
+  inline Expr<T> operator* (const Expr<T>& f, const Expr<T>& g) {
+    Node<T> n{Kind::compose, "compose"};
+    n.kids = {f.ptr(), g.ptr()};
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Costrutto: x -> <f1(x), ..., fN(x)> */
+  template <typename T>
+  inline Expr<T> construct (std::initializer_list<Expr<T>> fs) {
+    Node<T> n{Kind::construct, "construct"};
+    for (const auto& f : fs) n.kids.push_back(f.ptr());
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Operazione di "map": <x1, ..., xN> -> <f(x1), ..., f(xN)> */
+  template <typename T>
+  inline Expr<T> apply_to_all (const Expr<T>& f) {
+    Node<T> n{Kind::map, "apply_to_all"};
+    n.kids = {f.ptr()};
+    return detail::make<T>(std::move(n));
+  }
+
+  /*! \brief Operazione di "fold" (vedi fpar::insert)
+   *  \param f Funzione di riduzione; se è un puntatore a funzione la sua
+   *         forma binaria viene usata come in fpar::insert
+   */
+  template <typename T, typename F>
+  inline Expr<T> insert (F f, const T& n) {
+    Node<T> node{Kind::insert, "insert", std::function<T(const T&)>(f)};
+    node.value = n;
+    return detail::make<T>(std::move(node));
+  }
+
+  template <typename T, typename F>
+  inline Expr<T> insert (F f, const T& n, associative_t) {
+    Node<T> node{Kind::insert, "insert", std::function<T(const T&)>(f)};
+    node.value = n;
+    node.tag = 1;
+    return detail::make<T>(std::move(node));
+  }
+
+  template <typename T, typename F>
+  inline Expr<T> insert (F f, const T& n, commutative_t) {
+    Node<T> node{Kind::insert, "insert", std::function<T(const T&)>(f)};
+    node.value = n;
+    node.tag = 2;
+    return detail::make<T>(std::move(node));
+  }
+
+  /*! \brief Rappresentazione testuale, es. "insert * apply_to_all(prim) * trans" */
+  template <typename T>
+  inline std::string to_string (const Expr<T>& e) {
+    const auto& n = e.node();
+    auto kid = [&](size_t i) { return to_string(Expr<T>(n.kids[i])); };
+    switch (n.kind) {
+      case Kind::select: return "select(" + std::to_string(n.index) + ")";
+      case Kind::compose: return kid(0) + " * " + kid(1);
+      case Kind::construct: {
+        std::string s = "[";
+        for (size_t i = 0; i < n.kids.size(); i++) s += (i ? ", " : "") + kid(i);
+        return s + "]";
+      }
+      case Kind::map: return "apply_to_all(" + kid(0) + ")";
+      case Kind::insert: return n.kids.empty() ? "insert" : "insert(" + kid(0) + ")";
+      default: return n.name;
+    }
+  }
+
+  namespace detail {
+    template <typename T>
+    using node_ptr = std::shared_ptr<const Node<T>>;
+
+    template <typename T>
+    inline bool is_select_chain (const Node<T>& n) {
+      if (n.kind == Kind::select) return true;
+      return n.kind == Kind::compose and n.kids[0]->kind == Kind::select and
+             is_select_chain(*n.kids[1]);
+    }
+
+    /*
+      Ottimizzazione di un programma. I nodi vengono ricostruiti dal basso
+      e registrati in una tabella (hash consing): due sotto-termini uguali
+      diventano lo stesso nodo. Le composizioni sono tenute come catene
+      associate a destra, f * (g * (h * ...)), su cui si applicano le fusioni.
+    */
+    template <typename T>
+    class Optimizer {
+    private:
+      std::unordered_multimap<size_t, node_ptr<T>> _table;
+
+      static size_t hash (const Node<T>& n) {
+        auto h = std::hash<std::string>()(n.name);
+        h = fpar::detail::hash_combine(h, size_t(n.kind));
+        h = fpar::detail::hash_combine(h, n.index);
+        for (const auto& k : n.kids) h = fpar::detail::hash_combine(h, std::hash<const void*>()(k.get()));
+        return h;
+      }
+
+      // i figli sono già registrati: basta confrontarne i puntatori
+      static bool same (const Node<T>& a, const Node<T>& b) {
+        if (a.kind != b.kind or a.name != b.name or a.index != b.index or
+            a.tag != b.tag or a.kids != b.kids) return false;
+        switch (a.kind) {
+          case Kind::prim:
+            if (a.pointer() or b.pointer()) return a.pointer() == b.pointer();
+            return !a.name.empty();
+          case Kind::insert:
+            return a.pointer() and a.pointer() == b.pointer() and a.value == b.value;
+          case Kind::constant:
+            return a.value == b.value;
+          default:
+            return true;
+        }
+      }
+
+      node_ptr<T> intern (Node<T> n) {
+        auto h = hash(n);
+        auto range = _table.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (same(*it->second, n)) return it->second;
+        }
+        auto p = std::make_shared<const Node<T>>(std::move(n));
+        _table.emplace(h, p);
+        return p;
+      }
+
+      node_ptr<T> with_kids (const Node<T>& n, std::vector<node_ptr<T>> kids) {
+        Node<T> m = n;
+        m.kids = std::move(kids);
+        return intern(std::move(m));
+      }
+
+      node_ptr<T> compose (node_ptr<T> f, node_ptr<T> g) {
+        Node<T> n{Kind::compose, "compose"};
+        n.kids = {std::move(f), std::move(g)};
+        return intern(std::move(n));
+      }
+
+      static void flatten (const node_ptr<T>& n, std::vector<node_ptr<T>>& chain) {
+        if (n->kind == Kind::compose) {
+          flatten(n->kids[0], chain);
+          flatten(n->kids[1], chain);
+        } else if (n->kind != Kind::id) {
+          chain.push_back(n);
+        }
+      }
+
+      // fusione di f * g, nullptr se f e g non si fondono
+      node_ptr<T> fuse (const node_ptr<T>& f, const node_ptr<T>& g) {
+        if (g->kind != Kind::map) return nullptr;
+        if (f->kind == Kind::map) { // apply_to_all(a) * apply_to_all(b)
+          return with_kids(*f, {chain({f->kids[0], g->kids[0]})});
+        }
+        if (f->kind == Kind::insert) { // insert(a) * apply_to_all(b)
+          if (f->kids.empty()) return with_kids(*f, {g->kids[0]});
+          return with_kids(*f, {chain({f->kids[0], g->kids[0]})});
+        }
+        return nullptr;
+      }
+
+      // catena ottimizzata degli stadi, dal più esterno al più interno
+      node_ptr<T> chain (std::vector<node_ptr<T>> stages) {
+        auto flat = std::vector<node_ptr<T>>();
+        for (const auto& s : stages) flatten(s, flat);
+        auto res = std::vector<node_ptr<T>>(); // dal più interno
+        for (auto it = flat.rbegin(); it != flat.rend(); ++it) {
+          if (!res.empty()) {
+            if (auto fg = fuse(*it, res.back())) {
+              res.back() = fg;
+              continue;
+            }
+          }
+          res.push_back(*it);
+        }
+        if (res.empty()) return intern(Node<T>{Kind::id, "id"});
+        auto c = res.front();
+        for (size_t i = 1; i < res.size(); i++) c = compose(res[i], c);
+        return c;
+      }
+
+    public:
+      node_ptr<T> optimize (const node_ptr<T>& n) {
+        switch (n->kind) {
+          case Kind::compose:
+            return chain({optimize(n->kids[0]), optimize(n->kids[1])});
+          case Kind::construct:
+          case Kind::map:
+          case Kind::insert: {
+            auto kids = std::vector<node_ptr<T>>();
+            for (const auto& k : n->kids) kids.push_back(optimize(k));
+            return with_kids(*n, std::move(kids));
+          }
+          default:
+            return intern(*n);
+        }
+      }
+    };
+
+    struct memo_key {
+      const void* node;
+      fpar::detail::identity_t id;
+
+      friend bool operator== (const memo_key& a, const memo_key& b) noexcept {
+        return a.node == b.node and a.id == b.id;
+      }
+    };
+
+    struct memo_key_hash {
+      size_t operator() (const memo_key& k) const noexcept {
+        return fpar::detail::hash_combine(std::hash<const void*>()(k.node),
+                                          fpar::detail::identity_hash()(k.id));
+      }
+    };
+  }
+
+  /*! \class Program
+   *  \brief Programma compilato (vedi compile)
+   */
+  template <typename T>
+  class Program {
+  private:
+    using node_t = Node<T>;
+    using fn_t = typename node_t::fn_t;
+
+    detail::node_ptr<T> _root;
+    std::unordered_set<const node_t*> _memo; // nodi ricordati per identità dell'argomento
+    Cutoff _cutoff;
+
+    // risultati dei nodi ricordati, per una valutazione; l'argomento è
+    // conservato perché la sua identità non venga riusata
+    struct Context {
+      std::mutex m;
+      std::unordered_map<detail::memo_key, std::pair<T, T>, detail::memo_key_hash> results;
+    };
+
+    void mark (const detail::node_ptr<T>& n, std::unordered_map<const node_t*, size_t>& uses,
+               bool in_body) {
+      if (uses[n.get()]++ > 0) { // nodo condiviso
+        if (n->kind != Kind::select and n->kind != Kind::id and n->kind != Kind::constant) {
+          _memo.insert(n.get());
+        }
+        return;
+      }
+      if (in_body and n->kind == Kind::compose and detail::is_select_chain(*n->kids[1])) {
+        // primo stadio dopo una select: invariante se la select sceglie una parte comune
+        auto k = n->kids[0]->kind;
+        if (k != Kind::select and k != Kind::constant and k != Kind::id) _memo.insert(n->kids[0].get());
+      }
+      bool body = in_body or n->kind == Kind::map or n->kind == Kind::insert;
+      for (const auto& k : n->kids) mark(k, uses, body);
+    }
+
+    template <bool par, typename Tag, typename F>
+    T run_insert (F f, const node_t& n, const T& x, Context& ctx, size_t budget, bool transposed) const {
+      if (!n.kids.empty()) {
+        const auto& g = *n.kids[0];
+        if (auto gp = (g.kind == Kind::prim) ? g.pointer() : nullptr) { // kernel delle primitive
+          Insert<par, T, F, Tag, fn_t> ins{f, n.value, gp, _cutoff};
+          return transposed ? ins.transposed(x) : ins(x);
+        }
+        auto body = [&, budget](const T& y) { return eval(g, y, ctx, budget); };
+        Insert<par, T, F, Tag, decltype(body)> ins{f, n.value, body, _cutoff};
+        return transposed ? ins.transposed(x) : ins(x);
+      }
+      Insert<par, T, F, Tag> ins{f, n.value, {}, _cutoff};
+      return transposed ? ins.transposed(x) : ins(x);
+    }
+
+    template <bool par, typename F>
+    T insert_tag (F f, const node_t& n, const T& x, Context& ctx, size_t budget, bool transposed) const {
+      if (n.tag == 2) return run_insert<par, commutative_t>(f, n, x, ctx, budget, transposed);
+      if (n.tag == 1) return run_insert<par, associative_t>(f, n, x, ctx, budget, transposed);
+      return run_insert<par, void>(f, n, x, ctx, budget, transposed);
+    }
+
+    T eval_insert (const node_t& n, const T& x, Context& ctx, size_t budget, bool transposed) const {
+      if (transposed and (x.isBottom() or !x.isSequence() or x.isDense())) return Bottom;
+      auto els = x.isSequence() ? fpar::detail::seq_size(x) : 0;
+      if (transposed and els > 0 and x.as_sequence()[0]->isSequence()) {
+        els = fpar::detail::seq_size(*x.as_sequence()[0]);
+      }
+      // il parallelismo viene diviso tra gli elementi
+      bool par = budget > 1 and n.tag != 0;
+      size_t inner = par ? std::max<size_t>(1, budget / std::max<size_t>(1, els)) : budget;
+      auto fp = n.pointer();
+      if (par) {
+        return fp ? insert_tag<true>(fp, n, x, ctx, inner, transposed)
+                  : insert_tag<true>(n.fn, n, x, ctx, inner, transposed);
+      }
+      return fp ? insert_tag<false>(fp, n, x, ctx, inner, transposed)
+                : insert_tag<false>(n.fn, n, x, ctx, inner, transposed);
+    }
+
+    template <bool par>
+    T run_map (const node_t& n, const T& x, Context& ctx, size_t budget) const {
+      const auto& g = *n.kids[0];
+      if (auto gp = (g.kind == Kind::prim) ? g.pointer() : nullptr) { // kernel delle primitive
+        return Map<par, T, fn_t>{gp, _cutoff}(x);
+      }
+      auto body = [&, budget](const T& y) { return eval(g, y, ctx, budget); };
+      return Map<par, T, decltype(body)>{body, _cutoff}(x);
+    }
+
+    T eval_construct (const node_t& n, const T& x, Context& ctx, size_t budget) const {
+      auto k = n.kids.size();
+      auto res = std::vector<T>(k);
+      if (budget > 1 and k > 1) { // rami indipendenti come task concorrenti
+        size_t inner = std::max<size_t>(1, budget / k);
+        parallel_for(current_executor(), k, [&](size_t i) {
+          res[i] = eval(*n.kids[i], x, ctx, inner);
+        });
+      } else {
+        for (size_t i = 0; i < k; i++) res[i] = eval(*n.kids[i], x, ctx, budget);
+      }
+      auto s = Sequence<T>().transient();
+      for (auto& r : res) s.push_back(Box<T>(std::move(r)));
+      return T(std::move(s).persistent());
+    }
+
+    T eval_node (const node_t& n, const T& x, Context& ctx, size_t budget) const {
+      switch (n.kind) {
+        case Kind::id:
+          return x;
+        case Kind::prim:
+          if (n.fn_par and budget > 1) return n.fn_par(x);
+          return n.fn(x);
+        case Kind::select:
+          return fpar::select<T>(n.index)(x);
+        case Kind::constant:
+          return x.isBottom() ? T(Bottom) : n.value;
+        case Kind::compose: {
+          const auto& f = *n.kids[0];
+          const auto& g = *n.kids[1];
+          // insert * trans (* h): riduzione delle colonne
+          auto is_trans = [](const node_t& t) { return t.kind == Kind::prim and t.name == "trans"; };
+          if (f.kind == Kind::insert and is_trans(g)) return eval_insert(f, x, ctx, budget, true);
+          if (f.kind == Kind::insert and g.kind == Kind::compose and is_trans(*g.kids[0])) {
+            return eval_insert(f, eval(*g.kids[1], x, ctx, budget), ctx, budget, true);
+          }
+          return eval(f, eval(g, x, ctx, budget), ctx, budget);
+        }
+        case Kind::construct:
+          return eval_construct(n, x, ctx, budget);
+        case Kind::map: {
+          if (budget <= 1) return run_map<false>(n, x, ctx, 1);
+          auto els = x.isSequence() ? fpar::detail::seq_size(x) : 0;
+          return run_map<true>(n, x, ctx, std::max<size_t>(1, budget / std::max<size_t>(1, els)));
+        }
+        case Kind::insert:
+          return eval_insert(n, x, ctx, budget, false);
+      }
+      return Bottom;
+    }
+
+    T eval (const node_t& n, const T& x, Context& ctx, size_t budget) const {
+      if (_memo.count(&n) == 0) return eval_node(n, x, ctx, budget);
+      auto id = x.identity();
+      if (id.empty()) return eval_node(n, x, ctx, budget);
+      auto key = detail::memo_key{&n, id};
+      {
+        std::lock_guard<std::mutex> lk(ctx.m);
+        auto it = ctx.results.find(key);
+        if (it != ctx.results.end()) return it->second.second;
+      }
+      T r = eval_node(n, x, ctx, budget);
+      std::lock_guard<std::mutex> lk(ctx.m);
+      ctx.results.emplace(key, std::make_pair(x, r));
+      return r;
+    }
+
+    // elemento i di una sequenza
+    static T element (const T& x, size_t i) {
+      if (x.isDense()) return x.visit_dense([&](const auto& d) { return T(d[i]); });
+      return x.as_sequence()[i];
+    }
+
+    // apply_to_all(f) su una colonna, con il parallelismo diviso tra gli elementi
+    template <typename F>
+    T column (F f, const T& xs, size_t budget) const {
+      if (budget <= 1) return Map<false, T, F>{f, _cutoff}(xs);
+      return Map<true, T, F>{f, _cutoff}(xs);
+    }
+
+    // n valutato separatamente su ogni input del lotto
+    T each (const node_t& n, const T& xs, Context& ctx, size_t budget) const {
+      size_t inner = std::max<size_t>(1, budget / std::max<size_t>(1, fpar::detail::seq_size(xs)));
+      return column([&, inner](const T& y) { return eval(n, y, ctx, inner); }, xs, budget);
+    }
+
+    // construct come colonne: <f1(xi), ..., fN(xi)> per ogni input xi
+    std::vector<T> batch_construct (const node_t& n, const T& xs, Context& ctx, size_t budget) const {
+      auto k = n.kids.size();
+      auto cols = std::vector<T>(k);
+      if (budget > 1 and k > 1) {
+        size_t inner = std::max<size_t>(1, budget / k);
+        parallel_for(current_executor(), k, [&](size_t i) {
+          cols[i] = batch(*n.kids[i], xs, ctx, inner);
+        });
+      } else {
+        for (size_t i = 0; i < k; i++) cols[i] = batch(*n.kids[i], xs, ctx, budget);
+      }
+      return cols;
+    }
+
+    // primitiva aritmetica applicata a <y, z> senza costruire le coppie: un
+    // solo kernel sulle due colonne dense
+    std::optional<T> batch_zip (fn_t f, const T& y, const T& z, size_t budget) const {
+      if (!y.isDense() or y.identity().size != z.identity().size) return std::nullopt;
+      return y.visit_dense([&](const auto& a) -> std::optional<T> {
+        using dense_t = std::decay_t<decltype(a)>;
+        if (!z.template is<dense_t>()) return std::nullopt;
+        const auto& b = z.template get<dense_t>();
+        if (budget > 1 and a.size() >= fpar::detail::simd_grain) return fpar::detail::zip_kernel<true, T>(f, a, b);
+        return fpar::detail::zip_kernel<false, T>(f, a, b);
+      });
+    }
+
+    // apply_to_all(g) su ogni input: g è valutata una volta sulla
+    // concatenazione degli elementi e il risultato viene diviso
+    T batch_map (const node_t& n, const T& xs, Context& ctx, size_t budget) const {
+      auto b = fpar::detail::seq_size(xs);
+      auto inputs = std::vector<T>(b);
+      auto lengths = std::vector<size_t>(b);
+      auto flat = std::vector<T>();
+      for (size_t i = 0; i < b; i++) {
+        inputs[i] = element(xs, i);
+        if (inputs[i].isBottom() or !inputs[i].isSequence()) return each(n, xs, ctx, budget);
+        lengths[i] = fpar::detail::seq_size(inputs[i]);
+        for (size_t j = 0; j < lengths[i]; j++) flat.push_back(element(inputs[i], j));
+      }
+      T ys = flat.empty() ? T(Sequence<T>()) : batch(*n.kids[0], T::pack(flat), ctx, budget);
+      auto res = std::vector<T>(b);
+      size_t k = 0;
+      for (size_t i = 0; i < b; i++) {
+        auto part = std::vector<T>(lengths[i]);
+        for (auto& el : part) el = element(ys, k++);
+        res[i] = T::pack(part);
+      }
+      return T::pack(res);
+    }
+
+    T batch_node (const node_t& n, const T& xs, Context& ctx, size_t budget) const {
+      auto is_trans = [](const node_t& t) { return t.kind == Kind::prim and t.name == "trans"; };
+      switch (n.kind) {
+        case Kind::id:
+          return xs;
+        case Kind::prim:
+          // il lotto è già parallelo: trans, distl e distr sequenziali
+          if (auto fp = n.pointer()) return column(fp, xs, budget);
+          return column(n.fn, xs, budget);
+        case Kind::select:
+          return column(fpar::select<T>(n.index), xs, budget);
+        case Kind::compose: {
+          const auto& f = *n.kids[0];
+          const auto& g = *n.kids[1];
+          // insert * trans resta fusa: riduzione delle colonne di ogni input
+          if (f.kind == Kind::insert and
+              (is_trans(g) or (g.kind == Kind::compose and is_trans(*g.kids[0])))) {
+            break;
+          }
+          auto fp = f.kind == Kind::prim ? f.pointer() : nullptr;
+          if (fp and g.kind == Kind::construct and g.kids.size() == 2 and _memo.count(&g) == 0) {
+            auto cols = batch_construct(g, xs, ctx, budget);
+            if (auto res = batch_zip(fp, cols[0], cols[1], budget)) return *res;
+            return batch(f, fpar::trans<false, T>(T(Sequence<T>({cols[0], cols[1]}))), ctx, budget);
+          }
+          return batch(f, batch(g, xs, ctx, budget), ctx, budget);
+        }
+        case Kind::construct: {
+          auto cols = batch_construct(n, xs, ctx, budget);
+          if (cols.empty()) break;
+          auto s = Sequence<T>().transient();
+          for (auto& c : cols) s.push_back(Box<T>(std::move(c)));
+          return fpar::trans<false, T>(T(std::move(s).persistent()));
+        }
+        case Kind::map:
+          return batch_map(n, xs, ctx, budget);
+        default:
+          break;
+      }
+      return each(n, xs, ctx, budget);
+    }
+
+    // n valutato su ogni elemento della sequenza xs, uno stadio alla volta
+    T batch (const node_t& n, const T& xs, Context& ctx, size_t budget) const {
+      // i nodi ricordati restano per input: il risultato è condiviso per identità
+      if (_memo.count(&n) != 0) return each(n, xs, ctx, budget);
+      return batch_node(n, xs, ctx, budget);
+    }
+
+  public:
+    Program (detail::node_ptr<T> root, Cutoff cutoff) : _root(std::move(root)), _cutoff(cutoff) {
+      auto uses = std::unordered_map<const node_t*, size_t>();
+      mark(_root, uses, false);
+    }
+
+    /*! \brief Valutazione con l'esecutore corrente */
+    T operator() (const T& x) const {
+      FPAR_TRACE_SPAN("graph", 0);
+      Context ctx;
+      return eval(*_root, x, ctx, current_executor().concurrency());
+    }
+
+    /*! \brief Valutazione di un lotto di input (vedi batch_eval) */
+    T batch (const T& xs) const {
+      if (xs.isBottom() or !xs.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("graph_batch", fpar::detail::seq_size(xs));
+      Context ctx;
+      return batch(*_root, xs, ctx, current_executor().concurrency());
+    }
+
+    /*! \brief Programma ottimizzato */
+    Expr<T> expr () const { return Expr<T>(_root); }
+
+    /*! \brief Numero di nodi ricordati per identità dell'argomento */
+    size_t memoized () const noexcept { return _memo.size(); }
+  };
+
+  /*! \brief Ottimizza un programma
+   *  \param cutoff Soglia dei funzionali paralleli (vedi Grain.hpp)
+   *  \return Program, con lo stesso risultato di e
+   */
+  template <typename T>
+  inline Program<T> compile (const Expr<T>& e, Cutoff cutoff = Cutoff()) {
+    detail::Optimizer<T> opt;
+    return Program<T>(opt.optimize(e.ptr()), cutoff);
+  }
+
+  /*! \brief Valutazione di un programma su un lotto di input indipendenti
+   *  \param p Programma compilato
+   *  \param xs Sequenza degli input <x1, ..., xN>
+   *  \return <p(x1), ..., p(xN)>, come apply_to_all(p), calcolata un nodo
+   *          alla volta su tutto il lotto; bottom se xs non è una sequenza
+   */
+  template <typename T>
+  inline T batch_eval (const Program<T>& p, const T& xs) {
+    return p.batch(xs);
+  }
+
+  template <typename T>
+  inline T batch_eval (const Expr<T>& e, const T& xs, Cutoff cutoff = Cutoff()) {
+    return compile(e, cutoff).batch(xs);
+  }
+}
+}
+
+#endif
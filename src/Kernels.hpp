@@ -0,0 +1,243 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+/** \file Kernels.hpp
+ * Kernel vettoriali per le primitive aritmetiche
+ * Quando un funzionale riceve come funzione una delle primitive aritmetiche
+ * (add_op, sub_op, mul_op, div_op) e i dati sono sequenze dense di un tipo
+ * numerico, il calcolo viene eseguito da cicli su array grezzi annotati con
+ * "omp simd": il compilatore genera codice SSE/AVX2/AVX-512/NEON in base
+ * all'architettura selezionata (es. -march=native). Le primitive sono
+ * riconosciute confrontando il puntatore a funzione passato al funzionale.
+ */
+
+#include "Object.hpp"
+#include "Executor.hpp"
+#include "Functions.hpp"
+
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace fpar {
+
+  namespace kernels {
+
+    template <typename O>
+    inline void add (const O* y, const O* z, O* res, size_t n) {
+      #pragma omp simd
+      for (size_t i = 0; i < n; i++) res[i] = y[i] + z[i];
+    }
+
+    template <typename O>
+    inline void sub (const O* y, const O* z, O* res, size_t n) {
+      #pragma omp simd
+      for (size_t i = 0; i < n; i++) res[i] = y[i] - z[i];
+    }
+
+    template <typename O>
+    inline void mul (const O* y, const O* z, O* res, size_t n) {
+      #pragma omp simd
+      for (size_t i = 0; i < n; i++) res[i] = y[i] * z[i];
+    }
+
+    template <typename O>
+    inline void div (const O* y, const O* z, O* res, size_t n) {
+      #pragma omp simd
+      for (size_t i = 0; i < n; i++) res[i] = y[i] / z[i];
+    }
+
+    template <typename O>
+    inline O sum (const O* x, size_t n) {
+      O acc = 0;
+      #pragma omp simd reduction(+:acc)
+      for (size_t i = 0; i < n; i++) acc += x[i];
+      return acc;
+    }
+
+    template <typename O>
+    inline O dot (const O* y, const O* z, size_t n) {
+      O acc = 0;
+      #pragma omp simd reduction(+:acc)
+      for (size_t i = 0; i < n; i++) acc += y[i] * z[i];
+      return acc;
+    }
+
+    template <typename O>
+    inline bool any_zero (const O* x, size_t n) {
+      bool found = false;
+      #pragma omp simd reduction(||:found)
+      for (size_t i = 0; i < n; i++) found = found || (x[i] == 0);
+      return found;
+    }
+  }
+
+  namespace detail {
+
+    // tipi per cui i kernel calcolano esattamente ciò che calcola la primitiva
+    template <typename O>
+    constexpr bool simd_type = std::is_arithmetic<O>::value and
+                               std::is_same<decltype(O() + O()), O>::value;
+
+    // elementi minimi per blocco nei kernel paralleli (limitati dalla banda)
+    constexpr size_t simd_grain = 1 << 14;
+
+    enum class arith { none, add, sub, mul, div };
+
+    /*! \brief Riconosce le primitive aritmetiche su atomi di tipo O
+     *  \param f Funzione passata al funzionale
+     *  \return l'operazione calcolata da f, arith::none se f non è una
+     *          delle primitive aritmetiche (es. una lambda)
+     */
+    template <typename O, typename T, typename F>
+    inline arith arith_kind (const F& f) noexcept {
+      if constexpr (std::is_convertible<F, T(*)(const T&)>::value and
+                    std::is_pointer<F>::value) {
+        T (*fp)(const T&) = f;
+        if (fp == &add_op<O, T>) return arith::add;
+        if (fp == &sub_op<O, T>) return arith::sub;
+        if (fp == &mul_op<O, T>) return arith::mul;
+        if (fp == &div_op<O, T>) return arith::div;
+      }
+      return arith::none;
+    }
+
+    template <bool par, typename O>
+    inline DenseSequence<O> apply_kernel (arith op, const O* y, const O* z, size_t n) {
+      auto res = DenseSequence<O>(n).transient();
+      O* out = res.data_mut();
+      auto body = [&](size_t lo, size_t hi) {
+        switch (op) {
+          case arith::add: kernels::add(y + lo, z + lo, out + lo, hi - lo); break;
+          case arith::sub: kernels::sub(y + lo, z + lo, out + lo, hi - lo); break;
+          case arith::mul: kernels::mul(y + lo, z + lo, out + lo, hi - lo); break;
+          case arith::div: kernels::div(y + lo, z + lo, out + lo, hi - lo); break;
+          case arith::none: break;
+        }
+      };
+      if constexpr (par) {
+        parallel_for_chunks(current_executor(), n, simd_grain, body);
+      } else {
+        body(0, n);
+      }
+      return std::move(res).persistent();
+    }
+
+    /*! \brief zip(f) su due sequenze dense di tipo O
+     *  \return <f(y1, z1), ..., f(yN, zN)>, nullopt se f non è riconosciuta
+     *          o se una divisione incontra uno zero (il risultato contiene
+     *          bottom e non è denso)
+     */
+    template <bool par, typename T, typename O, typename F>
+    inline std::optional<T> zip_kernel (const F& f, const DenseSequence<O>& y,
+                                        const DenseSequence<O>& z) {
+      if constexpr (simd_type<O>) {
+        auto op = arith_kind<O, T>(f);
+        if (op == arith::none) return std::nullopt;
+        if (op == arith::div and kernels::any_zero(z.data(), z.size())) return std::nullopt;
+        return T(apply_kernel<par>(op, y.data(), z.data(), y.size()));
+      }
+      return std::nullopt;
+    }
+
+    /*! \brief apply_to_all(f) su una sequenza di coppie dense <yi, zi>
+     *  \return <f(<y1, z1>), ..., f(<yN, zN>)>, nullopt se f non è
+     *          riconosciuta o gli elementi non sono tutti coppie dense
+     */
+    template <bool par, typename T, typename F>
+    inline std::optional<T> map_pairs_kernel (const F& f, const Sequence<T>& s) {
+      if (s.size() == 0 or !s[0]->isDense()) return std::nullopt;
+      return s[0]->visit_dense([&](const auto& first) -> std::optional<T> {
+        using dense_t = std::decay_t<decltype(first)>;
+        using O = typename dense_t::value_type;
+        if constexpr (simd_type<O>) {
+          auto op = arith_kind<O, T>(f);
+          if (op == arith::none) return std::nullopt;
+          auto y = std::vector<O>(s.size());
+          auto z = std::vector<O>(s.size());
+          for (size_t i = 0; i < s.size(); i++) {
+            if (!s[i]->template is<dense_t>()) return std::nullopt;
+            const auto& p = s[i]->template get<dense_t>();
+            if (p.size() != 2) return std::nullopt;
+            y[i] = p[0];
+            z[i] = p[1];
+          }
+          if (op == arith::div and kernels::any_zero(z.data(), z.size())) return std::nullopt;
+          return T(apply_kernel<par>(op, y.data(), z.data(), s.size()));
+        }
+        return std::nullopt;
+      });
+    }
+
+    /*! \brief insert(add_op<O>, n) su una sequenza densa di tipo O
+     *  \param reassoc se false il kernel si usa solo per tipi interi, per i
+     *         quali riassociare la somma non cambia il risultato
+     *  \return n + x1 + ... + xN, nullopt se f non è add_op<O>, n non è O
+     *          o x è vuota (la riduzione di una sequenza vuota è bottom)
+     */
+    template <bool par, typename T, typename O, typename F>
+    inline std::optional<T> sum_kernel (const F& f, const T& n,
+                                        const DenseSequence<O>& x, bool reassoc) {
+      if constexpr (simd_type<O>) {
+        if (x.size() == 0) return std::nullopt;
+        if (!reassoc and !std::is_integral<O>::value) return std::nullopt;
+        if (arith_kind<O, T>(f) != arith::add or !n.template is<O>()) return std::nullopt;
+        O acc = n;
+        if constexpr (par) {
+          auto& ex = current_executor();
+          auto n_chunks = (x.size() + simd_grain - 1) / simd_grain;
+          if (n_chunks > 4 * ex.concurrency()) n_chunks = 4 * ex.concurrency();
+          auto partials = std::vector<O>(n_chunks, O(0));
+          parallel_for(ex, n_chunks, [&](size_t c) {
+            auto lo = x.size()*c/n_chunks;
+            auto hi = x.size()*(c+1)/n_chunks;
+            partials[c] = kernels::sum(x.data() + lo, hi - lo);
+          });
+          for (auto p : partials) acc += p;
+        } else {
+          acc += kernels::sum(x.data(), x.size());
+        }
+        return T(acc);
+      }
+      return std::nullopt;
+    }
+
+    /*! \brief insert(add_op<O>, n) * apply_to_all(mul_op<O>) * trans su una
+     *         coppia di sequenze dense <y, z> di tipo O (prodotto scalare)
+     *  \param els Numero di elementi da considerare (il minimo delle lunghezze)
+     *  \param reassoc come in sum_kernel
+     *  \return n + y1*z1 + ... + yN*zN, nullopt se f e g non sono add_op<O>
+     *          e mul_op<O>, n non è O o els è 0
+     */
+    template <bool par, typename T, typename O, typename F, typename G>
+    inline std::optional<T> dot_kernel (const F& f, const G& g, const T& n,
+                                        const DenseSequence<O>& y, const DenseSequence<O>& z,
+                                        size_t els, bool reassoc) {
+      if constexpr (simd_type<O>) {
+        if (els == 0) return std::nullopt;
+        if (!reassoc and !std::is_integral<O>::value) return std::nullopt;
+        if (arith_kind<O, T>(f) != arith::add or arith_kind<O, T>(g) != arith::mul or
+            !n.template is<O>()) return std::nullopt;
+        O acc = n;
+        if constexpr (par) {
+          auto& ex = current_executor();
+          auto n_chunks = (els + simd_grain - 1) / simd_grain;
+          if (n_chunks > 4 * ex.concurrency()) n_chunks = 4 * ex.concurrency();
+          auto partials = std::vector<O>(n_chunks, O(0));
+          parallel_for(ex, n_chunks, [&](size_t c) {
+            auto lo = els*c/n_chunks;
+            auto hi = els*(c+1)/n_chunks;
+            partials[c] = kernels::dot(y.data() + lo, z.data() + lo, hi - lo);
+          });
+          for (auto p : partials) acc += p;
+        } else {
+          acc += kernels::dot(y.data(), z.data(), els);
+        }
+        return T(acc);
+      }
+      return std::nullopt;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef MEMO_HPP
+#define MEMO_HPP
+
+/** \file Memo.hpp
+ * Cache dei risultati di funzioni
+ * Le funzioni FP sono pure: il risultato dipende solo dall'argomento e può
+ * essere riusato. La cache usata da memoize è limitata (gli elementi usati
+ * meno di recente vengono scartati) e può essere condivisa tra thread.
+ * Un argomento viene cercato prima per identità (stessa rappresentazione
+ * immer, in O(1)) e poi per hash strutturale e uguaglianza.
+ */
+
+#include "Object.hpp"
+
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace fpar {
+
+  namespace detail {
+
+    /*! \class MemoCache
+     *  \brief Cache LRU limitata da argomenti a risultati, thread safe.
+     *         L'hash di un argomento viene calcolato fuori dal lock.
+     */
+    template <typename T>
+    class MemoCache {
+    private:
+      struct Entry {
+        T key;
+        T value;
+        identity_t id;
+        size_t hash;
+      };
+
+      using entry_it = typename std::list<Entry>::iterator;
+
+      const size_t _capacity;
+      std::mutex _m;
+      std::list<Entry> _lru; // più recente in testa
+      // le chiavi restano vive nella lista, quindi le identità non possono
+      // essere riusate da altri oggetti finché sono nella cache
+      std::unordered_map<identity_t, entry_it, identity_hash> _by_id;
+      std::unordered_multimap<size_t, entry_it> _by_hash;
+
+      T hit (entry_it it) {
+        _lru.splice(_lru.begin(), _lru, it);
+        return it->value;
+      }
+
+      void evict () {
+        auto& last = _lru.back();
+        if (!last.id.empty()) _by_id.erase(last.id);
+        auto range = _by_hash.equal_range(last.hash);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second == std::prev(_lru.end())) {
+            _by_hash.erase(it);
+            break;
+          }
+        }
+        _lru.pop_back();
+      }
+
+    public:
+      explicit MemoCache (size_t capacity) : _capacity(capacity ? capacity : 1) {}
+
+      MemoCache (const MemoCache&) = delete;
+      MemoCache& operator= (const MemoCache&) = delete;
+
+      /*! \brief Cerca il risultato associato a x
+       *  \param hash Hash strutturale di x, restituito per il successivo put
+       *  \return il risultato, se presente
+       */
+      std::optional<T> find (const T& x, size_t& hash) {
+        auto id = x.identity();
+        if (!id.empty()) {
+          std::lock_guard<std::mutex> lk(_m);
+          auto it = _by_id.find(id);
+          if (it != _by_id.end()) return hit(it->second);
+        }
+        hash = x.hash();
+        std::lock_guard<std::mutex> lk(_m);
+        auto range = _by_hash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second->key == x) return hit(it->second);
+        }
+        return std::nullopt;
+      }
+
+      /*! \brief Associa value a x, scartando l'elemento usato meno di recente
+       *         se la cache è piena
+       *  \param hash Hash strutturale di x
+       */
+      void put (const T& x, size_t hash, const T& value) {
+        auto id = x.identity();
+        std::lock_guard<std::mutex> lk(_m);
+        auto range = _by_hash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second->key == x) return; // calcolato in parallelo da un altro thread
+        }
+        _lru.push_front({x, value, id, hash});
+        if (!id.empty()) _by_id[id] = _lru.begin();
+        _by_hash.emplace(hash, _lru.begin());
+        while (_lru.size() > _capacity) evict();
+      }
+
+      size_t size () {
+        std::lock_guard<std::mutex> lk(_m);
+        return _lru.size();
+      }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+/** \file Numa.hpp
+ * Esecuzione NUMA-aware (libnuma)
+ * Un numa::Pool è un WorkStealingPool con i worker fissati alle cpu dei nodi
+ * della macchina, a blocchi contigui (i primi worker sul nodo 0, ...), e con
+ * affinità: ogni parte i di n di un parallel_for sottomesso da fuori dal pool
+ * va sempre allo stesso worker (vedi WorkStealingPool::owner). Dato che i
+ * funzionali dividono le sequenze in blocchi proporzionali alla lunghezza,
+ * la porzione k-esima di una sequenza viene elaborata dal worker k.
+ * place sposta (o ricostruisce) una sequenza in modo che la porzione di ogni
+ * worker sia nella memoria del suo nodo:
+ *
+ *   auto pool = std::make_shared<numa::Pool>(numa::Config::from_env());
+ *   set_default_executor(pool);
+ *   Number x = numa::place<Number>(input, *pool);
+ *   apply_to_all<par_exec, Number>(f)(x); // ogni worker legge memoria locale
+ *
+ * Non è incluso da fpar.hpp: richiede -lnuma. Senza supporto NUMA nel
+ * kernel la topologia ha un solo nodo e place non sposta la memoria.
+ */
+
+#include "Object.hpp"
+#include "Executor.hpp"
+#include "Builder.hpp"
+#include "Grain.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <numa.h>
+#include <numaif.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace fpar {
+namespace numa {
+
+  /*! \brief true se il kernel e libnuma supportano NUMA */
+  inline bool available () {
+    return numa_available() >= 0;
+  }
+
+  /*! \class Topology
+   *  \brief Cpu utilizzabili di ogni nodo NUMA
+   */
+  struct Topology {
+    std::vector<std::vector<int>> cpus;
+
+    size_t nodes () const noexcept { return cpus.size(); }
+
+    size_t size () const noexcept {
+      size_t n = 0;
+      for (const auto& c : cpus) n += c.size();
+      return n;
+    }
+  };
+
+  /*! \brief Topologia della macchina; senza NUMA un solo nodo con le cpu
+   *         su cui il processo può essere eseguito
+   */
+  inline Topology topology () {
+    Topology t;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](int cpu) { return !restricted or CPU_ISSET(cpu, &allowed); };
+    if (available()) {
+      auto mask = numa_allocate_cpumask();
+      for (int node = 0; node <= numa_max_node(); node++) {
+        if (numa_node_to_cpus(node, mask) != 0) continue;
+        auto cpus = std::vector<int>();
+        for (unsigned cpu = 0; cpu < mask->size; cpu++) {
+          if (numa_bitmask_isbitset(mask, cpu) and usable(cpu)) cpus.push_back(cpu);
+        }
+        if (!cpus.empty()) t.cpus.push_back(std::move(cpus));
+      }
+      numa_free_cpumask(mask);
+    }
+    if (t.cpus.empty()) {
+      auto cpus = std::vector<int>();
+      int n = std::max(1u, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < n; cpu++) {
+        if (usable(cpu)) cpus.push_back(cpu);
+      }
+      if (cpus.empty()) cpus.push_back(0);
+      t.cpus.push_back(std::move(cpus));
+    }
+    return t;
+  }
+
+  /*! \class Config
+   *  \brief Configurazione di un Pool
+   *  \param threads Concorrenza (worker più il chiamante), 0 per una per cpu
+   *  \param pin Se true ogni worker è fissato ad una cpu
+   *  \param affine Se true le parti dei dati sono assegnate ai worker
+   */
+  struct Config {
+    size_t threads = 0;
+    bool pin = true;
+    bool affine = true;
+
+    /*! \brief Configurazione dalle variabili d'ambiente FPAR_THREADS
+     *         (default: omp_get_max_threads()) e FPAR_PIN (0 per non
+     *         fissare i worker)
+     */
+    static Config from_env () {
+      Config c;
+      c.threads = omp_get_max_threads();
+      if (auto t = std::getenv("FPAR_THREADS")) c.threads = std::strtoul(t, nullptr, 10);
+      if (auto p = std::getenv("FPAR_PIN")) c.pin = std::strcmp(p, "0") != 0;
+      return c;
+    }
+  };
+
+  /*! \class Pool
+   *  \brief WorkStealingPool con worker fissati ai nodi della topologia
+   */
+  class Pool : public WorkStealingPool {
+  private:
+    struct Assignment {
+      size_t threads;
+      std::vector<int> cpus;  // cpu di ogni worker
+      std::vector<int> nodes; // nodo di ogni worker
+    };
+
+    std::vector<int> _nodes;
+
+    // i worker sono distribuiti sulle cpu, ordinate per nodo, a blocchi
+    static Assignment assign (const Config& cfg, const Topology& topo) {
+      Assignment a;
+      a.threads = cfg.threads ? cfg.threads : topo.size();
+      auto all = std::vector<std::pair<int, int>>(); // (cpu, nodo)
+      for (size_t node = 0; node < topo.nodes(); node++) {
+        for (int cpu : topo.cpus[node]) all.emplace_back(cpu, (int)node);
+      }
+      size_t workers = a.threads > 1 ? a.threads - 1 : 1;
+      for (size_t k = 0; k < workers; k++) {
+        auto& cn = all[(k * all.size() / workers) % all.size()];
+        a.cpus.push_back(cn.first);
+        a.nodes.push_back(cn.second);
+      }
+      return a;
+    }
+
+    static void pin (int cpu) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      // senza permessi (es. cpuset del container) il worker resta libero
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    Pool (const Assignment& a, const Config& cfg)
+      : WorkStealingPool(a.threads, cfg.pin ? std::function<void(size_t)>(
+                           [cpus = a.cpus](size_t i) { pin(cpus[i]); }) : nullptr,
+                         cfg.affine),
+        _nodes(a.nodes) {}
+
+  public:
+    explicit Pool (const Config& cfg = Config::from_env(), const Topology& topo = topology())
+      : Pool(assign(cfg, topo), cfg) {}
+
+    /*! \brief Numero di worker (concurrency() - 1, almeno 1) */
+    size_t workers () const noexcept { return _nodes.size(); }
+
+    /*! \brief Nodo NUMA del worker k */
+    int node (size_t k) const noexcept { return _nodes[k]; }
+  };
+
+  namespace detail {
+    // preferenza per il nodo delle pagine di [first, last), già scritte
+    inline void move_pages (const void* first, const void* last, int node) {
+      auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+      // le pagine di confine restano dove sono: sono condivise con le porzioni vicine
+      auto lo = ((uintptr_t)first + page - 1) / page * page;
+      auto hi = (uintptr_t)last / page * page;
+      if (hi <= lo) return;
+      auto mask = numa_allocate_nodemask();
+      numa_bitmask_setbit(mask, node);
+      mbind((void*)lo, hi - lo, MPOL_PREFERRED, mask->maskp, mask->size + 1, MPOL_MF_MOVE);
+      numa_free_nodemask(mask);
+    }
+
+    // copia di un elemento, allocata (e scritta) dal thread chiamante
+    template <typename T>
+    inline Box<T> local_copy (const Box<T>& el) {
+      if (!el->isDense()) return el;
+      return el->visit_dense([](const auto& d) {
+        using dense_t = std::decay_t<decltype(d)>;
+        return Box<T>(T(dense_t(d.begin(), d.end())));
+      });
+    }
+  }
+
+  /*! \brief Distribuisce x nella memoria dei nodi dei worker del pool
+   *  \param x Sequenza densa: le pagine della porzione k-esima vengono
+   *         spostate sul nodo del worker k. Sequenza di box: viene
+   *         ricostruita dai worker del pool, e gli elementi densi (es. le
+   *         righe di una matrice) vengono copiati da chi li elaborerà
+   *  \return sequenza uguale a x; un oggetto che non è una sequenza è
+   *          restituito così com'è
+   */
+  template <typename T>
+  inline T place (const T& x, Pool& pool) {
+    if (!x.isSequence()) return x;
+    if (x.isDense()) {
+      if (!available()) return x;
+      x.visit_dense([&](const auto& d) {
+        auto n = d.size(), w = pool.workers();
+        for (size_t k = 0; k < w; k++) {
+          detail::move_pages(d.data() + k*n/w, d.data() + (k+1)*n/w, pool.node(k));
+        }
+      });
+      return x;
+    }
+    const auto& s = x.as_sequence();
+    ExecutorScope scope(pool);
+    return build_sequence<true, T>(s.size(), [&](size_t i) {
+      return detail::local_copy<T>(s[i]);
+    }, Cutoff::always());
+  }
+}
+}
+
+#endif
@@ -6,52 +6,517 @@
  * Definizione del type system di un sistema FP like.
  */
 
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <variant>
+#include <vector>
+#include <immer/array.hpp>
 #include <immer/box.hpp>
 #include <immer/flex_vector.hpp>
 
+// dimensione massima, in byte, di un atomo memorizzato nell'oggetto: quelli
+// più grandi stanno in un box. Il default è la dimensione di una sequenza di
+// box (radice, coda, lunghezza e profondità), che è sempre nell'oggetto
+#ifndef FPAR_INLINE_SIZE
+#define FPAR_INLINE_SIZE (4 * sizeof(void*))
+#endif
+
 namespace fpar {
 
-  /*! \class Object
+  /*
+    Sequenza densa: gli elementi, tutti atomi dello stesso tipo O, sono
+    memorizzati senza box in un unico array contiguo
+  */
+  template <typename O>
+  using DenseSequence = immer::array<O>;
+
+  namespace detail {
+    constexpr size_t npos = static_cast<size_t>(-1);
+
+    // indice della prima occorrenza di T in Us..., npos se assente
+    template <typename T, typename... Us>
+    struct index_of {
+      static constexpr size_t value = npos;
+    };
+
+    template <typename T, typename U, typename... Us>
+    struct index_of<T, U, Us...> {
+      static constexpr size_t value =
+        std::is_same<T, U>::value ? 0 :
+        (index_of<T, Us...>::value == npos ? npos : 1 + index_of<T, Us...>::value);
+    };
+
+    template <typename T, typename V>
+    struct variant_index;
+
+    template <typename T, typename... Us>
+    struct variant_index<T, std::variant<Us...>> : index_of<T, Us...> {};
+
+    template <typename T>
+    struct is_dense : std::false_type {};
+
+    template <typename O>
+    struct is_dense<DenseSequence<O>> : std::true_type {};
+
+    /*
+      Alternativa memorizzata fuori dall'oggetto, in un box immutabile
+      condiviso dalle copie. E' un tipo distinto da immer::box, quindi non si
+      confonde con un box che compaia tra i Ts.
+    */
+    template <typename U, typename MP>
+    struct OutOfLine {
+      immer::box<U, MP> box;
+
+      explicit OutOfLine (const U& v) : box(v) {}
+      explicit OutOfLine (U&& v) : box(std::move(v)) {}
+    };
+
+    template <typename U, typename MP>
+    using stored_t = std::conditional_t<(sizeof(U) > FPAR_INLINE_SIZE), OutOfLine<U, MP>, U>;
+
+    // valore di un'alternativa, memorizzata nell'oggetto o fuori
+    template <typename U>
+    inline const U& unwrap (const U& v) noexcept {
+      return v;
+    }
+
+    template <typename U, typename MP>
+    inline const U& unwrap (const OutOfLine<U, MP>& v) noexcept {
+      return v.box.get();
+    }
+
+    // combinazione di hash (come boost::hash_combine)
+    inline size_t hash_combine (size_t h, size_t v) noexcept {
+      return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+    }
+
+    // hash di un atomo; i tipi senza std::hash contribuiscono solo con il tipo
+    template <typename U>
+    inline size_t hash_value (const U& v) {
+      if constexpr (std::is_default_constructible<std::hash<U>>::value) {
+        return std::hash<U>()(v);
+      } else {
+        return 0;
+      }
+    }
+
+    /*
+      Identità della rappresentazione di una sequenza: la radice e la coda
+      dell'albero immer (o l'array di una sequenza densa) e la lunghezza.
+      Due sequenze con la stessa identità hanno gli stessi elementi.
+      Gli atomi non hanno identità (root e tail nulli).
+    */
+    struct identity_t {
+      const void* root = nullptr;
+      const void* tail = nullptr;
+      size_t size = 0;
+
+      bool empty () const noexcept { return root == nullptr and tail == nullptr; }
+
+      friend bool operator== (const identity_t& a, const identity_t& b) noexcept {
+        return a.root == b.root and a.tail == b.tail and a.size == b.size;
+      }
+    };
+
+    struct identity_hash {
+      size_t operator() (const identity_t& id) const noexcept {
+        auto h = std::hash<const void*>()(id.root);
+        h = hash_combine(h, std::hash<const void*>()(id.tail));
+        return hash_combine(h, id.size);
+      }
+    };
+  }
+
+  /*! \class BasicObject
    *  \brief Tipo degli oggetti di un sistema FP like.
    *         E' un tipo generico e ricorsivo che comprende:
    *          - bottom
    *          - tipi di base specifici: bool e size_t
    *          - tipi di base generici
    *          - tipo delle sequenze
+   *          - tipo delle sequenze dense di ognuno dei tipi di base generici
    *
+   *         Le sequenze dense sono sequenze a tutti gli effetti (isSequence()
+   *         è true) e vengono convertite in sequenze di box solo se richiesto.
+   *         Le alternative sono individuate per indice: se un tipo compare
+   *         più volte (es. bool tra i Ts) si usa la prima occorrenza.
+   *
+   *         MP è la memory policy di immer usata per i box e per le sequenze
+   *         di box (vedi Object e PooledObject). Le sequenze dense usano la
+   *         policy di default: sono una sola allocazione per sequenza.
+   *
+   *         Gli atomi più grandi di FPAR_INLINE_SIZE byte sono memorizzati
+   *         fuori linea, in un box condiviso dalle copie: un atomo grande non
+   *         allarga tutti gli oggetti oltre la dimensione della sequenza di
+   *         box, e copiarlo costa un incremento di refcount. Le sequenze
+   *         restano nell'oggetto, così da poter essere spostate fuori da un
+   *         temporaneo e aggiornate sul posto; un oggetto non è quindi mai
+   *         più piccolo di una sequenza di box, e gli atomi che non la
+   *         superano (es. std::string) restano nell'oggetto.
    */
-  template <typename... Ts>
-  class Object {
+  template <typename MP, typename... Ts>
+  class BasicObject {
+  public:
+    using memory_policy = MP;
+
   private:
-    std::variant<std::monostate,
-                 bool,
-                 size_t,
-                 Ts...,
-                 immer::flex_vector<immer::box<Object<Ts...>>>> _obj;
+    using box_t = immer::box<BasicObject, MP>;
+    using seq_t = immer::flex_vector<box_t, MP>;
+    // alternative (valori) e loro rappresentazione nell'oggetto, con gli
+    // stessi indici
+    using values_t = std::variant<std::monostate,
+                                  bool,
+                                  size_t,
+                                  Ts...,
+                                  seq_t,
+                                  DenseSequence<Ts>...>;
+    using variant_t = std::variant<std::monostate,
+                                   bool,
+                                   size_t,
+                                   detail::stored_t<Ts, MP>...,
+                                   seq_t,
+                                   DenseSequence<Ts>...>;
 
-  public:
-    Object() {}
+    // le sequenze dense seguono, nello stesso ordine dei Ts
+    static constexpr size_t seq_index = 3 + sizeof...(Ts);
 
     template <typename T>
-    Object(const T& obj) : _obj(obj) {}
+    static constexpr size_t index = detail::variant_index<T, values_t>::value;
+
+    template <size_t I>
+    using value_t = std::variant_alternative_t<I, values_t>;
+
+    variant_t _obj;
+
+    // valore dell'alternativa I; std::bad_variant_access se non è quella attiva
+    template <size_t I>
+    const value_t<I>& value () const {
+      return detail::unwrap(std::get<I>(_obj));
+    }
+
+    // come value, ma sposta il valore se è memorizzato nell'oggetto (gli
+    // atomi fuori linea vengono copiati dal box)
+    template <size_t I>
+    value_t<I> take () {
+      auto& v = std::get<I>(_obj);
+      if constexpr (std::is_same<std::decay_t<decltype(v)>, value_t<I>>::value) {
+        return std::move(v);
+      } else {
+        return v.box.get();
+      }
+    }
 
     template <typename T>
-    operator T () const {
-      return std::get<T>(_obj);
+    static variant_t make (T&& obj) {
+      using U = std::decay_t<T>;
+      if constexpr (index<U> != detail::npos) {
+        return variant_t(std::in_place_index<index<U>>, std::forward<T>(obj));
+      } else {
+        // conversione implicita (es. da const char* a std::string): si
+        // sceglie l'alternativa come farebbe std::variant
+        return std::visit([](auto&& v) {
+          using V = std::decay_t<decltype(v)>;
+          return variant_t(std::in_place_index<index<V>>, std::move(v));
+        }, values_t(std::forward<T>(obj)));
+      }
+    }
+
+    seq_t boxed () const {
+      return visit_dense([](const auto& d) {
+        auto res = seq_t().transient();
+        for (const auto& el : d) res.push_back(BasicObject(el));
+        return std::move(res).persistent();
+      });
+    }
+
+    template <size_t I = 0>
+    static bool dense_pair (BasicObject& res, const BasicObject& a, const BasicObject& b) {
+      if constexpr (I == sizeof...(Ts)) {
+        return false;
+      } else {
+        if (a._obj.index() != 3 + I) return dense_pair<I+1>(res, a, b);
+        const auto& y = a.template value<3 + I>();
+        const auto& z = b.template value<3 + I>();
+        res._obj.template emplace<seq_index + 1 + I>({y, z});
+        return true;
+      }
+    }
+
+    template <size_t I = 0>
+    static BasicObject pack_dense (const std::vector<BasicObject>& els) {
+      if constexpr (I == sizeof...(Ts)) {
+        return pack_boxed(els);
+      } else {
+        if (els[0]._obj.index() != 3 + I) return pack_dense<I+1>(els);
+        auto res = std::variant_alternative_t<seq_index + 1 + I, variant_t>().transient();
+        for (const auto& el : els) res.push_back(el.template value<3 + I>());
+        BasicObject dense;
+        dense._obj.template emplace<seq_index + 1 + I>(std::move(res).persistent());
+        return dense;
+      }
+    }
+
+    static BasicObject pack_boxed (const std::vector<BasicObject>& els) {
+      auto res = seq_t().transient();
+      for (const auto& el : els) res.push_back(box_t(el));
+      return std::move(res).persistent();
+    }
+
+    // hash di un atomo di tipo U memorizzato come Object
+    template <typename U>
+    static size_t atom_hash (const U& v) {
+      return detail::hash_combine(index<U>, detail::hash_value(v));
+    }
+
+    template <size_t I = 1>
+    static bool atoms_equal (const BasicObject& a, const BasicObject& b) {
+      if constexpr (I == seq_index) {
+        return false;
+      } else {
+        if (a._obj.index() != I) return atoms_equal<I+1>(a, b);
+        return a.template value<I>() == b.template value<I>();
+      }
+    }
+
+    static bool sequences_equal (const BasicObject& a, const BasicObject& b) {
+      auto id = a.identity();
+      if (!id.empty() and id == b.identity()) return true;
+      if (a.isDense() and a._obj.index() == b._obj.index()) {
+        return a.visit_dense([&](const auto& y) {
+          const auto& z = std::get<std::decay_t<decltype(y)>>(b._obj);
+          return y.size() == z.size() and std::equal(y.begin(), y.end(), z.begin());
+        });
+      }
+      // a e b non sono entrambe dense dello stesso tipo: si confrontano box
+      // a box, convertendo solo quella densa (se c'è)
+      if (a.isDense() or b.isDense()) {
+        seq_t y = a;
+        seq_t z = b;
+        return boxed_equal(y, z);
+      }
+      return boxed_equal(a.as_sequence(), b.as_sequence());
+    }
+
+    static bool boxed_equal (const seq_t& y, const seq_t& z) {
+      if (y.size() != z.size()) return false;
+      auto zit = z.begin();
+      for (const auto& el : y) {
+        // box condivisi: stesso oggetto, non serve visitarlo
+        if (&el.get() != &zit->get() and !(el.get() == zit->get())) return false;
+        ++zit;
+      }
+      return true;
+    }
+
+  public:
+    BasicObject() {}
+
+    template <typename T, typename = std::enable_if_t<!std::is_same<std::decay_t<T>, BasicObject>::value>>
+    BasicObject(T&& obj) : _obj(make(std::forward<T>(obj))) {}
+
+    // solo verso le alternative: le altre conversioni (es. verso box) sono
+    // quelle dei costruttori dei tipi di destinazione
+    template <typename T, typename = std::enable_if_t<index<T> != detail::npos>>
+    operator T () const& {
+      if constexpr (std::is_same<T, seq_t>::value) {
+        if (isDense()) return boxed();
+      }
+      return value<index<T>>();
+    }
+
+    // da un temporaneo il valore viene spostato, senza toccare i refcount;
+    // solo gli atomi fuori linea (vedi FPAR_INLINE_SIZE) vengono copiati
+    template <typename T, typename = std::enable_if_t<index<T> != detail::npos>>
+    operator T () && {
+      if constexpr (std::is_same<T, seq_t>::value) {
+        if (isDense()) return boxed();
+      }
+      return take<index<T>>();
+    }
+
+    /*! \brief Valore di tipo U contenuto nell'oggetto, senza copie
+     *  \return riferimento valido finché l'oggetto non viene modificato;
+     *          lancia std::bad_variant_access se l'oggetto non contiene un
+     *          U (una sequenza densa non contiene una Sequence)
+     */
+    template <typename U>
+    const U& get () const& {
+      return value<index<U>>();
+    }
+
+    // spostato se memorizzato nell'oggetto, copiato dal box altrimenti
+    template <typename U>
+    U get () && {
+      return take<index<U>>();
+    }
+
+    /*! \brief Come get, ma senza eccezioni
+     *  \return puntatore al valore di tipo U, nullptr se l'oggetto non
+     *          contiene un U
+     */
+    template <typename U>
+    const U* get_if () const noexcept {
+      if constexpr (index<U> == detail::npos) {
+        return nullptr;
+      } else {
+        auto p = std::get_if<index<U>>(&_obj);
+        return p ? &detail::unwrap(*p) : nullptr;
+      }
     }
 
     constexpr bool isBottom () const noexcept {
-      return std::holds_alternative<std::monostate>(_obj);
+      return _obj.index() == 0;
     }
 
     constexpr bool isSequence () const noexcept {
-      return std::holds_alternative<immer::flex_vector<immer::box<Object<Ts...>>>>(_obj);
+      return _obj.index() >= seq_index and _obj.index() != std::variant_npos;
     }
 
+    constexpr bool isDense () const noexcept {
+      return _obj.index() > seq_index and _obj.index() != std::variant_npos;
+    }
+
+    // true se T è una delle alternative di Object (es. DenseSequence<bool>)
+    template <typename T>
+    static constexpr bool holds = (index<T> != detail::npos);
+
     template <typename T>
     constexpr bool is () const noexcept {
-      return std::holds_alternative<T>(_obj);
+      if constexpr (index<T> == detail::npos) {
+        return false;
+      } else {
+        return _obj.index() == index<T>;
+      }
+    }
+
+    /*! \brief Sequenza di box contenuta nell'oggetto, senza copie
+     *  \return riferimento valido finché l'oggetto non viene modificato;
+     *          lancia std::bad_variant_access se l'oggetto non è una
+     *          sequenza di box (es. una sequenza densa)
+     */
+    const seq_t& as_sequence () const {
+      return value<seq_index>();
+    }
+
+    /*! \brief Valore di tipo U contenuto nell'oggetto, senza controlli.
+     *         Da usare solo se il tipo è noto staticamente (vedi Typed.hpp):
+     *         se is<U>() è falso il comportamento non è definito.
+     */
+    template <typename U>
+    const U& unchecked () const noexcept {
+      return detail::unwrap(*std::get_if<index<U>>(&_obj));
+    }
+
+    /*! \brief Applica f alla sequenza densa contenuta nell'oggetto
+     *  \param f Funzione invocata con const DenseSequence<O>&
+     *  \return f(d); lancia std::bad_variant_access se l'oggetto non è denso
+     */
+    template <typename F>
+    decltype(auto) visit_dense (F&& f) const {
+      using res_t = std::common_type_t<std::invoke_result_t<F&, const DenseSequence<Ts>&>...>;
+      return std::visit([&](const auto& v) -> res_t {
+        if constexpr (detail::is_dense<std::decay_t<decltype(v)>>::value) {
+          return f(v);
+        } else {
+          throw std::bad_variant_access();
+        }
+      }, _obj);
+    }
+
+    /*! \brief Identità della rappresentazione (vedi detail::identity_t)
+     *  \return identità vuota per bottom e per gli atomi
+     */
+    detail::identity_t identity () const noexcept {
+      return std::visit([](const auto& s) -> detail::identity_t {
+        const auto& v = detail::unwrap(s);
+        using V = std::decay_t<decltype(v)>;
+        if constexpr (std::is_same<V, seq_t>::value) {
+          return {v.impl().root, v.impl().tail, v.size()};
+        } else if constexpr (detail::is_dense<V>::value) {
+          return {v.data(), nullptr, v.size()};
+        } else {
+          return {};
+        }
+      }, _obj);
+    }
+
+    /*! \brief Hash strutturale dell'oggetto.
+     *         Oggetti uguali (operator==) hanno lo stesso hash: una sequenza
+     *         densa ha lo stesso hash della corrispondente sequenza di box.
+     *  \return hash, calcolato visitando tutto l'oggetto
+     */
+    size_t hash () const {
+      return std::visit([](const auto& s) -> size_t {
+        const auto& v = detail::unwrap(s);
+        using V = std::decay_t<decltype(v)>;
+        size_t h = seq_index;
+        if constexpr (std::is_same<V, std::monostate>::value) {
+          return 0;
+        } else if constexpr (std::is_same<V, seq_t>::value) {
+          for (const auto& el : v) h = detail::hash_combine(h, el->hash());
+          return h;
+        } else if constexpr (detail::is_dense<V>::value) {
+          for (const auto& el : v) h = detail::hash_combine(h, atom_hash(el));
+          return h;
+        } else {
+          return atom_hash(v);
+        }
+      }, _obj);
+    }
+
+    /*! \brief Uguaglianza strutturale.
+     *         Atomi uguali solo se dello stesso tipo; le sequenze sono
+     *         confrontate elemento per elemento, dense o meno, senza visitare
+     *         le parti condivise (stessa identità o stesso box).
+     */
+    friend bool operator== (const BasicObject& a, const BasicObject& b) {
+      if (a.isSequence() and b.isSequence()) return sequences_equal(a, b);
+      if (a._obj.index() != b._obj.index()) return false;
+      if (a.isBottom()) return true;
+      return atoms_equal(a, b);
+    }
+
+    friend bool operator!= (const BasicObject& a, const BasicObject& b) {
+      return !(a == b);
+    }
+
+    /*! \brief Costruisce la coppia <a, b>
+     *  \return coppia densa se a e b sono atomi dello stesso tipo tra i Ts,
+     *          altrimenti sequenza di box
+     */
+    static BasicObject pair (const BasicObject& a, const BasicObject& b) {
+      BasicObject res;
+      if (a._obj.index() == b._obj.index() and dense_pair(res, a, b)) return res;
+      return seq_t({box_t(a), box_t(b)});
+    }
+
+    static BasicObject pair (const BasicObject& a, const box_t& b) {
+      BasicObject res;
+      if (a._obj.index() == b->_obj.index() and dense_pair(res, a, *b)) return res;
+      return seq_t({box_t(a), b});
+    }
+
+    static BasicObject pair (const box_t& a, const box_t& b) {
+      BasicObject res;
+      if (a->_obj.index() == b->_obj.index() and dense_pair(res, *a, *b)) return res;
+      return seq_t({a, b});
+    }
+
+    /*! \brief Costruisce la sequenza degli elementi di els
+     *  \return sequenza densa se gli elementi sono atomi dello stesso tipo
+     *          tra i Ts, altrimenti sequenza di box
+     */
+    static BasicObject pack (const std::vector<BasicObject>& els) {
+      if (els.empty()) return seq_t();
+      auto idx = els[0]._obj.index();
+      for (const auto& el : els) {
+        if (el._obj.index() != idx) return pack_boxed(els);
+      }
+      return pack_dense(els);
     }
   };
 
@@ -64,10 +529,49 @@ namespace fpar {
   constexpr auto Bottom = std::monostate();
 
   /*
-    Type alias per le sequenze, anche queste generiche
+    Memory policy per gli oggetti. Quasi ogni primitiva binaria alloca una
+    coppia e i suoi box, che vengono liberati subito dopo: pooled_memory
+    mantiene free list per thread (e una globale) più lunghe di quelle di
+    default, quindi le allocazioni dei nodi piccoli raramente arrivano a
+    malloc, al prezzo di trattenere più memoria.
+  */
+  using default_memory = immer::default_memory_policy;
+  using pooled_memory = immer::memory_policy<
+    immer::free_list_heap_policy<immer::malloc_heap, 1 << 16>,
+    immer::refcount_policy,
+    immer::spinlock_policy>;
+
+  /*
+    Tipo degli oggetti con la memory policy di default:
+      using Number = Object<int, double>;
+    e con le free list di pooled_memory:
+      using Number = PooledObject<int, double>;
+  */
+  template <typename... Ts>
+  using Object = BasicObject<default_memory, Ts...>;
+
+  template <typename... Ts>
+  using PooledObject = BasicObject<pooled_memory, Ts...>;
+
+  /*
+    Type alias per i box e le sequenze, anche questi generici:
+    usano la memory policy del tipo degli oggetti
   */
   template <typename T>
-  using Sequence = immer::flex_vector<immer::box<T>>;
+  using Box = immer::box<T, typename T::memory_policy>;
+
+  template <typename T>
+  using Sequence = immer::flex_vector<Box<T>, typename T::memory_policy>;
+}
+
+namespace std {
+  // permette di usare gli oggetti come chiavi di unordered_map/unordered_set
+  template <typename MP, typename... Ts>
+  struct hash<fpar::BasicObject<MP, Ts...>> {
+    size_t operator() (const fpar::BasicObject<MP, Ts...>& x) const {
+      return x.hash();
+    }
+  };
 }
 
 #endif
@@ -0,0 +1,318 @@
+#ifndef OFFLOAD_HPP
+#define OFFLOAD_HPP
+
+/** \file Offload.hpp
+ * Calcolo su acceleratore (OpenMP target)
+ * Una Matrix<O> è una sequenza di righe dense di tipo O copiata una sola
+ * volta nella memoria di un dispositivo (GPU) con upload. Le operazioni di
+ * questo file prendono e restituiscono Matrix: ogni stadio è un kernel
+ * "omp target" sul dispositivo e i risultati intermedi restano nella sua
+ * memoria; solo download li copia di nuovo in un oggetto. Le primitive
+ * aritmetiche sono riconosciute come in Kernels.hpp, confrontando il
+ * puntatore a funzione:
+ *   zip(add_op<O, T>, a, b)    <-> apply_to_all(zip(add_op)) sulle righe
+ *   trans(a)                   <-> trans
+ *   insert(add_op<O, T>, n, a) <-> apply_to_all(insert(add_op, n)) sulle righe
+ *   mm(a, b)                   <-> MM di matrix_mul.cpp
+ *
+ *   auto a = offload::upload<int>(x), b = offload::upload<int>(y);
+ *   Number r = offload::download<Number>(offload::mm(a, b));
+ *
+ * Il dispositivo usato è quello di default di OpenMP (OMP_DEFAULT_DEVICE);
+ * senza dispositivi, o se il compilatore non genera codice per un
+ * acceleratore (con gcc: -foffload=nvptx-none o amdgcn-amdhsa), i kernel
+ * vengono eseguiti sull'host con lo stesso risultato.
+ */
+
+#include "Object.hpp"
+#include "Functions.hpp"
+#include "Kernels.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+namespace fpar {
+namespace offload {
+
+  /*! \class error
+   *  \brief Oggetto che non è una matrice di O, forme incompatibili,
+   *         primitiva non supportata o errore del dispositivo
+   */
+  struct error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  /*! \brief true se OpenMP ha almeno un dispositivo oltre all'host */
+  inline bool available () {
+    return omp_get_num_devices() > 0;
+  }
+
+  /*! \class Matrix
+   *  \brief Matrice rows x cols di O, per righe, nella memoria del
+   *         dispositivo. Non copiabile: la memoria è rilasciata dal
+   *         distruttore.
+   */
+  template <typename O>
+  class Matrix {
+    static_assert(fpar::detail::simd_type<O>, "offload::Matrix requires an arithmetic atom type");
+
+  private:
+    size_t _rows = 0, _cols = 0;
+    int _device = 0;
+    O* _data = nullptr;
+
+  public:
+    Matrix (size_t rows, size_t cols, int device = omp_get_default_device())
+      : _rows(rows), _cols(cols), _device(device) {
+      if (rows * cols == 0) return;
+      _data = static_cast<O*>(omp_target_alloc(rows * cols * sizeof(O), device));
+      if (!_data) throw error("offload: omp_target_alloc failed");
+    }
+
+    Matrix (Matrix&& m) noexcept
+      : _rows(m._rows), _cols(m._cols), _device(m._device), _data(std::exchange(m._data, nullptr)) {}
+
+    Matrix& operator= (Matrix&& m) noexcept {
+      std::swap(_rows, m._rows);
+      std::swap(_cols, m._cols);
+      std::swap(_device, m._device);
+      std::swap(_data, m._data);
+      return *this;
+    }
+
+    Matrix (const Matrix&) = delete;
+    Matrix& operator= (const Matrix&) = delete;
+
+    ~Matrix () {
+      if (_data) omp_target_free(_data, _device);
+    }
+
+    size_t rows () const noexcept { return _rows; }
+    size_t cols () const noexcept { return _cols; }
+    size_t size () const noexcept { return _rows * _cols; }
+    int device () const noexcept { return _device; }
+
+    // puntatore nella memoria del dispositivo: da usare con is_device_ptr
+    O* data () noexcept { return _data; }
+    const O* data () const noexcept { return _data; }
+
+    /*! \brief Copia n elementi dall'host a partire dall'elemento offset */
+    void write (const O* src, size_t n, size_t offset = 0) {
+      if (n == 0) return;
+      if (omp_target_memcpy(_data, const_cast<O*>(src), n * sizeof(O), offset * sizeof(O), 0,
+                            _device, omp_get_initial_device()) != 0) {
+        throw error("offload: omp_target_memcpy failed");
+      }
+    }
+
+    /*! \brief Copia n elementi sull'host a partire dall'elemento offset */
+    void read (O* dst, size_t n, size_t offset = 0) const {
+      if (n == 0) return;
+      if (omp_target_memcpy(dst, _data, n * sizeof(O), 0, offset * sizeof(O),
+                            omp_get_initial_device(), _device) != 0) {
+        throw error("offload: omp_target_memcpy failed");
+      }
+    }
+  };
+
+  namespace detail {
+    // riga di una matrice: sequenza densa di O o sequenza di atomi di tipo O
+    template <typename O, typename T>
+    inline void stage_row (const T& x, std::vector<O>& host, size_t cols) {
+      if (x.template is<DenseSequence<O>>()) {
+        const auto& d = x.template get<DenseSequence<O>>();
+        if (d.size() != cols) throw error("offload: rows of different lengths");
+        host.insert(host.end(), d.begin(), d.end());
+        return;
+      }
+      if (!x.isSequence() or x.isDense()) throw error("offload: not a matrix of the atom type");
+      const auto& s = x.as_sequence();
+      if (s.size() != cols) throw error("offload: rows of different lengths");
+      for (const auto& el : s) {
+        if (!el->template is<O>()) throw error("offload: not a matrix of the atom type");
+        host.push_back(el->template get<O>());
+      }
+    }
+
+    template <typename O, typename T, typename F>
+    inline fpar::detail::arith primitive (const F& f) {
+      auto op = fpar::detail::arith_kind<O, T>(f);
+      if (op == fpar::detail::arith::none) throw error("offload: not an arithmetic primitive");
+      return op;
+    }
+  }
+
+  /*! \brief Copia una matrice nella memoria del dispositivo
+   *  \param x Sequenza di righe (dense o di atomi) di tipo O, tutte della
+   *         stessa lunghezza, oppure una sola riga densa
+   */
+  template <typename O, typename T>
+  inline Matrix<O> upload (const T& x, int device = omp_get_default_device()) {
+    if (x.isBottom() or !x.isSequence()) throw error("offload: not a matrix of the atom type");
+    auto host = std::vector<O>();
+    size_t rows = 1, cols = 0;
+    if (x.isDense()) {
+      cols = fpar::detail::seq_size(x);
+      detail::stage_row<O>(x, host, cols);
+    } else {
+      const auto& s = x.as_sequence();
+      rows = s.size();
+      cols = rows ? fpar::detail::seq_size(*s[0]) : 0;
+      host.reserve(rows * cols);
+      for (const auto& row : s) detail::stage_row<O>(*row, host, cols);
+    }
+    auto m = Matrix<O>(rows, cols, device);
+    m.write(host.data(), host.size());
+    return m;
+  }
+
+  /*! \brief Copia una matrice dal dispositivo
+   *  \return sequenza di righe dense
+   */
+  template <typename T, typename O>
+  inline T download (const Matrix<O>& m) {
+    auto res = Sequence<T>().transient();
+    for (size_t i = 0; i < m.rows(); i++) {
+      auto row = DenseSequence<O>(m.cols()).transient();
+      m.read(row.data_mut(), m.cols(), i * m.cols());
+      res.push_back(Box<T>(T(std::move(row).persistent())));
+    }
+    return std::move(res).persistent();
+  }
+
+  /*! \brief Copia dal dispositivo tutti gli elementi di una matrice
+   *  \return sequenza densa degli elementi, riga per riga
+   */
+  template <typename T, typename O>
+  inline T download_flat (const Matrix<O>& m) {
+    auto res = DenseSequence<O>(m.size()).transient();
+    m.read(res.data_mut(), m.size());
+    return std::move(res).persistent();
+  }
+
+  /*! \brief zip(f) elemento per elemento tra due matrici della stessa forma
+   *  \param f add_op, sub_op, mul_op o div_op su atomi di tipo O
+   */
+  template <typename T, typename O, typename F>
+  inline Matrix<O> zip (F f, const Matrix<O>& a, const Matrix<O>& b) {
+    using fpar::detail::arith;
+    auto op = detail::primitive<O, T>(f);
+    if (a.rows() != b.rows() or a.cols() != b.cols()) throw error("offload: shapes differ");
+    auto res = Matrix<O>(a.rows(), a.cols(), a.device());
+    const O* y = a.data();
+    const O* z = b.data();
+    O* out = res.data();
+    size_t n = a.size();
+    int dev = a.device();
+    if (op == arith::div) {
+      bool zero = false;
+      #pragma omp target teams distribute parallel for reduction(||:zero) is_device_ptr(z) device(dev)
+      for (size_t i = 0; i < n; i++) zero = zero || (z[i] == 0);
+      // div_op restituisce bottom, che una matrice densa non può contenere
+      if (zero) throw error("offload: division by zero");
+    }
+    switch (op) {
+      case arith::add:
+        #pragma omp target teams distribute parallel for is_device_ptr(y, z, out) device(dev)
+        for (size_t i = 0; i < n; i++) out[i] = y[i] + z[i];
+        break;
+      case arith::sub:
+        #pragma omp target teams distribute parallel for is_device_ptr(y, z, out) device(dev)
+        for (size_t i = 0; i < n; i++) out[i] = y[i] - z[i];
+        break;
+      case arith::mul:
+        #pragma omp target teams distribute parallel for is_device_ptr(y, z, out) device(dev)
+        for (size_t i = 0; i < n; i++) out[i] = y[i] * z[i];
+        break;
+      case arith::div:
+        #pragma omp target teams distribute parallel for is_device_ptr(y, z, out) device(dev)
+        for (size_t i = 0; i < n; i++) out[i] = y[i] / z[i];
+        break;
+      case arith::none:
+        break;
+    }
+    return res;
+  }
+
+  /*! \brief Trasposta
+   *  \return matrice cols x rows
+   */
+  template <typename O>
+  inline Matrix<O> trans (const Matrix<O>& a) {
+    auto res = Matrix<O>(a.cols(), a.rows(), a.device());
+    const O* x = a.data();
+    O* out = res.data();
+    size_t r = a.rows(), c = a.cols();
+    int dev = a.device();
+    #pragma omp target teams distribute parallel for collapse(2) is_device_ptr(x, out) device(dev)
+    for (size_t i = 0; i < r; i++) {
+      for (size_t j = 0; j < c; j++) out[j * r + i] = x[i * c + j];
+    }
+    return res;
+  }
+
+  /*! \brief insert(f, n) su ogni riga
+   *  \param f add_op o mul_op su atomi di tipo O (associative); per i tipi
+   *         in virgola mobile l'ordine delle operazioni non è quello
+   *         sequenziale, come con insert(f, n, associative)
+   *  \return riga di rows elementi: <f(n, f(x11, ...)), ..., f(n, f(xr1, ...))>
+   */
+  template <typename T, typename O, typename F>
+  inline Matrix<O> insert (F f, const T& n, const Matrix<O>& a) {
+    using fpar::detail::arith;
+    auto op = detail::primitive<O, T>(f);
+    if (op != arith::add and op != arith::mul) throw error("offload: insert requires add_op or mul_op");
+    if (!n.template is<O>()) throw error("offload: neutral element is not of the atom type");
+    O init = n;
+    auto res = Matrix<O>(1, a.rows(), a.device());
+    const O* x = a.data();
+    O* out = res.data();
+    size_t r = a.rows(), c = a.cols();
+    int dev = a.device();
+    bool add = (op == arith::add);
+    #pragma omp target teams distribute parallel for is_device_ptr(x, out) device(dev)
+    for (size_t i = 0; i < r; i++) {
+      O acc = init;
+      if (add) {
+        for (size_t j = 0; j < c; j++) acc += x[i * c + j];
+      } else {
+        for (size_t j = 0; j < c; j++) acc *= x[i * c + j];
+      }
+      out[i] = acc;
+    }
+    return res;
+  }
+
+  /*! \brief Prodotto di matrici: elemento (i, j) uguale a IP di riga i di a
+   *         e colonna j di b, come MM in matrix_mul.cpp
+   *  \return matrice a.rows() x b.cols()
+   */
+  template <typename O>
+  inline Matrix<O> mm (const Matrix<O>& a, const Matrix<O>& b) {
+    if (a.cols() != b.rows()) throw error("offload: shapes differ");
+    auto res = Matrix<O>(a.rows(), b.cols(), a.device());
+    const O* x = a.data();
+    const O* y = b.data();
+    O* out = res.data();
+    size_t m = a.rows(), k = a.cols(), n = b.cols();
+    int dev = a.device();
+    #pragma omp target teams distribute parallel for collapse(2) is_device_ptr(x, y, out) device(dev)
+    for (size_t i = 0; i < m; i++) {
+      for (size_t j = 0; j < n; j++) {
+        O acc = 0;
+        for (size_t l = 0; l < k; l++) acc += x[i * k + l] * y[l * n + j];
+        out[i * n + j] = acc;
+      }
+    }
+    return res;
+  }
+}
+}
+
+#endif
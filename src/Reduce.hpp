@@ -0,0 +1,256 @@
+#ifndef REDUCE_HPP
+#define REDUCE_HPP
+
+/** \file Reduce.hpp
+ * Riduzioni di sequenze
+ * Algoritmi di riduzione usati da insert. Se il chiamante dichiara che
+ * l'operazione è associativa, la sequenza viene ridotta con un albero di
+ * profondità logaritmica: i sotto-alberi sono task dell'esecutore corrente e
+ * le foglie sono blocchi ridotti sequenzialmente.
+ * Gli algoritmi accettano iteratori qualsiasi (anche indici) e un accessore
+ * che restituisce l'elemento corrispondente: in questo modo riducono sia
+ * sequenze di box sia sequenze dense sia elementi calcolati al volo dai
+ * funzionali fusi. Se f ha una forma binaria (vedi detail::Binary) gli
+ * elementi le vengono passati direttamente, altrimenti le coppie passate a f
+ * sono costruite con Object::pair.
+ */
+
+#include "Object.hpp"
+#include "Binary.hpp"
+#include "Executor.hpp"
+#include "Grain.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace fpar {
+
+  /*
+    Proprietà algebriche dell'operazione di riduzione, dichiarate dal
+    chiamante di insert:
+      insert<par_exec>(add, Number(0), associative)
+    commutative implica associative.
+  */
+  struct associative_t {};
+  struct commutative_t : associative_t {};
+  constexpr associative_t associative{};
+  constexpr commutative_t commutative{};
+
+  namespace detail {
+
+    /*! \brief Dimensione delle foglie della riduzione parallela
+     *  \param n Numero di elementi da ridurre
+     *  \param workers Concorrenza dell'esecutore
+     *  \param min_grain Elementi che costano circa quanto la soglia di cutoff
+     *  \return circa 8 foglie per thread, ma mai meno di min_grain elementi:
+     *          una foglia deve valere almeno il costo di un task
+     */
+    inline size_t reduce_grain (size_t n, size_t workers, size_t min_grain) noexcept {
+      auto grain = n / (8 * workers);
+      if (grain < min_grain) grain = min_grain;
+      return grain ? grain : 1;
+    }
+
+    /*
+      Accessore di default degli elementi: per le sequenze di box restituisce
+      il box (che può essere riusato nella coppia passata a f), per le
+      sequenze dense l'oggetto costruito dall'atomo
+    */
+    template <typename T>
+    struct deref {
+      template <typename It>
+      decltype(auto) operator() (const It& it) const {
+        if constexpr (std::is_same<std::decay_t<decltype(*it)>, Box<T>>::value) {
+          return *it;
+        } else {
+          return T(*it);
+        }
+      }
+    };
+
+    /*! \brief Riduzione sequenziale da sinistra
+     *  \param f Funzione binaria, es. Binary
+     *  \param acc Valore iniziale
+     *  \param get Accessore: iteratore -> elemento (box o oggetto)
+     *  \return f(...f(f(acc, x1), x2)..., xN) con xi = get(it), it in [first, last)
+     */
+    template <typename T, typename F, typename It, typename Get = deref<T>>
+    inline T fold (const F& f, T acc, It first, It last, const Get& get = Get()) {
+      for (size_t k = 0; first != last; ++first, ++k) {
+        if (k % cancel_stride == 0) cancellation_point();
+        acc = f(acc, get(first));
+      }
+      return acc;
+    }
+
+    /*! \brief Riduzione ad albero di [first, last), non vuoto.
+     *         Richiede che f sia associativa.
+     */
+    template <typename T, typename F, typename It, typename Get = deref<T>>
+    inline T tree_reduce (Executor& ex, const F& f, It first, It last, size_t grain,
+                          const Get& get = Get()) {
+      size_t n = last - first;
+      if (n <= grain) {
+        T head = value<T>(get(first));
+        return fold<T>(f, std::move(head), first + 1, last, get);
+      }
+      auto mid = first + n/2;
+      T left;
+      TaskGroup group(ex);
+      group.run([&]{ left = tree_reduce<T>(ex, f, first, mid, grain, get); });
+      T right = tree_reduce<T>(ex, f, mid, last, grain, get);
+      group.wait();
+      return f(left, right);
+    }
+
+    /*! \brief Riduzione a blocchi di [first, last), non vuoto.
+     *         Richiede che f sia associativa e commutativa: i risultati dei
+     *         blocchi vengono combinati nell'ordine in cui sono pronti.
+     */
+    template <typename T, typename F, typename It, typename Get = deref<T>>
+    inline T unordered_reduce (Executor& ex, const F& f, It first, It last, size_t grain,
+                               const Get& get = Get()) {
+      size_t n = last - first;
+      size_t n_chunks = (n + grain - 1) / grain;
+      std::optional<T> acc;
+      std::mutex m;
+      parallel_for(ex, n_chunks, [&](size_t c) {
+        auto cfirst = first + n*c/n_chunks;
+        auto clast = first + n*(c+1)/n_chunks;
+        T head = value<T>(get(cfirst));
+        T part = fold<T>(f, std::move(head), cfirst + 1, clast, get);
+        std::unique_lock<std::mutex> lk(m);
+        while (acc) { // combina fuori dal lock con il risultato già pronto
+          T other = std::move(*acc);
+          acc.reset();
+          lk.unlock();
+          part = f(other, part);
+          lk.lock();
+        }
+        acc.emplace(std::move(part));
+      });
+      return std::move(*acc);
+    }
+
+    /*! \brief Riduzione di [first, last) secondo le proprietà di f
+     *  \param Tag void (nessuna proprietà), associative_t o commutative_t
+     *  \param par se true riduzione parallela, se il lavoro stimato supera la
+     *         soglia di cutoff; la dimensione delle foglie dipende dal costo
+     *         stimato di un elemento
+     *  \return f(n, f(x1, ...)) con xi = get(it), bottom se l'intervallo è vuoto
+     */
+    template <bool par, typename Tag, typename T, typename F, typename It, typename Get = deref<T>>
+    inline T reduce (const F& f, const T& n, It first, It last, const Get& get = Get(),
+                     const Cutoff& cutoff = Cutoff()) {
+      size_t els = last - first;
+      if (els == 0) return Bottom;
+      const Binary<T, F> op(f);
+      T acc = n;
+      if constexpr (par) {
+        auto& ex = current_executor();
+        // il primo elemento si riduce nel thread chiamante, misurandone il costo
+        size_t done = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto probe = [&]{ acc = op(acc, get(first)); return size_t(1); };
+        if (worth_parallel(cutoff, ex, els, probe, done)) {
+          auto per_element = done ? elapsed_ns(start) / double(done) : 0.0;
+          auto rest_first = first + done;
+          auto rest = els - done;
+          if constexpr (std::is_same<Tag, void>::value) {
+            // senza proprietà dichiarate: un blocco per thread, ognuno a partire da n
+            auto n_threads = std::min(ex.concurrency(), rest);
+            auto locals = std::vector<T>(n_threads);
+            parallel_for(ex, n_threads, [&](size_t i) {
+              locals[i] = fold<T>(op, n, rest_first + rest*i/n_threads,
+                                  rest_first + rest*(i+1)/n_threads, get);
+            });
+            return fold<T>(op, acc, locals.begin(), locals.end());
+          } else {
+            auto grain = reduce_grain(rest, ex.concurrency(), cost_grain(cutoff, per_element));
+            T r;
+            if (rest <= grain) {
+              return fold<T>(op, acc, rest_first, last, get);
+            } else if constexpr (std::is_same<Tag, commutative_t>::value) {
+              r = unordered_reduce<T>(ex, op, rest_first, last, grain, get);
+            } else {
+              r = tree_reduce<T>(ex, op, rest_first, last, grain, get);
+            }
+            // l'elemento neutro (e il primo elemento) vengono combinati una sola volta
+            return op(acc, r);
+          }
+        }
+        return fold<T>(op, acc, first + done, last, get);
+      }
+      return fold<T>(op, acc, first, last, get);
+    }
+
+    // somme prefisse sequenziali di [first, last), a partire da acc
+    template <typename T, typename F, typename It, typename Get>
+    inline T scan_fold (const F& f, T acc, It first, It last, T* out, const Get& get) {
+      for (size_t k = 0; first != last; ++first, ++out, ++k) {
+        if (k % cancel_stride == 0) cancellation_point();
+        acc = f(acc, get(first));
+        *out = acc;
+      }
+      return acc;
+    }
+
+    /*! \brief Somme prefisse di [first, last) secondo le proprietà di f
+     *  \param Tag void (nessuna proprietà), associative_t o commutative_t
+     *  \param par se true e f è associativa, scan parallela in due passate
+     *         sugli stessi blocchi di reduce: ogni blocco viene ridotto, i
+     *         risultati dei blocchi vengono accumulati sequenzialmente e ogni
+     *         blocco calcola le sue somme prefisse a partire dal proprio
+     *         accumulo. Senza proprietà la scan è sequenziale.
+     *  \return y1, ..., yN con yi = f(...f(f(n, x1), x2)..., xi)
+     */
+    template <bool par, typename Tag, typename T, typename F, typename It, typename Get = deref<T>>
+    inline std::vector<T> scan (const F& f, const T& n, It first, It last, const Get& get = Get(),
+                                const Cutoff& cutoff = Cutoff()) {
+      size_t els = last - first;
+      auto out = std::vector<T>(els);
+      if (els == 0) return out;
+      const Binary<T, F> op(f);
+      if constexpr (par and !std::is_same<Tag, void>::value) {
+        auto& ex = current_executor();
+        size_t done = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto probe = [&]{ out[0] = op(n, get(first)); return size_t(1); };
+        if (worth_parallel(cutoff, ex, els, probe, done)) {
+          auto per_element = done ? elapsed_ns(start) / double(done) : 0.0;
+          auto rest = els - done;
+          auto grain = reduce_grain(rest, ex.concurrency(), cost_grain(cutoff, per_element));
+          auto n_chunks = (rest + grain - 1) / grain;
+          auto lo = [&](size_t c) { return done + rest*c/n_chunks; };
+          if (n_chunks >= 2) {
+            // prima passata: riduzione dei blocchi, tranne l'ultimo
+            auto partials = std::vector<T>(n_chunks - 1);
+            parallel_for(ex, n_chunks - 1, [&](size_t c) {
+              T head = value<T>(get(first + lo(c)));
+              partials[c] = fold<T>(op, std::move(head), first + lo(c) + 1, first + lo(c+1), get);
+            });
+            auto carry = std::vector<T>(n_chunks);
+            carry[0] = done ? out[done - 1] : n;
+            for (size_t c = 1; c < n_chunks; c++) carry[c] = op(carry[c-1], partials[c-1]);
+            // seconda passata: somme prefisse di ogni blocco dal suo accumulo
+            parallel_for(ex, n_chunks, [&](size_t c) {
+              scan_fold<T>(op, carry[c], first + lo(c), first + lo(c+1), out.data() + lo(c), get);
+            });
+            return out;
+          }
+        }
+        auto acc = done ? out[done - 1] : n;
+        scan_fold<T>(op, acc, first + done, last, out.data() + done, get);
+        return out;
+      }
+      scan_fold<T>(op, n, first, last, out.data(), get);
+      return out;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,509 @@
+#ifndef SERIALIZE_HPP
+#define SERIALIZE_HPP
+
+/** \file Serialize.hpp
+ * Formato binario degli oggetti
+ * Un oggetto viene scritto come immagine binaria compatta, leggibile senza
+ * analisi del testo e senza un push_back per elemento:
+ *  - ogni oggetto inizia ad un offset multiplo di 8 con un'intestazione di
+ *    8 byte, il cui tag è l'indice dell'alternativa dell'oggetto (bottom,
+ *    bool, size_t, Ts..., sequenza, DenseSequence<Ts>...)
+ *  - gli atomi di tipo banalmente copiabile sono memorizzati così come sono
+ *    in memoria, le std::string come lunghezza e caratteri
+ *  - una sequenza di box memorizza il numero di elementi e la tabella degli
+ *    offset degli elementi, quindi l'accesso all'i-esimo elemento è O(1)
+ *  - una sequenza densa memorizza il numero di elementi seguito dall'array
+ *    contiguo, allineato per il tipo degli atomi; le sequenze dense di
+ *    stringhe sono una tabella di offset seguita da tutti i caratteri
+ * Le sequenze dense vengono caricate con una sola copia dell'array. Con
+ * serial::open il file viene mappato in memoria e View permette di
+ * navigare l'immagine e di leggere gli array densi direttamente dalla
+ * mappatura, senza deserializzare gli elementi.
+ *
+ * Il formato usa l'ordine dei byte e le dimensioni dei tipi della macchina
+ * che lo scrive: l'intestazione del file permette di riconoscere
+ * un'immagine scritta da una macchina incompatibile.
+ */
+
+#include "Object.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fpar {
+namespace serial {
+
+  /*! \class error
+   *  \brief Immagine non valida, tipo di atomo non serializzabile o errore
+   *         di I/O
+   */
+  struct error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  namespace detail {
+    constexpr char magic[4] = {'F', 'P', 'A', 'R'};
+    constexpr uint32_t version = 1;
+    constexpr uint32_t byte_order = 0x01020304;
+    constexpr size_t header_size = 16;
+
+    inline size_t align_up (size_t off, size_t align) noexcept {
+      return (off + align - 1) / align * align;
+    }
+
+    // tipi degli atomi serializzabili
+    template <typename U>
+    constexpr bool flat = std::is_trivially_copyable<U>::value;
+
+    template <typename U>
+    constexpr bool is_string = std::is_same<U, std::string>::value;
+
+    // alternative di un tipo di oggetti
+    template <typename T>
+    struct types;
+
+    template <typename MP, typename... Ts>
+    struct types<BasicObject<MP, Ts...>> {
+      using atoms = std::tuple<Ts...>;
+      static constexpr uint32_t n = sizeof...(Ts);
+      static constexpr uint32_t seq = 3 + n;    // sequenza di box
+      static constexpr uint32_t dense = 4 + n;  // prima sequenza densa
+    };
+
+    template <typename T, size_t I>
+    using atom_t = std::tuple_element_t<I, typename types<T>::atoms>;
+
+    /*! \class Writer
+     *  \brief Scrive l'immagine di un oggetto in un buffer
+     */
+    template <typename T>
+    class Writer {
+    private:
+      using ty = types<T>;
+      std::string& _buf;
+
+      void pad (size_t align) {
+        _buf.resize(align_up(_buf.size(), align), '\0');
+      }
+
+      template <typename U>
+      void put (const U& v) {
+        _buf.append(reinterpret_cast<const char*>(&v), sizeof(U));
+      }
+
+      void put_at (size_t off, uint64_t v) {
+        std::memcpy(&_buf[off], &v, sizeof(v));
+      }
+
+      size_t header (uint32_t tag) {
+        pad(8);
+        auto start = _buf.size();
+        put<uint32_t>(tag);
+        put<uint32_t>(0);
+        return start;
+      }
+
+      template <typename U>
+      void value (const U& v) {
+        if constexpr (is_string<U>) {
+          put<uint64_t>(v.size());
+          _buf.append(v);
+        } else if constexpr (flat<U>) {
+          pad(alignof(U));
+          put(v);
+        } else {
+          throw error("serial: atom type is not serializable");
+        }
+      }
+
+      template <typename U>
+      void dense (const DenseSequence<U>& d) {
+        put<uint64_t>(d.size());
+        if constexpr (is_string<U>) {
+          uint64_t off = 0;
+          for (const auto& s : d) {
+            put<uint64_t>(off);
+            off += s.size();
+          }
+          put<uint64_t>(off);
+          for (const auto& s : d) _buf.append(s);
+        } else if constexpr (flat<U>) {
+          pad(alignof(U) > 8 ? alignof(U) : 8);
+          _buf.append(reinterpret_cast<const char*>(d.data()), d.size() * sizeof(U));
+        } else {
+          throw error("serial: atom type is not serializable");
+        }
+      }
+
+      // atomi e sequenze dense dei Ts, a partire dall'I-esimo
+      template <size_t I = 0>
+      size_t alternative (const T& x) {
+        if constexpr (I == ty::n) {
+          throw error("serial: unknown alternative");
+        } else {
+          using U = atom_t<T, I>;
+          if (x.template is<U>()) {
+            auto start = header(3 + I);
+            value<U>(x.template get<U>());
+            return start;
+          }
+          if (x.template is<DenseSequence<U>>()) {
+            auto start = header(ty::dense + I);
+            dense<U>(x);
+            return start;
+          }
+          return alternative<I+1>(x);
+        }
+      }
+
+    public:
+      explicit Writer (std::string& buf) : _buf(buf) {}
+
+      /*! \brief Scrive x
+       *  \return offset di x nel buffer
+       */
+      size_t object (const T& x) {
+        if (x.isBottom()) return header(0);
+        if (x.template is<bool>()) {
+          auto start = header(1);
+          value<bool>(x.template get<bool>());
+          return start;
+        }
+        if (x.template is<size_t>()) {
+          auto start = header(2);
+          value<size_t>(x.template get<size_t>());
+          return start;
+        }
+        if (x.isSequence() and !x.isDense()) {
+          const auto& s = x.as_sequence();
+          auto start = header(ty::seq);
+          put<uint64_t>(s.size());
+          auto table = _buf.size();
+          _buf.resize(table + 8 * s.size(), '\0');
+          size_t i = 0;
+          for (const auto& el : s) {
+            auto off = object(*el);
+            put_at(table + 8 * i++, off);
+          }
+          return start;
+        }
+        return alternative(x);
+      }
+    };
+
+    /*! \class Reader
+     *  \brief Legge oggetti da un'immagine, controllando i limiti
+     */
+    template <typename T>
+    class Reader {
+    private:
+      using ty = types<T>;
+      const char* _base;
+      size_t _size;
+
+      template <typename U>
+      U value (size_t off) const {
+        if constexpr (is_string<U>) {
+          auto len = get<uint64_t>(off);
+          check(off + 8, len);
+          return std::string(_base + off + 8, len);
+        } else if constexpr (flat<U>) {
+          return get<U>(align_up(off, alignof(U)));
+        } else {
+          throw error("serial: atom type is not serializable");
+        }
+      }
+
+      template <typename U>
+      T dense (size_t off) const {
+        auto count = get<uint64_t>(off);
+        if constexpr (is_string<U>) {
+          auto table = off + 8;
+          if (count >= _size / 8) throw error("serial: truncated image");
+          check(table, 8 * (count + 1));
+          auto chars = table + 8 * (count + 1);
+          auto last = get<uint64_t>(table + 8 * count);
+          check(chars, last);
+          auto res = DenseSequence<U>().transient();
+          for (size_t i = 0; i < count; i++) {
+            auto lo = get<uint64_t>(table + 8 * i), hi = get<uint64_t>(table + 8 * (i + 1));
+            if (hi < lo or hi > last) throw error("serial: corrupted string table");
+            res.push_back(std::string(_base + chars + lo, hi - lo));
+          }
+          return std::move(res).persistent();
+        } else if constexpr (flat<U>) {
+          auto data = align_up(off + 8, alignof(U) > 8 ? alignof(U) : 8);
+          if (count > (_size - std::min(_size, data)) / sizeof(U)) throw error("serial: truncated image");
+          // una sola copia dell'array, bit a bit
+          auto res = DenseSequence<U>(count).transient();
+          if (count) std::memcpy(static_cast<void*>(res.data_mut()), _base + data, count * sizeof(U));
+          return std::move(res).persistent();
+        } else {
+          throw error("serial: atom type is not serializable");
+        }
+      }
+
+      template <size_t I = 0>
+      T alternative (uint32_t tag, size_t off) const {
+        if constexpr (I == ty::n) {
+          throw error("serial: unknown tag");
+        } else {
+          using U = atom_t<T, I>;
+          if (tag == 3 + I) return T(value<U>(off));
+          if (tag == ty::dense + I) return dense<U>(off);
+          return alternative<I+1>(tag, off);
+        }
+      }
+
+    public:
+      Reader (const char* base, size_t size) : _base(base), _size(size) {}
+
+      const char* base () const noexcept { return _base; }
+
+      void check (size_t off, size_t len) const {
+        if (off > _size or len > _size - off) throw error("serial: truncated image");
+      }
+
+      template <typename U>
+      U get (size_t off) const {
+        check(off, sizeof(U));
+        U v;
+        std::memcpy(&v, _base + off, sizeof(U));
+        return v;
+      }
+
+      uint32_t tag (size_t off) const {
+        if (off % 8) throw error("serial: misaligned object");
+        return get<uint32_t>(off);
+      }
+
+      // offset dell'elemento i della sequenza di box in off; gli elementi
+      // seguono sempre la sequenza, quindi un'immagine non ha cicli
+      size_t element (size_t off, size_t i) const {
+        auto child = get<uint64_t>(off + 16 + 8 * i);
+        if (child <= off) throw error("serial: invalid element offset");
+        return child;
+      }
+
+      T object (size_t off) const {
+        auto t = tag(off);
+        auto p = off + 8;
+        switch (t) {
+          case 0: return Bottom;
+          case 1: return T(value<bool>(p));
+          case 2: return T(value<size_t>(p));
+          default: break;
+        }
+        if (t == ty::seq) {
+          auto count = get<uint64_t>(p);
+          if (count > _size / 8) throw error("serial: truncated image");
+          check(p + 8, 8 * count);
+          auto res = Sequence<T>().transient();
+          for (size_t i = 0; i < count; i++) res.push_back(object(element(off, i)));
+          return std::move(res).persistent();
+        }
+        return alternative(t, p);
+      }
+
+      // offset della radice, dopo aver controllato l'intestazione
+      size_t root () const {
+        check(0, header_size);
+        if (std::memcmp(_base, magic, sizeof(magic)) != 0) throw error("serial: not an fpar image");
+        if (get<uint32_t>(4) != version) throw error("serial: unsupported version");
+        if (get<uint32_t>(8) != byte_order) throw error("serial: incompatible byte order");
+        return header_size;
+      }
+    };
+  }
+
+  /*! \brief Immagine binaria di un oggetto
+   *  \param x Oggetto da serializzare
+   *  \return bytes dell'immagine, compresa l'intestazione
+   */
+  template <typename T>
+  inline std::string dump (const T& x) {
+    std::string buf(detail::magic, sizeof(detail::magic));
+    buf.append(reinterpret_cast<const char*>(&detail::version), sizeof(detail::version));
+    buf.append(reinterpret_cast<const char*>(&detail::byte_order), sizeof(detail::byte_order));
+    buf.resize(detail::header_size, '\0');
+    detail::Writer<T>(buf).object(x);
+    buf.resize(detail::align_up(buf.size(), 8), '\0');
+    return buf;
+  }
+
+  /*! \brief Scrive l'immagine di x nel file path */
+  template <typename T>
+  inline void save (const T& x, const std::string& path) {
+    auto buf = dump(x);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(buf.data(), buf.size());
+    if (!out) throw error("serial: cannot write " + path);
+  }
+
+  /*! \brief Ricostruisce un oggetto da un'immagine
+   *  \param data Immagine prodotta da dump o save
+   *  \return l'oggetto; lancia serial::error se l'immagine non è valida
+   */
+  template <typename T>
+  inline T parse (const char* data, size_t size) {
+    detail::Reader<T> r(data, size);
+    return r.object(r.root());
+  }
+
+  template <typename T>
+  inline T parse (const std::string& bytes) {
+    return parse<T>(bytes.data(), bytes.size());
+  }
+
+  /*! \class View
+   *  \brief Oggetto di un'immagine, non deserializzato.
+   *         Gli elementi di una sequenza di box si raggiungono in O(1) e gli
+   *         array delle sequenze dense sono accessibili senza copie. Una View
+   *         resta valida finché lo è l'immagine.
+   */
+  template <typename T>
+  class View {
+  private:
+    using ty = detail::types<T>;
+    detail::Reader<T> _r;
+    size_t _off;
+
+  public:
+    View (detail::Reader<T> r, size_t off) : _r(r), _off(off) {}
+
+    uint32_t tag () const { return _r.tag(_off); }
+
+    bool isBottom () const { return tag() == 0; }
+    bool isSequence () const { return tag() >= ty::seq; }
+    bool isDense () const { return tag() > ty::seq; }
+
+    // numero di elementi della sequenza
+    size_t size () const {
+      if (!isSequence()) throw error("serial: not a sequence");
+      return _r.template get<uint64_t>(_off + 8);
+    }
+
+    /*! \brief Elemento i di una sequenza di box, senza deserializzarlo */
+    View operator[] (size_t i) const {
+      if (tag() != ty::seq) throw error("serial: not a boxed sequence");
+      if (i >= size()) throw std::out_of_range("serial: index out of range");
+      return View(_r, _r.element(_off, i));
+    }
+
+    /*! \brief Array di una sequenza densa di atomi di tipo U
+     *  \return puntatore ai size() elementi nell'immagine, nullptr se
+     *          l'oggetto non è una DenseSequence<U> o l'immagine non è
+     *          allineata (es. un buffer in memoria, non una mappatura)
+     */
+    template <typename U>
+    const U* data () const {
+      if constexpr (detail::flat<U>) {
+        auto t = tag();
+        if (t <= ty::seq or !dense_of<U>(t - ty::dense)) return nullptr;
+        auto p = detail::align_up(_off + 16, alignof(U) > 8 ? alignof(U) : 8);
+        _r.check(p, size() * sizeof(U));
+        auto ptr = _r.base() + p;
+        if (reinterpret_cast<uintptr_t>(ptr) % alignof(U)) return nullptr;
+        return reinterpret_cast<const U*>(ptr);
+      }
+      return nullptr;
+    }
+
+    /*! \brief Deserializza l'oggetto (e i suoi elementi) */
+    T get () const { return _r.object(_off); }
+
+  private:
+    template <typename U, size_t I = 0>
+    static bool dense_of (size_t i) {
+      if constexpr (I == ty::n) {
+        return false;
+      } else {
+        if (i == I) return std::is_same<detail::atom_t<T, I>, U>::value;
+        return dense_of<U, I+1>(i);
+      }
+    }
+  };
+
+  /*! \class Mapped
+   *  \brief Immagine mappata in memoria in sola lettura. Le pagine del file
+   *         vengono caricate dal sistema operativo quando sono lette.
+   */
+  template <typename T>
+  class Mapped {
+  private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+  public:
+    explicit Mapped (const std::string& path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw error("serial: cannot open " + path);
+      struct stat st;
+      if (::fstat(fd, &st) != 0 or st.st_size == 0) {
+        ::close(fd);
+        throw error("serial: cannot read " + path);
+      }
+      _size = static_cast<size_t>(st.st_size);
+      void* p = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) throw error("serial: cannot map " + path);
+      try { // controlla l'intestazione
+        detail::Reader<T>(static_cast<const char*>(p), _size).root();
+      } catch (...) {
+        ::munmap(p, _size);
+        throw;
+      }
+      _data = static_cast<const char*>(p);
+    }
+
+    Mapped (const Mapped&) = delete;
+    Mapped& operator= (const Mapped&) = delete;
+
+    Mapped (Mapped&& o) noexcept : _data(o._data), _size(o._size) {
+      o._data = nullptr;
+      o._size = 0;
+    }
+
+    ~Mapped () {
+      if (_data) ::munmap(const_cast<char*>(_data), _size);
+    }
+
+    const char* data () const noexcept { return _data; }
+    size_t size () const noexcept { return _size; }
+
+    /*! \brief Oggetto radice dell'immagine, non deserializzato */
+    View<T> root () const {
+      detail::Reader<T> r(_data, _size);
+      return View<T>(r, r.root());
+    }
+
+    /*! \brief Deserializza l'oggetto radice */
+    T get () const { return root().get(); }
+  };
+
+  /*! \brief Mappa in memoria l'immagine nel file path */
+  template <typename T>
+  inline Mapped<T> open (const std::string& path) {
+    return Mapped<T>(path);
+  }
+
+  /*! \brief Carica l'oggetto scritto da save nel file path */
+  template <typename T>
+  inline T load (const std::string& path) {
+    return open<T>(path).get();
+  }
+}
+}
+
+#endif
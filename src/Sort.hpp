@@ -0,0 +1,391 @@
+#ifndef SORT_HPP
+#define SORT_HPP
+
+/** \file Sort.hpp
+ * Ordinamento, fusione e filtro di sequenze
+ *  - sort(f): merge sort stabile. Con par = true la sequenza viene divisa in
+ *    blocchi ordinati in parallelo, poi fusi a coppie; ogni fusione è
+ *    divisa a sua volta in pezzi indipendenti, quindi anche gli ultimi
+ *    livelli usano tutti i thread
+ *  - merge(f): fusione stabile di due sequenze ordinate, a pezzi paralleli
+ *  - filter(p) e partition(p): il predicato viene valutato una volta per
+ *    elemento; le sequenze dense vengono compattate con una somma prefissa
+ *    dei conteggi dei blocchi, le altre concatenando i blocchi
+ * f è un confronto "precede" tra due elementi: una funzione su coppie, come
+ * less_op<O, T>, oppure una funzione (const T&, const T&) (vedi
+ * detail::Binary). Se f restituisce qualcosa che non è un bool il risultato
+ * è bottom. Con less_op su una sequenza densa di tipo O l'ordinamento
+ * avviene direttamente sull'array.
+ *
+ *   sort<par_exec, Number>(less_op<int, Number>)(x);
+ *   filter<par_exec, Number>([](const Number& y) -> Number { return (int)y % 2 == 0; })(x);
+ */
+
+#include "Object.hpp"
+#include "Executor.hpp"
+#include "Grain.hpp"
+#include "Builder.hpp"
+#include "Reduce.hpp"
+#include "Functions.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace fpar {
+
+  namespace detail {
+    // elementi minimi per blocco di ordinamento, fusione e compattazione
+    constexpr size_t sort_grain = 1 << 12;
+
+    // con la stima di costo (min_ns > 0) le sequenze sotto sort_grain
+    // elementi vengono ordinate sequenzialmente
+    inline bool sort_parallel (const Cutoff& c, const Executor& ex, size_t n) noexcept {
+      return ex.concurrency() >= 2 and n >= 2 and n >= c.min_elements and
+             (c.min_ns == 0 or n >= 2 * sort_grain);
+    }
+
+    /*! \class Order
+     *  \brief Confronto tra elementi (oggetti, box o puntatori a box) con
+     *         la funzione f; annota se f ha restituito un non bool
+     */
+    template <typename T, typename F>
+    class Order {
+    private:
+      const Binary<T, F> _op;
+      std::atomic<bool>* _invalid;
+
+      template <typename A>
+      static const A& ref (const A& a) noexcept { return a; }
+
+      template <typename A>
+      static const A& ref (const A* a) noexcept { return *a; }
+
+    public:
+      Order (const F& f, std::atomic<bool>& invalid) : _op(f), _invalid(&invalid) {}
+
+      template <typename A, typename B>
+      bool operator() (const A& a, const B& b) const {
+        T r = _op(ref(a), ref(b));
+        if (r.template is<bool>()) return r.template get<bool>();
+        _invalid->store(true, std::memory_order_relaxed);
+        return false;
+      }
+    };
+
+    /*! \brief Fusione stabile di [a0, a1) e [b0, b1) in out.
+     *         Con par = true viene divisa in pieces fusioni indipendenti:
+     *         il pezzo i inizia dall'elemento a0 + |a|*i/pieces e dai primi
+     *         elementi di b che non lo precedono.
+     */
+    template <bool par, typename It, typename Out, typename L>
+    inline void merge_ranges (It a0, It a1, It b0, It b1, Out out, const L& less, size_t pieces) {
+      size_t na = a1 - a0;
+      if constexpr (par) {
+        if (pieces > na) pieces = na;
+        if (pieces >= 2) {
+          auto ya = std::vector<It>(pieces + 1), yb = std::vector<It>(pieces + 1);
+          for (size_t i = 0; i <= pieces; i++) {
+            ya[i] = a0 + na*i/pieces;
+            yb[i] = i == 0 ? b0 : i == pieces ? b1 : std::lower_bound(b0, b1, *ya[i], less);
+          }
+          parallel_for(current_executor(), pieces, [&](size_t i) {
+            std::merge(ya[i], ya[i+1], yb[i], yb[i+1], out + (ya[i] - a0) + (yb[i] - b0), less);
+          });
+          return;
+        }
+      }
+      std::merge(a0, a1, b0, b1, out, less);
+    }
+
+    /*! \brief Merge sort stabile di v
+     *  \param par se true blocchi ordinati e fusi in parallelo
+     */
+    template <bool par, typename E, typename L>
+    inline void merge_sort (std::vector<E>& v, const L& less, const Cutoff& cutoff) {
+      auto n = v.size();
+      if constexpr (par) {
+        auto& ex = current_executor();
+        if (sort_parallel(cutoff, ex, n)) {
+          auto k = std::min(4 * ex.concurrency(), std::max(n / sort_grain, size_t(2)));
+          if (k > n) k = n;
+          auto bounds = std::vector<size_t>(k + 1);
+          for (size_t c = 0; c <= k; c++) bounds[c] = n*c/k;
+          parallel_for(ex, k, [&](size_t c) {
+            std::stable_sort(v.begin() + bounds[c], v.begin() + bounds[c+1], less);
+          });
+          // fusione a coppie di blocchi adiacenti, fino ad un solo blocco
+          auto buf = v;
+          for (size_t width = 1; width < k; width *= 2) {
+            auto pairs = (k + 2*width - 1) / (2*width);
+            auto pieces = std::max(k / pairs, size_t(1));
+            parallel_for(ex, pairs, [&](size_t p) {
+              auto lo = bounds[2*width*p];
+              auto mid = bounds[std::min(2*width*p + width, k)];
+              auto hi = bounds[std::min(2*width*(p+1), k)];
+              merge_ranges<par>(v.begin() + lo, v.begin() + mid, v.begin() + mid, v.begin() + hi,
+                                buf.begin() + lo, less, pieces);
+            });
+            std::swap(v, buf);
+          }
+          return;
+        }
+      }
+      std::stable_sort(v.begin(), v.end(), less);
+    }
+
+    // puntatori ai box di una sequenza, validi finché la sequenza esiste
+    template <typename T>
+    inline auto box_pointers (const Sequence<T>& s) {
+      auto res = std::vector<const Box<T>*>();
+      res.reserve(s.size());
+      for (const auto& el : s) res.push_back(&el);
+      return res;
+    }
+
+    /*! \brief Sequenza dei box puntati da ptrs
+     *  \param dense se true il risultato è denso se possibile (vedi Object::pack)
+     */
+    template <bool par, typename T>
+    inline T from_pointers (const std::vector<const Box<T>*>& ptrs, bool dense) {
+      if (dense) {
+        auto els = std::vector<T>();
+        els.reserve(ptrs.size());
+        for (auto p : ptrs) els.push_back(p->get());
+        return T::pack(els);
+      }
+      return build_blocks<par, T>(ptrs.size(), sort_grain, [&](size_t lo, size_t hi) {
+        auto res = Sequence<T>().transient();
+        for (size_t i = lo; i < hi; i++) res.push_back(*ptrs[i]);
+        return std::move(res).persistent();
+      }, Cutoff::elements(2 * sort_grain));
+    }
+
+    /*! \brief Ordinamento diretto di una sequenza densa con less_op
+     *  \return nullopt se f non è less_op<O, T>
+     */
+    template <bool par, typename T, typename O, typename F>
+    inline std::optional<T> sort_dense (const F& f, const DenseSequence<O>& d, const Cutoff& cutoff) {
+      if constexpr (std::is_convertible<F, T(*)(const T&)>::value and std::is_pointer<F>::value and
+                    ordered<O>::value) {
+        T (*fp)(const T&) = f;
+        if (fp != &less_op<O, T>) return std::nullopt;
+        auto v = std::vector<O>(d.begin(), d.end());
+        merge_sort<par>(v, std::less<O>(), cutoff);
+        return T(DenseSequence<O>(v.begin(), v.end()));
+      }
+      return std::nullopt;
+    }
+  }
+
+  /*! \brief Ordinamento stabile
+   *  \param f Confronto: f(<y, z>) (o f(y, z)) è true se y precede z
+   *  \param par se true merge sort parallelo
+   *  \param cutoff Soglia sotto cui si esegue sequenzialmente (vedi Grain.hpp)
+   *  \return <x1, ..., xN> -> la permutazione ordinata di x; bottom se f
+   *          restituisce un valore che non è un bool
+   */
+  template <bool par, typename T, typename F>
+  inline auto sort (F f, Cutoff cutoff = Cutoff()) {
+    return [=](const T& x) -> T {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("sort", detail::seq_size(x));
+      if (x.isDense()) {
+        auto res = x.visit_dense([&](const auto& d) {
+          return detail::sort_dense<par, T>(f, d, cutoff);
+        });
+        if (res) return *res;
+      }
+      const detail::boxed_ref<T> s(x);
+      auto ptrs = detail::box_pointers(*s);
+      std::atomic<bool> invalid(false);
+      detail::merge_sort<par>(ptrs, detail::Order<T, F>(f, invalid), cutoff);
+      if (invalid.load()) return Bottom;
+      return detail::from_pointers<par, T>(ptrs, x.isDense());
+    };
+  }
+
+  /*! \brief Fusione stabile di sequenze ordinate
+   *  \param f Confronto, come in sort
+   *  \return <<y1, ..., yN>, <z1, ..., zM>> -> sequenza ordinata degli
+   *          elementi di y e z; a parità, quelli di y precedono quelli di z
+   */
+  template <bool par, typename T, typename F>
+  inline auto merge (F f, Cutoff cutoff = Cutoff()) {
+    return [=](const T& x) -> T {
+      if (x.isBottom() or !x.isSequence() or x.isDense()) return Bottom;
+      const auto& s = x.as_sequence();
+      if (s.size() != 2) return Bottom;
+      const T& _y = *s.front();
+      const T& _z = *s.back();
+      if (!_y.isSequence() or !_z.isSequence()) return Bottom;
+      const detail::boxed_ref<T> y(_y), z(_z);
+      auto n = y->size() + z->size();
+      FPAR_TRACE_SPAN("merge", n);
+      auto ys = detail::box_pointers(*y), zs = detail::box_pointers(*z);
+      auto out = std::vector<const Box<T>*>(n);
+      std::atomic<bool> invalid(false);
+      const detail::Order<T, F> less(f, invalid);
+      size_t pieces = 1;
+      if constexpr (par) {
+        auto& ex = current_executor();
+        if (detail::sort_parallel(cutoff, ex, n)) pieces = 4 * ex.concurrency();
+      }
+      detail::merge_ranges<par>(ys.begin(), ys.end(), zs.begin(), zs.end(), out.begin(), less, pieces);
+      if (invalid.load()) return Bottom;
+      // due sequenze dense dello stesso tipo danno una sequenza densa
+      bool dense = _y.isDense() and _z.isDense() and _y.visit_dense([&](const auto& d) {
+        return _z.template is<std::decay_t<decltype(d)>>();
+      });
+      return detail::from_pointers<par, T>(out, dense);
+    };
+  }
+
+  namespace detail {
+    /*! \brief Valuta il predicato p su ogni elemento di x
+     *  \return 1 se p(xi) è true, 0 se è false; nullopt se per qualche
+     *          elemento p non restituisce un bool
+     */
+    template <bool par, typename T, typename P>
+    inline std::optional<std::vector<char>> flags (const P& p, const T& x, const Cutoff& cutoff) {
+      auto n = seq_size(x);
+      auto res = std::vector<char>(n);
+      std::atomic<bool> invalid(false);
+      auto eval = [&](size_t lo, size_t hi) {
+        auto test = [&](size_t i, const T& el) {
+          T r = p(el);
+          if (!r.template is<bool>()) invalid.store(true, std::memory_order_relaxed);
+          else res[i] = r.template get<bool>();
+        };
+        if (x.isDense()) {
+          x.visit_dense([&](const auto& d) {
+            for (size_t i = lo; i < hi; i++) test(i, T(d[i]));
+            return 0;
+          });
+        } else {
+          const auto& s = x.as_sequence();
+          for (size_t i = lo; i < hi; i++) test(i, *s[i]);
+        }
+      };
+      size_t done = 0;
+      if constexpr (par) {
+        auto& ex = current_executor();
+        auto probe = [&]{ eval(0, 1); return size_t(1); };
+        if (worth_parallel(cutoff, ex, n, probe, done)) {
+          auto rest = n - done;
+          auto n_chunks = std::min(4 * ex.concurrency(), rest);
+          parallel_for(ex, n_chunks, [&](size_t c) {
+            eval(done + rest*c/n_chunks, done + rest*(c+1)/n_chunks);
+          });
+          done = n;
+        }
+      }
+      eval(done, n);
+      if (invalid.load()) return std::nullopt;
+      return res;
+    }
+
+    /*! \brief Elementi di x con flag uguale a keep, nello stesso ordine.
+     *         Una sequenza densa viene compattata in un solo array: ogni
+     *         blocco scrive i suoi elementi dalla posizione data dalla somma
+     *         prefissa dei conteggi dei blocchi precedenti.
+     */
+    template <bool par, typename T>
+    inline T compact (const T& x, const std::vector<char>& flags, char keep) {
+      auto n = flags.size();
+      if (x.isDense()) {
+        return x.visit_dense([&](const auto& d) -> T {
+          using dense_t = std::decay_t<decltype(d)>;
+          size_t n_chunks = 1;
+          if constexpr (par) {
+            auto& ex = current_executor();
+            if (ex.concurrency() >= 2 and n >= 2 * sort_grain) {
+              n_chunks = std::min(4 * ex.concurrency(), n / sort_grain);
+            }
+          }
+          auto counts = std::vector<size_t>(n_chunks + 1, 0);
+          auto count = [&](size_t c) {
+            for (size_t i = n*c/n_chunks; i < n*(c+1)/n_chunks; i++) counts[c+1] += (flags[i] == keep);
+          };
+          if constexpr (par) {
+            if (n_chunks > 1) parallel_for(current_executor(), n_chunks, count);
+            else count(0);
+          } else {
+            count(0);
+          }
+          for (size_t c = 0; c < n_chunks; c++) counts[c+1] += counts[c];
+          if constexpr (std::is_trivially_copyable<typename dense_t::value_type>::value) {
+            auto res = dense_t(counts[n_chunks]).transient();
+            auto* out = res.data_mut();
+            auto write = [&](size_t c) {
+              auto pos = counts[c];
+              for (size_t i = n*c/n_chunks; i < n*(c+1)/n_chunks; i++) {
+                if (flags[i] == keep) out[pos++] = d[i];
+              }
+            };
+            if constexpr (par) {
+              if (n_chunks > 1) parallel_for(current_executor(), n_chunks, write);
+              else write(0);
+            } else {
+              write(0);
+            }
+            return std::move(res).persistent();
+          } else {
+            auto res = dense_t().transient();
+            for (size_t i = 0; i < n; i++) {
+              if (flags[i] == keep) res.push_back(d[i]);
+            }
+            return std::move(res).persistent();
+          }
+        });
+      }
+      const auto& s = x.as_sequence();
+      return build_blocks<par, T>(n, sort_grain, [&](size_t lo, size_t hi) {
+        auto res = Sequence<T>().transient();
+        for (size_t i = lo; i < hi; i++) {
+          if (flags[i] == keep) res.push_back(s[i]);
+        }
+        return std::move(res).persistent();
+      }, Cutoff::elements(2 * sort_grain));
+    }
+  }
+
+  /*! \brief Filtro
+   *  \param p Predicato, restituisce un bool
+   *  \return <x1, ..., xN> -> gli xi per cui p(xi) è true, nello stesso
+   *          ordine; bottom se p restituisce un valore che non è un bool
+   */
+  template <bool par, typename T, typename P>
+  inline auto filter (P p, Cutoff cutoff = Cutoff()) {
+    return [=](const T& x) -> T {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("filter", detail::seq_size(x));
+      auto fl = detail::flags<par>(p, x, cutoff);
+      if (!fl) return Bottom;
+      return detail::compact<par>(x, *fl, 1);
+    };
+  }
+
+  /*! \brief Partizione
+   *  \param p Predicato, restituisce un bool
+   *  \return <x1, ..., xN> -> <gli xi per cui p(xi) è true, gli altri>,
+   *          entrambi nello stesso ordine di x; bottom se p restituisce un
+   *          valore che non è un bool
+   */
+  template <bool par, typename T, typename P>
+  inline auto partition (P p, Cutoff cutoff = Cutoff()) {
+    return [=](const T& x) -> T {
+      if (x.isBottom() or !x.isSequence()) return Bottom;
+      FPAR_TRACE_SPAN("partition", detail::seq_size(x));
+      auto fl = detail::flags<par>(p, x, cutoff);
+      if (!fl) return Bottom;
+      return T::pair(detail::compact<par>(x, *fl, 1), detail::compact<par>(x, *fl, 0));
+    };
+  }
+}
+
+#endif
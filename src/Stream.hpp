@@ -0,0 +1,385 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+/** \file Stream.hpp
+ * Sequenze lazy
+ * Uno Stream è una sequenza prodotta a blocchi, su richiesta: un generatore
+ * (o un intervallo, o una sequenza già in memoria) fornisce un blocco alla
+ * volta e ogni stadio della pipeline lo trasforma quando lo stadio
+ * successivo lo richiede. La sequenza completa viene costruita solo dal
+ * consumatore finale (collect) oppure non viene mai costruita (insert),
+ * quindi la memoria usata da una pipeline è limitata a pochi blocchi per
+ * stadio, indipendentemente dalla lunghezza dell'input.
+ *
+ * I blocchi sono sequenze FP (dense se possibile) e vengono elaborati dai
+ * funzionali ordinari: apply_to_all, insert, zip e distl su un blocco sono
+ * gli stessi di Functionals.hpp, con i loro kernel e la loro soglia di
+ * cutoff. Con par = true ogni stadio chiede in anticipo il blocco
+ * successivo allo stadio precedente, come task dell'esecutore corrente:
+ * gli stadi lavorano contemporaneamente su blocchi diversi.
+ *
+ *   auto s = stream::generate<par_exec, Number>(100000000, [](size_t i) { return Number((int)i); });
+ *   auto sum = stream::insert<par_exec>(add_op<int, Number>, Number(0), associative) *
+ *              stream::apply_to_all<par_exec, Number>(f);
+ *   sum(s);
+ *
+ * Uno Stream si può consumare una sola volta: le copie condividono la
+ * posizione di lettura.
+ */
+
+#include "Object.hpp"
+#include "Functions.hpp"
+#include "Functionals.hpp"
+#include "Executor.hpp"
+#include "Trace.hpp"
+
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace fpar {
+
+  namespace detail {
+    // elementi di default di un blocco
+    constexpr size_t stream_chunk = 1 << 14;
+
+    // true se c è un blocco da elaborare (sequenza non vuota)
+    template <typename T>
+    inline bool is_chunk (const T& c) {
+      return c.isSequence() and seq_size(c) > 0;
+    }
+
+    // elementi [lo, hi) di una sequenza, densa o meno
+    template <typename T>
+    inline T slice (const T& x, size_t lo, size_t hi) {
+      if (x.isDense()) {
+        return x.visit_dense([&](const auto& d) -> T {
+          using dense_t = std::decay_t<decltype(d)>;
+          return dense_t(d.begin() + lo, d.begin() + hi);
+        });
+      }
+      return x.as_sequence().drop(lo).take(hi - lo);
+    }
+
+    // concatenazione dei blocchi: densa se lo sono tutti, dello stesso tipo
+    template <typename T>
+    inline T concat_chunks (const std::vector<T>& chunks) {
+      if (chunks.empty()) return Sequence<T>();
+      if (chunks[0].isDense()) {
+        auto res = chunks[0].visit_dense([&](const auto& first) -> std::optional<T> {
+          using dense_t = std::decay_t<decltype(first)>;
+          auto all = first.transient();
+          for (size_t c = 1; c < chunks.size(); c++) {
+            if (!chunks[c].template is<dense_t>()) return std::nullopt;
+            for (const auto& el : chunks[c].template get<dense_t>()) all.push_back(el);
+          }
+          return T(std::move(all).persistent());
+        });
+        if (res) return *res;
+      }
+      Sequence<T> res = chunks[0];
+      for (size_t c = 1; c < chunks.size(); c++) {
+        res = std::move(res) + *detail::boxed_ref<T>(chunks[c]);
+      }
+      return res;
+    }
+  }
+
+  /*! \class Stream
+   *  \brief Sequenza lazy, prodotta un blocco alla volta.
+   *         La sorgente restituisce ad ogni invocazione il blocco successivo:
+   *         una sequenza non vuota, la sequenza vuota a fine stream oppure
+   *         bottom, che termina lo stream e rende bottom il risultato dei
+   *         consumatori.
+   */
+  template <typename T>
+  class Stream {
+  public:
+    using source_t = std::function<T()>;
+
+  private:
+    struct State {
+      source_t source;
+      bool done = false;
+      T last; // sequenza vuota o bottom, dopo la fine
+    };
+
+    std::shared_ptr<State> _state;
+
+  public:
+    explicit Stream (source_t source) : _state(std::make_shared<State>()) {
+      _state->source = std::move(source);
+    }
+
+    /*! \brief Blocco successivo
+     *  \return sequenza non vuota; dopo la fine sempre la sequenza vuota,
+     *          oppure bottom se lo stream è terminato con un errore
+     */
+    T next () {
+      if (_state->done) return _state->last;
+      T c = _state->source();
+      if (detail::is_chunk(c)) return c;
+      _state->done = true;
+      _state->source = nullptr; // rilascia gli stadi precedenti
+      _state->last = c.isSequence() ? T(Sequence<T>()) : T(Bottom);
+      return _state->last;
+    }
+
+    /*! \brief Consuma lo stream e costruisce la sequenza
+     *  \return <x1, ..., xN>, bottom se lo stream è terminato con un errore
+     */
+    T collect () {
+      std::vector<T> chunks;
+      T c;
+      while (detail::is_chunk(c = next())) chunks.push_back(c);
+      if (c.isBottom()) return Bottom;
+      return detail::concat_chunks(chunks);
+    }
+  };
+
+  namespace detail {
+
+    /*! \class Puller
+     *  \brief Legge i blocchi di uno stream. Con par = true il blocco
+     *         successivo viene calcolato in anticipo, come task
+     *         dell'esecutore corrente, mentre il chiamante elabora quello
+     *         restituito.
+     */
+    template <bool par, typename T>
+    class Puller {
+    private:
+      Stream<T> _s;
+      std::optional<Task<T>> _next;
+
+    public:
+      explicit Puller (Stream<T> s) : _s(std::move(s)) {}
+
+      T operator() () {
+        if constexpr (par) {
+          T c = _next ? _next->get() : _s.next();
+          _next.reset();
+          if (is_chunk(c)) _next.emplace(current_executor(), [s = _s]() mutable { return s.next(); });
+          return c;
+        } else {
+          return _s.next();
+        }
+      }
+    };
+
+    // sorgente di uno stadio che legge da s e trasforma ogni blocco con f
+    template <bool par, typename T, typename F>
+    inline Stream<T> stage (Stream<T> s, F f) {
+      auto pull = std::make_shared<Puller<par, T>>(std::move(s));
+      return Stream<T>([=]() -> T {
+        T c = (*pull)();
+        if (!is_chunk(c)) return c;
+        return f(c);
+      });
+    }
+
+    template <bool par, typename Tag, typename T, typename F>
+    inline auto stream_insert (F f, const T& n, Cutoff cutoff) {
+      // senza proprietà dichiarate ogni blocco prosegue la riduzione da
+      // sinistra del precedente, quindi viene ridotto sequenzialmente
+      constexpr bool chunk_par = par and !std::is_same<Tag, void>::value;
+      return [=](Stream<T> s) -> T {
+        Puller<par, T> pull(std::move(s));
+        T acc = n;
+        T c;
+        bool empty = true;
+        while (is_chunk(c = pull())) {
+          FPAR_TRACE_SPAN("stream_insert", seq_size(c));
+          acc = Insert<chunk_par, T, F, Tag>{f, acc, {}, cutoff}(c);
+          empty = false;
+        }
+        if (c.isBottom() or empty) return Bottom;
+        return acc;
+      };
+    }
+  }
+
+  namespace stream {
+
+    /*! \brief Stream degli elementi di una sequenza
+     *  \param x Sequenza <x1, ..., xN>, densa o meno
+     *  \param chunk Elementi per blocco
+     *  \return stream x1, ..., xN; bottom se x non è una sequenza
+     */
+    template <typename T>
+    inline Stream<T> from (const T& x, size_t chunk = detail::stream_chunk) {
+      if (chunk == 0) chunk = 1;
+      auto pos = std::make_shared<size_t>(0);
+      return Stream<T>([=]() -> T {
+        if (!x.isSequence()) return Bottom;
+        auto n = detail::seq_size(x);
+        if (*pos >= n) return Sequence<T>();
+        auto lo = *pos;
+        *pos = std::min(n, lo + chunk);
+        return detail::slice(x, lo, *pos);
+      });
+    }
+
+    /*! \brief Stream degli elementi di un intervallo [first, last)
+     *  \param chunk Elementi per blocco
+     *  \return stream T(*first), ..., T(*(last-1)); l'intervallo deve
+     *          restare valido finché lo stream viene letto
+     */
+    template <typename T, typename It>
+    inline Stream<T> from_range (It first, It last, size_t chunk = detail::stream_chunk) {
+      if (chunk == 0) chunk = 1;
+      auto it = std::make_shared<It>(first);
+      return Stream<T>([=]() -> T {
+        auto els = std::vector<T>();
+        els.reserve(chunk);
+        for (; *it != last and els.size() < chunk; ++*it) els.push_back(T(**it));
+        return T::pack(els);
+      });
+    }
+
+    /*! \brief Stream prodotto da un generatore
+     *  \param gen Invocato senza argomenti, restituisce std::optional<T>:
+     *         il prossimo elemento oppure nullopt a fine stream
+     *  \param chunk Elementi per blocco
+     */
+    template <typename T, typename G>
+    inline Stream<T> from_generator (G gen, size_t chunk = detail::stream_chunk) {
+      if (chunk == 0) chunk = 1;
+      auto g = std::make_shared<G>(std::move(gen));
+      return Stream<T>([=]() -> T {
+        auto els = std::vector<T>();
+        els.reserve(chunk);
+        while (els.size() < chunk) {
+          std::optional<T> el = (*g)();
+          if (!el) break;
+          els.push_back(std::move(*el));
+        }
+        return T::pack(els);
+      });
+    }
+
+    /*! \brief Stream di N elementi calcolati dal loro indice
+     *  \param g Generatore, invocato con l'indice (tra 0 e N-1) dell'elemento
+     *  \param par se true gli elementi di un blocco sono calcolati in
+     *         parallelo (vedi build_packed)
+     *  \param chunk Elementi per blocco
+     *  \return stream g(0), g(1), ..., g(N-1)
+     */
+    template <bool par, typename T, typename G>
+    inline Stream<T> generate (size_t n, G g, size_t chunk = detail::stream_chunk,
+                               Cutoff cutoff = Cutoff()) {
+      if (chunk == 0) chunk = 1;
+      auto pos = std::make_shared<size_t>(0);
+      return Stream<T>([=]() -> T {
+        if (*pos >= n) return Sequence<T>();
+        auto lo = *pos;
+        *pos = std::min(n, lo + chunk);
+        return build_packed<par, T>(*pos - lo, [&](size_t i) { return g(lo + i); }, cutoff);
+      });
+    }
+
+    /*! \brief Operazione di "map" su uno stream
+     *  \param par se true ogni blocco è elaborato come da apply_to_all<par> e
+     *         il blocco successivo viene letto in anticipo
+     *  \return x1, x2, ... -> f(x1), f(x2), ...
+     */
+    template <bool par, typename T, typename F>
+    inline auto apply_to_all (F f, Cutoff cutoff = Cutoff()) {
+      return [=](Stream<T> s) -> Stream<T> {
+        return detail::stage<par>(std::move(s), [m = Map<par, T, F>{f, cutoff}](const T& c) {
+          FPAR_TRACE_SPAN("stream_apply_to_all", detail::seq_size(c));
+          return m(c);
+        });
+      };
+    }
+
+    /*! \brief Operazione di "fold" su uno stream
+     *  \param par se true i blocchi sono ridotti come da insert<par> (solo
+     *         per operazioni associative) e il blocco successivo viene letto
+     *         in anticipo
+     *  \return x1, ..., xN -> f(n, f(x1, ...)), bottom se lo stream è vuoto
+     */
+    template <bool par, typename T, typename F>
+    inline auto insert (F f, const T& n, Cutoff cutoff = Cutoff()) {
+      return detail::stream_insert<par, void>(f, n, cutoff);
+    }
+
+    template <bool par, typename T, typename F>
+    inline auto insert (F f, const T& n, associative_t, Cutoff cutoff = Cutoff()) {
+      return detail::stream_insert<par, associative_t>(f, n, cutoff);
+    }
+
+    template <bool par, typename T, typename F>
+    inline auto insert (F f, const T& n, commutative_t, Cutoff cutoff = Cutoff()) {
+      return detail::stream_insert<par, commutative_t>(f, n, cutoff);
+    }
+
+    /*! \brief Operazione di "zip" su due stream
+     *  \param par se true ogni blocco è elaborato come da zip<par> e i
+     *         blocchi successivi vengono letti in anticipo
+     *  \return (x1, ..., xN), (y1, ..., yN) -> f(<x1, y1>), ..., f(<xN, yN>);
+     *          lo stream termina con bottom se le lunghezze sono diverse
+     */
+    template <bool par, typename T, typename F>
+    inline auto zip (F f, Cutoff cutoff = Cutoff()) {
+      return [=](Stream<T> xs, Stream<T> ys) -> Stream<T> {
+        struct State {
+          detail::Puller<par, T> px, py;
+          T bx, by; // elementi letti e non ancora usati
+        };
+        auto st = std::make_shared<State>(State{detail::Puller<par, T>(std::move(xs)),
+                                                detail::Puller<par, T>(std::move(ys)),
+                                                Sequence<T>(), Sequence<T>()});
+        auto z = fpar::zip<par, T>(f, cutoff);
+        return Stream<T>([=]() -> T {
+          if (!detail::is_chunk(st->bx)) st->bx = st->px();
+          if (!detail::is_chunk(st->by)) st->by = st->py();
+          bool cx = detail::is_chunk(st->bx), cy = detail::is_chunk(st->by);
+          if (st->bx.isBottom() or st->by.isBottom() or cx != cy) return Bottom;
+          if (!cx) return Sequence<T>();
+          // i blocchi dei due stream possono avere dimensioni diverse
+          auto nx = detail::seq_size(st->bx), ny = detail::seq_size(st->by);
+          auto k = std::min(nx, ny);
+          T x = detail::slice(st->bx, 0, k);
+          T y = detail::slice(st->by, 0, k);
+          st->bx = detail::slice(st->bx, k, nx);
+          st->by = detail::slice(st->by, k, ny);
+          FPAR_TRACE_SPAN("stream_zip", k);
+          return z(T::pair(x, y));
+        });
+      };
+    }
+
+    /*! \brief Distribuzione di un oggetto in uno stream
+     *  \return y, (z1, ..., zN) -> <y,z1>, ..., <y,zN>
+     */
+    template <bool par, typename T>
+    inline Stream<T> distl (const T& y, Stream<T> zs) {
+      return detail::stage<par>(std::move(zs), [=](const T& c) {
+        return fpar::distl<par, T>(T::pair(y, c));
+      });
+    }
+
+    /*! \brief Distribuzione di un oggetto in uno stream
+     *  \return (y1, ..., yN), z -> <y1,z>, ..., <yN,z>
+     */
+    template <bool par, typename T>
+    inline Stream<T> distr (Stream<T> ys, const T& z) {
+      return detail::stage<par>(std::move(ys), [=](const T& c) {
+        return fpar::distr<par, T>(T::pair(c, z));
+      });
+    }
+
+    /*! \brief Consumatore finale: costruisce la sequenza
+     *  \return x1, ..., xN -> <x1, ..., xN>
+     */
+    template <typename T>
+    inline T collect (Stream<T> s) {
+      return s.collect();
+    }
+  }
+}
+
+#endif
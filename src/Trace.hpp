@@ -0,0 +1,244 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+/** \file Trace.hpp
+ * Strumentazione dei funzionali
+ * Se la libreria è compilata con -DFPAR_TRACE ogni invocazione di un
+ * funzionale (e delle primitive parallele) registra un evento con nome,
+ * dimensione dell'input, istante di inizio, durata, thread e numero di
+ * allocazioni. Anche ogni task eseguito dal pool registra un evento "task",
+ * come la parte di un parallel_for eseguita dal thread chiamante e la stima
+ * del costo di un funzionale (vedi worth_parallel): l'unione degli
+ * intervalli dei task di un thread è il suo tempo "busy".
+ * Gli eventi possono essere esportati nel formato JSON di Chrome trace
+ * (chrome://tracing, ui.perfetto.dev), dove le chiamate annidate, es.
+ * apply_to_all -> insert, appaiono come intervalli annidati, oppure
+ * riassunti per nome.
+ * Senza FPAR_TRACE le macro di questo file non generano codice.
+ *
+ * Il conteggio delle allocazioni richiede che un solo file del programma
+ * contenga FPAR_TRACE_COUNT_ALLOCATIONS(), che ridefinisce operator new.
+ */
+
+#ifdef FPAR_TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace fpar {
+namespace trace {
+
+  struct Event {
+    const char* name;
+    size_t size;        // dimensione dell'input
+    uint64_t start_ns;  // dall'inizio del programma
+    uint64_t dur_ns;
+    uint64_t allocs;    // allocazioni del thread durante l'evento
+    size_t tid;
+  };
+
+  /*! \class Summary
+   *  \brief Statistiche degli eventi con lo stesso nome
+   */
+  struct Summary {
+    size_t count = 0;
+    size_t total_size = 0;
+    uint64_t total_ns = 0;
+    uint64_t allocs = 0;
+  };
+
+  namespace detail {
+    // eventi di un thread; sopravvive al thread fino all'export
+    struct Buffer {
+      std::mutex m;
+      size_t tid;
+      std::vector<Event> events;
+    };
+
+    struct Registry {
+      std::mutex m;
+      std::vector<std::shared_ptr<Buffer>> buffers;
+    };
+
+    inline Registry& registry () {
+      static Registry r;
+      return r;
+    }
+
+    inline Buffer& buffer () {
+      static thread_local std::shared_ptr<Buffer> buf = []{
+        auto b = std::make_shared<Buffer>();
+        auto& r = registry();
+        std::lock_guard<std::mutex> lk(r.m);
+        b->tid = r.buffers.size();
+        r.buffers.push_back(b);
+        return b;
+      }();
+      return *buf;
+    }
+
+    inline uint64_t now_ns () {
+      using clock = std::chrono::steady_clock;
+      static const auto epoch = clock::now();
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count();
+    }
+
+    // allocazioni del thread corrente (vedi FPAR_TRACE_COUNT_ALLOCATIONS)
+    inline uint64_t& allocations () noexcept {
+      static thread_local uint64_t n = 0;
+      return n;
+    }
+  }
+
+  /*! \class Span
+   *  \brief Registra un evento della durata dello scope
+   */
+  class Span {
+  private:
+    const char* _name;
+    size_t _size;
+    uint64_t _start;
+    uint64_t _allocs;
+
+  public:
+    Span (const char* name, size_t size)
+      : _name(name), _size(size), _start(detail::now_ns()), _allocs(detail::allocations()) {}
+
+    Span (const Span&) = delete;
+    Span& operator= (const Span&) = delete;
+
+    ~Span () {
+      auto stop = detail::now_ns();
+      auto& buf = detail::buffer();
+      std::lock_guard<std::mutex> lk(buf.m);
+      buf.events.push_back({_name, _size, _start, stop - _start,
+                            detail::allocations() - _allocs, buf.tid});
+    }
+  };
+
+  /*! \brief Tutti gli eventi registrati, di tutti i thread */
+  inline std::vector<Event> events () {
+    std::vector<Event> res;
+    auto& r = detail::registry();
+    std::lock_guard<std::mutex> lk(r.m);
+    for (auto& b : r.buffers) {
+      std::lock_guard<std::mutex> blk(b->m);
+      res.insert(res.end(), b->events.begin(), b->events.end());
+    }
+    return res;
+  }
+
+  /*! \brief Scarta gli eventi registrati */
+  inline void reset () {
+    auto& r = detail::registry();
+    std::lock_guard<std::mutex> lk(r.m);
+    for (auto& b : r.buffers) {
+      std::lock_guard<std::mutex> blk(b->m);
+      b->events.clear();
+    }
+  }
+
+  /*! \brief Statistiche per nome: invocazioni, dimensione degli input,
+   *         tempo totale e allocazioni
+   */
+  inline std::map<std::string, Summary> summary () {
+    std::map<std::string, Summary> res;
+    for (const auto& e : events()) {
+      auto& s = res[e.name];
+      s.count++;
+      s.total_size += e.size;
+      s.total_ns += e.dur_ns;
+      s.allocs += e.allocs;
+    }
+    return res;
+  }
+
+  /*! \brief Tempo passato da ogni thread ad eseguire task del pool
+   *  \return tid -> ns
+   */
+  inline std::map<size_t, uint64_t> busy_time () {
+    // i task annidati (es. eseguiti da TaskGroup::wait dentro un task) sono
+    // contenuti in quello esterno: si somma l'unione degli intervalli
+    std::map<size_t, std::vector<std::pair<uint64_t, uint64_t>>> spans;
+    for (const auto& e : events()) {
+      if (std::string(e.name) == "task") spans[e.tid].emplace_back(e.start_ns, e.start_ns + e.dur_ns);
+    }
+    std::map<size_t, uint64_t> res;
+    for (auto& ts : spans) {
+      auto& v = ts.second;
+      std::sort(v.begin(), v.end());
+      uint64_t total = 0, end = 0;
+      for (const auto& iv : v) {
+        if (iv.second <= end) continue;
+        total += iv.second - std::max(iv.first, end);
+        end = iv.second;
+      }
+      res[ts.first] = total;
+    }
+    return res;
+  }
+
+  /*! \brief Esporta gli eventi nel formato JSON di Chrome trace / Perfetto.
+   *         Va chiamata quando non ci sono computazioni in corso.
+   */
+  inline void write_chrome_json (std::ostream& out) {
+    auto evs = events();
+    out << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < evs.size(); i++) {
+      const auto& e = evs[i];
+      out << "{\"name\":\"" << e.name << "\",\"cat\":\"fpar\",\"ph\":\"X\",\"pid\":0"
+          << ",\"tid\":" << e.tid
+          << ",\"ts\":" << e.start_ns / 1000.0
+          << ",\"dur\":" << e.dur_ns / 1000.0
+          << ",\"args\":{\"size\":" << e.size << ",\"allocs\":" << e.allocs << "}}"
+          << (i + 1 < evs.size() ? ",\n" : "\n");
+    }
+    out << "],\"displayTimeUnit\":\"ns\"}\n";
+  }
+}
+}
+
+#define FPAR_TRACE_CONCAT_(a, b) a##b
+#define FPAR_TRACE_CONCAT(a, b) FPAR_TRACE_CONCAT_(a, b)
+
+// registra l'evento "name" per il resto dello scope; size viene calcolato
+// solo se la strumentazione è attiva
+#define FPAR_TRACE_SPAN(name, size) \
+  ::fpar::trace::Span FPAR_TRACE_CONCAT(_fpar_span_, __LINE__)(name, static_cast<size_t>(size))
+
+// gcc segnala free() su memoria di operator new anche se questo usa malloc()
+#if defined(__GNUC__) and !defined(__clang__)
+#define FPAR_TRACE_DISABLE_MISMATCH_WARNING \
+  _Pragma("GCC diagnostic ignored \"-Wmismatched-new-delete\"")
+#else
+#define FPAR_TRACE_DISABLE_MISMATCH_WARNING
+#endif
+
+// da espandere in un solo file: conta le allocazioni di ogni thread
+#define FPAR_TRACE_COUNT_ALLOCATIONS() \
+  FPAR_TRACE_DISABLE_MISMATCH_WARNING \
+  void* operator new (std::size_t n) { \
+    ::fpar::trace::detail::allocations()++; \
+    if (void* p = std::malloc(n ? n : 1)) return p; \
+    throw std::bad_alloc(); \
+  } \
+  void operator delete (void* p) noexcept { std::free(p); } \
+  void operator delete (void* p, std::size_t) noexcept { std::free(p); }
+
+#else
+
+#define FPAR_TRACE_SPAN(name, size) ((void)0)
+#define FPAR_TRACE_COUNT_ALLOCATIONS()
+
+#endif
+
+#endif
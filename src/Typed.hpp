@@ -0,0 +1,301 @@
+#ifndef TYPED_HPP
+#define TYPED_HPP
+
+/** \file Typed.hpp
+ * Funzioni con forma statica
+ * Le primitive controllano ad ogni invocazione che l'argomento sia del tipo
+ * atteso (bottom, sequenza, coppia, atomo di tipo O): in un apply_to_all o
+ * in un insert il controllo viene ripetuto per ogni elemento e per ogni
+ * funzione composta. Una funzione tipata dichiara a tempo di compilazione la
+ * forma dei suoi argomenti e dei suoi risultati, es.
+ *   shape::seq<shape::pair<shape::atom<int>, shape::atom<int>>>
+ * (sequenza di coppie di int), ed ha una versione senza controlli valida
+ * per gli argomenti di quella forma. Componendo funzioni tipate le cui forme
+ * coincidono si ottiene una funzione tipata: la forma dell'argomento viene
+ * verificata una sola volta, all'ingresso, e tutti gli stadi interni usano
+ * le versioni senza controlli. Se la verifica fallisce si usa la funzione
+ * ordinaria, quindi il risultato è sempre quello dei funzionali non tipati.
+ *
+ *   auto ip = typed::insert<par_exec>(typed::add_op<int, Number>(), Number(0), associative) *
+ *             typed::apply_to_all<par_exec, Number>(typed::mul_op<int, Number>());
+ *   ip(pairs);           // verifica la forma di pairs una volta
+ *   ip.unchecked(pairs); // nessuna verifica: pairs deve avere la forma dichiarata
+ */
+
+#include "Object.hpp"
+#include "Functions.hpp"
+#include "Functionals.hpp"
+
+#include <functional>
+#include <type_traits>
+
+namespace fpar {
+
+  /*
+    Forme statiche degli oggetti. la sequenza vuota ha qualsiasi forma
+    seq<S>; bottom ha solo la forma any.
+  */
+  namespace shape {
+    struct any {};
+
+    template <typename O>
+    struct atom {};
+
+    template <typename S>
+    struct seq {};
+
+    template <typename A, typename B>
+    struct pair {};
+  }
+
+  namespace detail {
+    // un atomo di tipo U (es. elemento di una sequenza densa) ha forma S
+    template <typename S, typename U>
+    constexpr bool atom_conforms = false;
+
+    template <typename U>
+    constexpr bool atom_conforms<shape::any, U> = true;
+
+    template <typename U>
+    constexpr bool atom_conforms<shape::atom<U>, U> = true;
+
+    template <typename S>
+    struct conforms;
+
+    template <>
+    struct conforms<shape::any> {
+      template <typename T>
+      static bool check (const T&) { return true; }
+    };
+
+    template <typename O>
+    struct conforms<shape::atom<O>> {
+      template <typename T>
+      static bool check (const T& x) { return x.template is<O>(); }
+    };
+
+    template <typename S>
+    struct conforms<shape::seq<S>> {
+      template <typename T>
+      static bool check (const T& x) {
+        if (!x.isSequence()) return false;
+        if (x.isDense()) {
+          return x.visit_dense([](const auto& d) {
+            return d.size() == 0 or atom_conforms<S, typename std::decay_t<decltype(d)>::value_type>;
+          });
+        }
+        if constexpr (!std::is_same<S, shape::any>::value) {
+          for (const auto& el : x.as_sequence()) {
+            if (!conforms<S>::check(*el)) return false;
+          }
+        }
+        return true;
+      }
+    };
+
+    template <typename A, typename B>
+    struct conforms<shape::pair<A, B>> {
+      template <typename T>
+      static bool check (const T& x) {
+        if (!x.isSequence()) return false;
+        if (x.isDense()) {
+          return x.visit_dense([](const auto& d) {
+            using U = typename std::decay_t<decltype(d)>::value_type;
+            return d.size() == 2 and atom_conforms<A, U> and atom_conforms<B, U>;
+          });
+        }
+        const auto& s = x.as_sequence();
+        return s.size() == 2 and conforms<A>::check(*s[0]) and conforms<B>::check(*s[1]);
+      }
+    };
+  }
+
+  /*! \brief Verifica la forma di un oggetto
+   *  \return true se x ha forma S
+   */
+  template <typename S, typename T>
+  inline bool conforms (const T& x) {
+    return detail::conforms<S>::check(x);
+  }
+
+  /*! \class Typed
+   *  \brief Funzione con forma statica In -> Out.
+   *         f è la funzione ordinaria, u la stessa funzione senza controlli:
+   *         per ogni x di forma In, u(x) == f(x) e il risultato ha forma Out.
+   */
+  template <typename T, typename In, typename Out, typename F, typename U>
+  struct Typed {
+    using in_shape = In;
+    using out_shape = Out;
+
+    F f;
+    U u;
+
+    T operator() (const T& x) const {
+      if (conforms<In>(x)) return u(x);
+      return f(x);
+    }
+
+    /*! \brief Applicazione senza controlli: x deve avere forma In */
+    T unchecked (const T& x) const {
+      return u(x);
+    }
+  };
+
+  /*! \brief Composizione di funzioni tipate
+   *  \return se la forma dei risultati di g è quella degli argomenti di f,
+   *          la funzione tipata (g.In -> f.Out) che verifica solo la forma
+   *          dell'argomento di g; altrimenti la composizione ordinaria
+   */
+  template <typename T, typename A, typename B, typename C, typename D,
+            typename F1, typename U1, typename F2, typename U2>
+  inline auto operator*(Typed<T, C, D, F1, U1> f, Typed<T, A, B, F2, U2> g) {
+    if constexpr (std::is_same<B, C>::value) {
+      return Typed<T, A, D, Composed<F1, F2>, Composed<U1, U2>>{{f.f, g.f}, {f.u, g.u}};
+    } else {
+      return Composed<Typed<T, C, D, F1, U1>, Typed<T, A, B, F2, U2>>{f, g};
+    }
+  }
+
+  namespace detail {
+    /*! \class UncheckedBinary
+     *  \brief op applicata ad una coppia di atomi di tipo O, densa o di box,
+     *         oppure ai due atomi (vedi detail::Binary)
+     */
+    template <typename O, typename T, typename Op>
+    struct UncheckedBinary {
+      Op op;
+
+      T operator() (const T& x) const {
+        if (x.isDense()) {
+          const auto& d = x.template unchecked<DenseSequence<O>>();
+          return T(op(d[0], d[1]));
+        }
+        const auto& s = x.template unchecked<Sequence<T>>();
+        return (*this)(*s[0], *s[1]);
+      }
+
+      T operator() (const T& a, const T& b) const {
+        return T(op(a.template unchecked<O>(), b.template unchecked<O>()));
+      }
+    };
+
+    template <typename F>
+    struct shapes {
+      using in = typename F::in_shape;
+      using out = typename F::out_shape;
+    };
+  }
+
+  namespace typed {
+
+    /*! \brief Funzione tipata
+     *  \param f Funzione ordinaria
+     *  \param u Versione di f senza controlli, per argomenti di forma In
+     */
+    template <typename T, typename In, typename Out, typename F, typename U>
+    inline auto function (F f, U u) {
+      return Typed<T, In, Out, F, U>{f, u};
+    }
+
+    template <typename O>
+    using atom_pair = shape::pair<shape::atom<O>, shape::atom<O>>;
+
+    /*! \brief add_op<O> tipata: <O, O> -> O */
+    template <typename O, typename T>
+    inline auto add_op () {
+      return function<T, atom_pair<O>, shape::atom<O>>(&fpar::add_op<O, T>,
+        detail::UncheckedBinary<O, T, std::plus<O>>{});
+    }
+
+    /*! \brief sub_op<O> tipata: <O, O> -> O */
+    template <typename O, typename T>
+    inline auto sub_op () {
+      return function<T, atom_pair<O>, shape::atom<O>>(&fpar::sub_op<O, T>,
+        detail::UncheckedBinary<O, T, std::minus<O>>{});
+    }
+
+    /*! \brief mul_op<O> tipata: <O, O> -> O */
+    template <typename O, typename T>
+    inline auto mul_op () {
+      return function<T, atom_pair<O>, shape::atom<O>>(&fpar::mul_op<O, T>,
+        detail::UncheckedBinary<O, T, std::multiplies<O>>{});
+    }
+
+    /*! \brief equals<O> tipata: <O, O> -> bool */
+    template <typename O, typename T>
+    inline auto equals () {
+      return function<T, atom_pair<O>, shape::atom<bool>>(&fpar::equals<O, T>,
+        detail::UncheckedBinary<O, T, std::equal_to<O>>{});
+    }
+
+    /*! \brief apply_to_all tipata: seq<In> -> seq<Out>
+     *  \param f Funzione tipata In -> Out, applicata senza controlli
+     *         agli elementi se la sequenza ha la forma dichiarata
+     */
+    template <bool par, typename T, typename F>
+    inline auto apply_to_all (F f, Cutoff cutoff = Cutoff()) {
+      using s = detail::shapes<F>;
+      return function<T, shape::seq<typename s::in>, shape::seq<typename s::out>>(
+        Map<par, T, F>{f, cutoff}, Map<par, T, decltype(f.u)>{f.u, cutoff});
+    }
+
+    /*! \brief insert tipata: seq<A> -> A, oppure bottom se la sequenza è vuota
+     *  \param f Funzione tipata <A, A> -> A
+     *  \param n Elemento neutro; se non ha forma A si usa sempre insert
+     */
+    template <bool par, typename T, typename F, typename Tag = void>
+    inline auto insert (F f, const T& n, Tag = Tag(), Cutoff cutoff = Cutoff()) {
+      using s = detail::shapes<F>;
+      using A = typename s::out;
+      static_assert(std::is_same<typename s::in, shape::pair<A, A>>::value,
+                    "typed::insert requires a function <A, A> -> A");
+      auto checked = Insert<par, T, F, Tag>{f, n, {}, cutoff};
+      auto unchecked = Insert<par, T, decltype(f.u), Tag>{f.u, n, {}, cutoff};
+      bool n_ok = conforms<A>(n);
+      return function<T, shape::seq<A>, shape::any>(checked, [=](const T& x) -> T {
+        return n_ok ? unchecked(x) : checked(x);
+      });
+    }
+
+    // zip tipata con la forma <A, B> degli argomenti di f esplicita
+    template <bool par, typename T, typename F, typename A, typename B>
+    inline auto zip_of (F f, shape::pair<A, B>, Cutoff cutoff) {
+      return function<T, shape::pair<shape::seq<A>, shape::seq<B>>, shape::any>(
+        fpar::zip<par, T>(f, cutoff), fpar::zip<par, T>(f.u, cutoff));
+    }
+
+    /*! \brief zip tipata: <seq<A>, seq<B>> -> seq, bottom se le lunghezze
+     *         sono diverse
+     *  \param f Funzione tipata <A, B> -> C
+     */
+    template <bool par, typename T, typename F>
+    inline auto zip (F f, Cutoff cutoff = Cutoff()) {
+      using s = detail::shapes<F>;
+      return zip_of<par, T>(f, typename s::in(), cutoff);
+    }
+
+    /*! \brief distl tipata: <A, seq<B>> -> seq<<A, B>> */
+    template <bool par, typename T, typename A, typename B>
+    inline auto distl () {
+      return function<T, shape::pair<A, shape::seq<B>>, shape::seq<shape::pair<A, B>>>(
+        &fpar::distl<par, T>, &fpar::distl<par, T>);
+    }
+
+    /*! \brief distr tipata: <seq<A>, B> -> seq<<A, B>> */
+    template <bool par, typename T, typename A, typename B>
+    inline auto distr () {
+      return function<T, shape::pair<shape::seq<A>, B>, shape::seq<shape::pair<A, B>>>(
+        &fpar::distr<par, T>, &fpar::distr<par, T>);
+    }
+
+    /*! \brief trans tipata: seq<seq<A>> -> seq<seq<A>> */
+    template <bool par, typename T, typename A>
+    inline auto trans () {
+      return function<T, shape::seq<shape::seq<A>>, shape::seq<shape::seq<A>>>(
+        &fpar::trans<par, T>, &fpar::trans<par, T>);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,148 @@
+#include "fpar.hpp"
+#include "Graph.hpp"
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+using namespace fpar;
+
+using Number = Object<int, double>;
+
+/*
+  Controlli delle riscritture di graph::compile e di batch_eval: ogni
+  programma compilato deve dare lo stesso risultato dei funzionali di
+  Functionals.hpp. Il programma termina con un codice diverso da 0 e stampa
+  la riga del controllo fallito se un'ottimizzazione cambia un risultato.
+*/
+
+static int failures = 0;
+
+#define CHECK(...) do { \
+    if (!(__VA_ARGS__)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #__VA_ARGS__ << std::endl; failures++; } \
+  } while (0)
+
+static Number vec (int n, int off) {
+  auto w = Sequence<Number>();
+  for (int j = 0; j < n; j++) w = std::move(w).push_back(Number(j * 3 + off));
+  return dense<int>(Number(w));
+}
+
+static Number mat (int n, int off) {
+  auto v = Sequence<Number>();
+  for (int i = 0; i < n; i++) v = std::move(v).push_back(Number(vec(n, i + off)));
+  return v;
+}
+
+static Number pair (const Number& a, const Number& b) {
+  return Sequence<Number>({a, b});
+}
+
+// prodotto interno e prodotto di matrici scritti con i funzionali
+static Number IP (const Number& x) {
+  return (insert<seq_exec>(add_op<int, Number>, Number(0), associative) *
+          (apply_to_all<seq_exec, Number>(mul_op<int, Number>) * trans<Number>))(x);
+}
+
+static Number select1 (const Number& x) { return select<Number>(1)(x); }
+static Number trans2 (const Number& x) { return trans<Number>(select<Number>(2)(x)); }
+
+static Number MM (const Number& x) {
+  return (apply_to_all<seq_exec, Number>(apply_to_all<seq_exec, Number>(IP)) *
+          (apply_to_all<seq_exec, Number>(distl<seq_exec, Number>) *
+           (distr<seq_exec, Number> * construct<seq_exec, Number>({select1, trans2}))))(x);
+}
+
+static std::atomic<int> calls{0};
+
+int main(int argc, char const *argv[]) {
+  auto S = [](unsigned i) { return graph::select<Number>(i); };
+  auto ip = graph::insert<Number>(add_op<int, Number>, Number(0), associative) *
+            graph::apply_to_all(graph::prim<Number>(mul_op<int, Number>)) * graph::trans<Number>();
+  auto mm = graph::apply_to_all(graph::apply_to_all(ip) * graph::distl<Number>()) * graph::distr<Number>() *
+            graph::construct<Number>({S(1), graph::trans<Number>() * S(2)});
+  Number in = pair(mat(20, 0), mat(20, 1));
+  Number ref = MM(in);
+
+  // insert * apply_to_all fuso, insert * trans ridotto per colonne
+  CHECK(graph::to_string(graph::compile(ip).expr()) == "insert(prim) * trans");
+  CHECK(graph::compile(ip)(pair(vec(50, 0), vec(50, 1))) == IP(pair(vec(50, 0), vec(50, 1))));
+  for (auto cutoff : {Cutoff(), Cutoff::always()}) {
+    CHECK(graph::compile(mm, cutoff)(in) == ref);
+  }
+
+  // trans * select(2), invariante dentro apply_to_all, calcolato una volta
+  auto inv = graph::apply_to_all(graph::apply_to_all(ip) * graph::distl<Number>() *
+                                 graph::construct<Number>({S(1), graph::trans<Number>() * S(2)})) *
+             graph::distr<Number>() * graph::construct<Number>({S(1), S(2)});
+  auto pinv = graph::compile(inv);
+  CHECK(pinv.memoized() >= 1);
+  CHECK(pinv(in) == ref);
+  auto count = graph::prim<Number>(std::function<Number(const Number&)>([](const Number& x) -> Number {
+    calls++;
+    return length<Number>(x);
+  }), "count");
+  auto counted = graph::compile(graph::apply_to_all(count * S(2)) * graph::distr<Number>());
+  Number lengths = counted(pair(mat(30, 0), mat(4, 0)));
+  CHECK((size_t)length(lengths) == 30 and (size_t)select<Number>(7)(lengths) == 4);
+  CHECK(calls == 1);
+
+  // hash consing: i sotto-termini uguali diventano lo stesso nodo
+  auto inc = graph::prim<Number>(std::function<Number(const Number&)>([](const Number& x) -> Number {
+    return (int)x + 1;
+  }), "inc");
+  auto sum0 = [] { return graph::insert<Number>(add_op<int, Number>, Number(0), associative); };
+  auto shared = graph::compile(graph::construct<Number>({
+    graph::apply_to_all(inc) * graph::apply_to_all(inc), graph::apply_to_all(inc) * graph::apply_to_all(inc),
+    sum0(), sum0(),
+    graph::prim<Number>(add_op<int, Number>), graph::prim<Number>(add_op<int, Number>),
+    graph::insert<Number>(add_op<int, Number>, Number(1), associative)}));
+  const auto& kids = shared.expr().node().kids;
+  CHECK(kids[0] == kids[1] and kids[2] == kids[3] and kids[4] == kids[5]);
+  CHECK(kids[2] != kids[6]);
+  CHECK(graph::to_string(graph::Expr<Number>(kids[0])) == "apply_to_all(inc * inc)");
+  Number v = dense<int>(Number(Sequence<Number>({Number(1), Number(2)})));
+  Number ref_shared = Sequence<Number>({
+    apply_to_all<seq_exec, Number>([](const Number& x) -> Number { return (int)x + 2; })(v),
+    apply_to_all<seq_exec, Number>([](const Number& x) -> Number { return (int)x + 2; })(v),
+    Number(3), Number(3), Number(3), Number(3), Number(4)});
+  CHECK(shared(v) == ref_shared);
+  // primitive anonime: mai uguali
+  auto anon = [] {
+    return graph::prim<Number>(std::function<Number(const Number&)>([](const Number& x) { return x; }));
+  };
+  CHECK(graph::compile(graph::construct<Number>({anon(), anon()})).expr().node().kids[0] !=
+        graph::compile(graph::construct<Number>({anon(), anon()})).expr().node().kids[1]);
+
+  // batch_eval: stessi risultati di apply_to_all del programma
+  auto mul = graph::prim<Number>(mul_op<int, Number>);
+  auto poly = graph::prim<Number>(add_op<int, Number>) *
+              graph::construct<Number>({mul * graph::construct<Number>({S(1), S(2)}), S(2)});
+  auto consts = graph::construct<Number>({graph::constant<Number>(Number(7)),
+                                          graph::insert<Number>(add_op<int, Number>, Number(0)) * S(1)});
+  auto vectors = std::vector<Number>(), atoms = std::vector<Number>(), mats = std::vector<Number>();
+  for (int i = 0; i < 500; i++) vectors.push_back(pair(vec(8, i), vec(8, i + 1)));
+  for (int i = 0; i < 500; i++) atoms.push_back(pair(Number(i), Number(i % 7)));
+  for (int i = 0; i < 10; i++) mats.push_back(pair(mat(5, i), mat(5, i + 2)));
+  Number xs = Number::pack(vectors), as = Number::pack(atoms), ms = Number::pack(mats);
+  Number mixed = Sequence<Number>({xs.as_sequence()[0], Box<Number>(Number(3)), Box<Number>(Number(Bottom)),
+                                   Box<Number>(Number(Sequence<Number>()))});
+  for (auto cutoff : {Cutoff(), Cutoff::always()}) {
+    auto pip = graph::compile(ip, cutoff), ppoly = graph::compile(poly, cutoff);
+    CHECK(graph::batch_eval(pip, xs) == apply_to_all<seq_exec, Number>(IP)(xs));
+    CHECK(graph::batch_eval(ppoly, as) == apply_to_all<seq_exec, Number>(ppoly)(as));
+    CHECK(graph::batch_eval(ppoly, as).isDense());
+    CHECK(graph::batch_eval(graph::compile(mm, cutoff), ms) == apply_to_all<seq_exec, Number>(MM)(ms));
+    for (const auto& e : {ip, poly, consts, mm}) {
+      auto p = graph::compile(e, cutoff);
+      CHECK(graph::batch_eval(p, xs) == apply_to_all<seq_exec, Number>(p)(xs));
+      CHECK(graph::batch_eval(p, mixed) == apply_to_all<seq_exec, Number>(p)(mixed));
+      CHECK((size_t)length(graph::batch_eval(p, Number(Sequence<Number>()))) == 0);
+      CHECK(graph::batch_eval(p, Number(4)).isBottom());
+    }
+  }
+
+  if (failures == 0) std::cout << "All checks passed" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
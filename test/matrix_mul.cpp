@@ -12,29 +12,30 @@ inline Number select1 (const Number& x) {
   return select<Number>(1)(x);
 }
 
+template <bool par>
 inline Number select2AndTrans (const Number& x) {
-  return trans(select<Number>(2)(x));
+  return trans<par>(select<Number>(2)(x));
 }
 
 template <bool par>
 inline Number IP (const Number& x) {
   auto mul = mul_op<int, Number>;
   auto add = add_op<int, Number>;
-  return (insert<par>(add, Number(0)) *
+  return (insert<par>(add, Number(0), associative) *
             (apply_to_all<par, Number>(mul) * trans<Number>))(x);
 }
 
 template <bool par>
 inline Number MM (const Number& x) {
 
-  auto aIP = [=](const Number& y) {
-    return apply_to_all<par, Number>(IP<par>)(y);
-  };
+  // apply_to_all(aIP) * apply_to_all(distl) * distr viene fuso: le
+  // sequenze di coppie prodotte da distl e distr non vengono costruite
+  auto aIP = apply_to_all<par, Number>(IP<par>);
 
   return (apply_to_all<par, Number>(aIP) *
             (apply_to_all<par, Number>(distl<par, Number>) *
               (distr<par, Number> *
-                construct<par, Number>({select1, select2AndTrans}))))(x);
+                construct<par, Number>({select1, select2AndTrans<par>}))))(x);
 }
 
 int main(int argc, char const *argv[]) {
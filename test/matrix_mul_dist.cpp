@@ -0,0 +1,82 @@
+#include "fpar.hpp"
+#include "Distributed.hpp"
+#include <iostream>
+#include <chrono>
+
+using namespace fpar;
+
+// istanzio il type system con il supporto per int e double
+using Number = Object<int, double>;
+
+inline Number select1 (const Number& x) {
+  return select<Number>(1)(x);
+}
+
+template <bool par>
+inline Number select2AndTrans (const Number& x) {
+  return trans<par>(select<Number>(2)(x));
+}
+
+template <bool par>
+inline Number IP (const Number& x) {
+  auto mul = mul_op<int, Number>;
+  auto add = add_op<int, Number>;
+  return (insert<par>(add, Number(0), associative) *
+            (apply_to_all<par, Number>(mul) * trans<Number>))(x);
+}
+
+// MM con le righe del risultato distribuite tra i processi
+template <bool par>
+inline Number MM (const Number& x) {
+
+  auto aIP = [=](const Number& y) {
+    return apply_to_all<par, Number>(IP<par>)(y);
+  };
+
+  return (dist::apply_to_all<par, Number>(aIP) *
+            (apply_to_all<par, Number>(dist::distl<par, Number>) *
+              (dist::distr<par, Number> *
+                construct<par, Number>({select1, select2AndTrans<par>}))))(x);
+}
+
+int main(int argc, char *argv[]) {
+
+  dist::Environment env(argc, argv);
+  dist::Communicator world;
+
+  // costruisco l'input sul processo 0 e lo replico
+  auto v = Sequence<Number>();
+  if (world.rank() == 0) {
+    for(size_t i = 0; i < 100; i++) {
+      auto w = Sequence<Number>();
+      for(size_t j = 0; j < 100; j++) {
+        std::move(w).push_back((int)(i+j));
+      }
+      std::move(v).push_back(w);
+    }
+  }
+  Number in = dist::broadcast(Number(Sequence<Number>({v,v})));
+
+  auto t_i = std::chrono::high_resolution_clock::now();
+  auto dr = MM<par_exec>(in);
+  auto t_f = std::chrono::high_resolution_clock::now();
+
+  // somma di tutti gli elementi, ridotta tra i processi
+  auto sum = dist::insert<par_exec>(add_op<int, Number>, Number(0), associative) *
+               dist::apply_to_all<par_exec, Number>(
+                 insert<par_exec>(add_op<int, Number>, Number(0), associative));
+
+  auto total = sum(dr);
+  // stesso risultato con i blocchi calcolati sequenzialmente
+  auto sr = MM<seq_exec>(in);
+
+  if (world.rank() == 0) {
+    int elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(t_f-t_i).count();
+    std::cout << "Processes: " << world.size() << std::endl;
+    std::cout << "Distributed runtime: " << elapsed << " ms" << std::endl;
+    std::cout << "Sum of the result: " << (int)total << std::endl;
+    std::cout << "Sequential blocks: " << (dr == sr ? "equal" : "different") << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include "fpar.hpp"
+#include "Numa.hpp"
+#include <iostream>
+#include <chrono>
+
+using namespace fpar;
+
+// istanzio il type system con il supporto per int e double
+using Number = Object<int, double>;
+
+inline Number select1 (const Number& x) {
+  return select<Number>(1)(x);
+}
+
+template <bool par>
+inline Number select2AndTrans (const Number& x) {
+  return trans<par>(select<Number>(2)(x));
+}
+
+template <bool par>
+inline Number IP (const Number& x) {
+  auto mul = mul_op<int, Number>;
+  auto add = add_op<int, Number>;
+  return (insert<par>(add, Number(0), associative) *
+            (apply_to_all<par, Number>(mul) * trans<Number>))(x);
+}
+
+template <bool par>
+inline Number MM (const Number& x) {
+  auto aIP = apply_to_all<par, Number>(IP<par>);
+
+  return (apply_to_all<par, Number>(aIP) *
+            (apply_to_all<par, Number>(distl<par, Number>) *
+              (distr<par, Number> *
+                construct<par, Number>({select1, select2AndTrans<par>}))))(x);
+}
+
+// FPAR_THREADS=8 FPAR_PIN=1 ./matrix_mul_numa, oppure ./matrix_mul_numa 8
+int main(int argc, char const *argv[]) {
+
+  auto cfg = numa::Config::from_env();
+  if (argc > 1) cfg.threads = atoi(argv[1]);
+  auto topo = numa::topology();
+  auto pool = std::make_shared<numa::Pool>(cfg, topo);
+  set_default_executor(pool);
+
+  // costruisco l'input con righe dense, nella memoria dei worker che le usano
+  auto v = Sequence<Number>();
+  for(size_t i = 0; i < 100; i++) {
+    auto w = Sequence<Number>();
+    for(size_t j = 0; j < 100; j++) {
+      std::move(w).push_back((int)(i+j));
+    }
+    std::move(v).push_back(dense<int>(Number(w)));
+  }
+  Number rows = numa::place<Number>(Number(v), *pool);
+  Number in = Sequence<Number>({rows, rows});
+
+  auto t_i = std::chrono::high_resolution_clock::now();
+  auto pr = MM<par_exec>(in);
+  auto t_f = std::chrono::high_resolution_clock::now();
+  auto sr = MM<seq_exec>(in);
+
+  int elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(t_f-t_i).count();
+  std::cout << "NUMA nodes: " << topo.nodes() << ", threads: " << pool->concurrency() << std::endl;
+  std::cout << "Parallel runtime: " << elapsed << " ms" << std::endl;
+  std::cout << "Sequential result: " << (pr == sr ? "equal" : "different") << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include "fpar.hpp"
+#include "Offload.hpp"
+#include <iostream>
+#include <chrono>
+
+using namespace fpar;
+
+// istanzio il type system con il supporto per int e double
+using Number = Object<int, double>;
+
+inline Number select1 (const Number& x) {
+  return select<Number>(1)(x);
+}
+
+inline Number select2AndTrans (const Number& x) {
+  return trans<par_exec>(select<Number>(2)(x));
+}
+
+inline Number IP (const Number& x) {
+  auto mul = mul_op<int, Number>;
+  auto add = add_op<int, Number>;
+  return (insert<par_exec>(add, Number(0), associative) *
+            (apply_to_all<par_exec, Number>(mul) * trans<Number>))(x);
+}
+
+inline Number MM (const Number& x) {
+
+  auto aIP = [=](const Number& y) {
+    return apply_to_all<par_exec, Number>(IP)(y);
+  };
+
+  return (apply_to_all<par_exec, Number>(aIP) *
+            (apply_to_all<par_exec, Number>(distl<par_exec, Number>) *
+              (distr<par_exec, Number> *
+                construct<par_exec, Number>({select1, select2AndTrans}))))(x);
+}
+
+int main(int argc, char const *argv[]) {
+
+  // costruisco l'input: righe dense
+  auto v = Sequence<Number>();
+  for(size_t i = 0; i < 200; i++) {
+    auto w = DenseSequence<int>().transient();
+    for(size_t j = 0; j < 200; j++) {
+      w.push_back((int)(i+j));
+    }
+    std::move(v).push_back(Number(std::move(w).persistent()));
+  }
+  Number in = Sequence<Number>({v,v});
+
+  auto cpu_t_i = std::chrono::high_resolution_clock::now();
+  auto cr = MM(in);
+  auto cpu_t_f = std::chrono::high_resolution_clock::now();
+
+  // le matrici vengono copiate sul dispositivo una volta; MM, la somma
+  // delle righe e la somma delle righe di MM + MM restano sul dispositivo
+  auto dev_t_i = std::chrono::high_resolution_clock::now();
+  auto a = offload::upload<int>(select1(in));
+  auto b = offload::upload<int>(select<Number>(2)(in));
+  auto c = offload::mm(a, b);
+  auto rows = offload::insert(add_op<int, Number>, Number(0),
+                              offload::zip<Number>(add_op<int, Number>, c, c));
+  auto dr = offload::download<Number>(c);
+  auto sums = offload::download_flat<Number>(rows);
+  auto dev_t_f = std::chrono::high_resolution_clock::now();
+
+  int cpu_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+                    (cpu_t_f-cpu_t_i).count();
+  int dev_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+                    (dev_t_f-dev_t_i).count();
+
+  std::cout << "Device: " << (offload::available() ? "accelerator" : "host fallback") << std::endl;
+  std::cout << "CPU runtime: " << cpu_elapsed << " ms" << std::endl;
+  std::cout << "Offload runtime: " << dev_elapsed << " ms" << std::endl;
+  std::cout << "Same result: " << (dr == cr ? "yes" : "no") << std::endl;
+  std::cout << "First row sum of 2MM: " << (int)select<Number>(1)(sums) << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+#include "fpar.hpp"
+#include "Serialize.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace fpar;
+
+using Number = Object<int, double>;
+using Text = Object<std::string>;
+
+// atomo più grande di una sequenza di box: memorizzato fuori linea
+struct Wide {
+  double v[8];
+
+  friend bool operator== (const Wide& a, const Wide& b) {
+    return std::equal(a.v, a.v + 8, b.v);
+  }
+};
+
+static_assert(sizeof(Wide) > FPAR_INLINE_SIZE);
+static_assert(sizeof(Object<int, Wide>) == sizeof(Object<int>),
+              "a large atom must not widen the object");
+
+/*
+  Casi limite già corretti: il programma termina con un codice diverso da 0
+  e stampa la riga del controllo fallito se uno di essi si ripresenta.
+*/
+
+static int failures = 0;
+
+// true se parse lancia serial::error
+template <typename T = Number>
+static bool rejected (const std::string& image) {
+  try {
+    serial::parse<T>(image);
+  } catch (const serial::error&) {
+    return true;
+  }
+  return false;
+}
+
+template <bool par, typename T, typename F>
+constexpr bool parallel (const Map<par, T, F>&) { return par; }
+
+template <bool par, typename T, typename F, typename Tag, typename G>
+constexpr bool parallel (const Insert<par, T, F, Tag, G>&) { return par; }
+
+#define CHECK(...) do { \
+    if (!(__VA_ARGS__)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #__VA_ARGS__ << std::endl; failures++; } \
+  } while (0)
+
+int main(int argc, char const *argv[]) {
+  // riduzione di una sequenza densa vuota: bottom, come per la sequenza di box
+  Number empty = dense<int>(Number(Sequence<Number>()));
+  Number one = dense<int>(Number(Sequence<Number>({Number(5)})));
+  CHECK(insert<seq_exec>(add_op<int, Number>, Number(0))(Number(Sequence<Number>())).isBottom());
+  CHECK(insert<seq_exec>(add_op<int, Number>, Number(0))(empty).isBottom());
+  CHECK(insert<par_exec>(add_op<int, Number>, Number(0))(empty).isBottom());
+  CHECK(insert<par_exec>(add_op<int, Number>, Number(0), associative)(empty).isBottom());
+  CHECK(insert<seq_exec>(add_op<int, Number>, Number(0))(tail<Number>(one)).isBottom());
+
+  // apply_to_all parallelo: blocchi densi e di box, concatenati
+  auto v = Sequence<Number>();
+  for (int i = 0; i < 1000; i++) v = std::move(v).push_back(Number(i));
+  auto half = [](const Number& x) -> Number {
+    if ((int)x < 500) return (int)x + 1;
+    return Sequence<Number>({x});
+  };
+  auto inc = [](const Number& x) -> Number { return (int)x + 1; };
+  Number mixed = apply_to_all<par_exec, Number>(half, Cutoff::always())(Number(v));
+  CHECK(mixed == apply_to_all<seq_exec, Number>(half)(Number(v)));
+  CHECK(!mixed.isDense() and (size_t)length(mixed) == 1000);
+  Number incs = apply_to_all<par_exec, Number>(inc, Cutoff::always())(Number(v));
+  CHECK(incs.isDense() and incs == apply_to_all<seq_exec, Number>(inc)(Number(v)));
+
+  // la fusione di uno stadio seq_exec con uno par_exec è sequenziale
+  CHECK(!parallel(apply_to_all<seq_exec, Number>(inc) * apply_to_all<par_exec, Number>(inc)));
+  CHECK(!parallel(apply_to_all<par_exec, Number>(inc) * apply_to_all<seq_exec, Number>(inc)));
+  CHECK(parallel(apply_to_all<par_exec, Number>(inc) * apply_to_all<par_exec, Number>(inc)));
+  CHECK(!parallel(insert<par_exec>(add_op<int, Number>, Number(0)) * apply_to_all<seq_exec, Number>(inc)));
+
+  // immagini con un elemento che punta alla sequenza stessa o indietro
+  auto image = serial::dump(Number(Sequence<Number>({Number(1), Number(2)})));
+  auto root = serial::detail::header_size;
+  CHECK(serial::parse<Number>(image) == Number(Sequence<Number>({Number(1), Number(2)})));
+  for (uint64_t off : {uint64_t(root), uint64_t(0)}) {
+    auto bad = image;
+    std::memcpy(&bad[root + 16], &off, sizeof(off));
+    CHECK(rejected(bad));
+  }
+
+  // tabella di stringhe con un offset intermedio oltre l'ultimo
+  Text words = dense<std::string>(Text(Sequence<Text>({Text(std::string("ab")), Text(std::string("cd"))})));
+  auto strings = serial::dump(words);
+  CHECK(serial::parse<Text>(strings) == words);
+  uint64_t far = 100000;
+  std::memcpy(&strings[root + 24], &far, sizeof(far));
+  CHECK(rejected<Text>(strings));
+
+  // l'atomo fuori linea è condiviso dalle copie
+  Wide w{};
+  w.v[7] = 3;
+  Object<int, Wide> big(w), copy = big;
+  CHECK(copy == big and copy.get<Wide>().v[7] == 3 and &copy.get<Wide>() == &big.get<Wide>());
+
+  // guardia di una ricorsione: con un solo thread non si speculano i rami
+  std::function<Number(const Number&)> fact;
+  fact = condition<par_exec, Number>([](const Number& x) -> Number { return (int)x <= 0; },
+                                     [](const Number&) -> Number { return 1; },
+                                     [&](const Number& x) -> Number { return (int)x * (int)fact((int)x - 1); });
+  {
+    InlineExecutor inline_ex;
+    ExecutorScope scope(inline_ex);
+    CHECK((int)fact(Number(5)) == 120);
+  }
+  {
+    WorkStealingPool pool(4);
+    ExecutorScope scope(pool);
+    CHECK((int)fact(Number(5)) == 120);
+  }
+
+  // con affinità anche la prima parte va al suo worker, non al chiamante
+  {
+    WorkStealingPool pool(4, nullptr, true);
+    auto who = std::vector<std::thread::id>(4);
+    parallel_for(pool, 4, [&](size_t i) { who[i] = std::this_thread::get_id(); });
+    CHECK(std::count(who.begin(), who.end(), std::this_thread::get_id()) == 0);
+  }
+
+  if (failures == 0) std::cout << "All checks passed" << std::endl;
+  return failures == 0 ? 0 : 1;
+}